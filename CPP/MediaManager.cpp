@@ -1,91 +1,1129 @@
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
 #include "MediaManager.h"
 
-// Create Photo
+// Records of the mutation log: the kind of mutation, the name of the object or group, then
+// the other fields of the mutation
+enum Mutation : uint8_t
+{
+    CreateObject = 1, // type, file, latitude, longitude, duree
+    CreateGroupe,
+    RemoveObject,
+    RemoveGroupe,
+    MovePhoto, // latitude, longitude
+    ChangeDuree // duree
+};
+
+template <typename T>
+static void putValue(std::string &record, T value)
+{
+    record.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void putText(std::string &record, std::string_view text)
+{
+    putValue(record, uint32_t(text.size()));
+    record.append(text);
+}
+
+static std::string mutation(Mutation kind, std::string_view name)
+{
+    std::string record(1, char(kind));
+    putText(record, name);
+    return record;
+}
+
+// Photos are placed in the GeoIndex, which has no position for NaN or infinite coordinates
+static bool validPosition(double lat, double lon)
+{
+    return std::isfinite(lat) && std::isfinite(lon);
+}
+
+// Fields of a record, _ok_ becomes false if the record is too short
+struct MutationReader
+{
+    std::string_view data;
+    bool ok = true;
+
+    template <typename T>
+    T value()
+    {
+        T v{};
+        if (data.size() < sizeof(T))
+            ok = false;
+        else
+        {
+            memcpy(&v, data.data(), sizeof(T));
+            data.remove_prefix(sizeof(T));
+        }
+        return v;
+    }
+
+    std::string_view text()
+    {
+        uint32_t size = value<uint32_t>();
+        if (!ok || data.size() < size)
+        {
+            ok = false;
+            return {};
+        }
+        std::string_view t = data.substr(0, size);
+        data.remove_prefix(size);
+        return t;
+    }
+};
+
+// Empty catalog (each stripe has its own empty maps)
+MediaManager::MediaManager()
+{
+    Catalog *c = new Catalog;
+    for (size_t i = 0; i < StripeCount; ++i)
+    {
+        c->objects[i] = std::make_shared<const ObjectMap>();
+        c->groups[i] = std::make_shared<const GroupeMap>();
+    }
+    catalog.store(c);
+}
+
+// No reader or writer can be running anymore, the objects that outlive the catalog are detached
+MediaManager::~MediaManager()
+{
+    log.reset(); // the buffered mutations are written, the compaction is over
+    const Catalog *c = catalog.load();
+    for (auto &objects : c->objects)
+    {
+        objects->forEach([](std::string_view, const Item &item)
+                         { attach(item.object.get(), nullptr); });
+    }
+    for (auto &file : files)
+        file->forEachBuilt([](MultimediaObject *obj)
+                           { attach(obj, nullptr); });
+    delete c;
+}
+
+// Set the catalog that must be notified when the indexed attributes of the object change
+void MediaManager::attach(MultimediaObject *obj, MediaManager *manager)
+{
+    if (auto *p = dynamic_cast<Photo *>(obj))
+        p->manager = manager;
+    else if (auto *v = dynamic_cast<Video *>(obj))
+        v->manager = manager;
+}
+
+// Object of an item, which is built the first time if it comes from a file
+MultimediaPtr MediaManager::resolve(const Catalog &c, const Item &item) const
+{
+    if (!item.record)
+        return item.object;
+    const CatalogFile &file = *c.file;
+    return file.object(item.record - 1, [&]
+                       {
+                           // the record was checked when the item was found
+                           CatalogFile::Object o;
+                           file.objectAt(item.record - 1, o);
+                           MultimediaPtr obj = build(o);
+                           // not attached if the file was replaced meanwhile (see load())
+                           if (catalog.load()->file.get() == &file)
+                               attach(obj.get(), const_cast<MediaManager *>(this));
+                           return obj;
+                       });
+}
+
+// Object of an item if it exists (nullptr if it was not built from its record yet)
+const MultimediaObject *MediaManager::peek(const Catalog &c, const Item &item)
+{
+    return item.record ? c.file->built(item.record - 1).get() : item.object.get();
+}
+
+// Item of a name in a version: its object if the name was created, replaced or removed since
+// the file was loaded, its record in the file otherwise (false if there is no such object)
+bool MediaManager::lookup(const Catalog &c, std::string_view name, size_t h, Item &item)
+{
+    if (const Item *found = c.objects[stripe(h)]->find(name, h))
+    {
+        item = *found;
+        return item.object != nullptr;
+    }
+    uint32_t k;
+    if (!c.file || !c.file->find(name, k))
+        return false;
+    item = Item{nullptr, k + 1};
+    return true;
+}
+
+// Call f(name, item) for each object of a version: the records of the file that were neither
+// replaced nor removed (in the order of the file), then the objects of the stripes
+template <typename F>
+void MediaManager::forEachItem(const Catalog &c, F f)
+{
+    for (uint32_t k = 0; c.file && k < c.file->objectCount(); ++k)
+    {
+        CatalogFile::Object o;
+        uint32_t found;
+        if (!c.file->objectAt(k, o) || o.detached || !c.file->find(o.name, found) || found != k)
+            continue;
+        size_t h = ObjectMap::hash(o.name);
+        if (!c.objects[stripe(h)]->find(o.name, h))
+            f(o.name, Item{nullptr, k + 1});
+    }
+    for (auto &objects : c.objects)
+    {
+        objects->forEach([&](std::string_view name, const Item &item)
+                         {
+                             if (item.object)
+                                 f(name, item);
+                         });
+    }
+}
+
+// Name of an item in the secondary indexes: the name of its record if it comes from a file
+// (which is kept), otherwise its key in its stripe (the stripe must be locked)
+std::string_view MediaManager::indexedName(const Catalog &c, const Item &item, std::string_view name) const
+{
+    if (!item.record)
+        return stripes[stripe(ObjectMap::hash(name))].names.find(name);
+    CatalogFile::Object o;
+    c.file->objectAt(item.record - 1, o);
+    return o.name;
+}
+
+// Object allocated by make(): allocate_shared needs a public constructor, the constructors
+// of the objects are protected
+template <typename T>
+struct Pooled final : T
+{
+    template <typename... Args>
+    Pooled(Args &&...args) : T(std::forward<Args>(args)...) {}
+};
+
+// Create an object and its control block in a single block of a pool
+template <typename T, typename... Args>
+std::shared_ptr<T> MediaManager::make(const std::shared_ptr<ObjectPool> &pool, Args &&...args)
+{
+    return std::allocate_shared<Pooled<T>>(PoolAllocator<Pooled<T>>(pool), std::forward<Args>(args)...);
+}
+
+// Build an object from its record
+MultimediaPtr MediaManager::build(const CatalogFile::Object &o) const
+{
+    std::string name(o.name), file(o.file);
+    switch (o.type)
+    {
+    case CatalogFile::PhotoType:
+        return make<Photo>(photoPool, name, file, o.latitude, o.longitude);
+    case CatalogFile::VideoType:
+        return make<Video>(videoPool, name, file, o.duree);
+    default:
+    {
+        std::shared_ptr<Film> f = make<Film>(filmPool, name, file, o.duree);
+        f->setChapitres(o.chapters, int(o.chapterCount));
+        return f;
+    }
+    }
+}
+
+// Record of an object (false if its type can't be saved)
+bool MediaManager::describe(const MultimediaObject &obj, std::string_view name, CatalogFile::Object &o)
+{
+    o.name = name;
+    o.file = obj.getNomFichier();
+    if (auto *f = dynamic_cast<const Film *>(&obj))
+    {
+        o.type = CatalogFile::FilmType;
+        o.duree = f->Duree;
+        o.chapters = f->getChapitres();
+        o.chapterCount = uint32_t(f->getNbChapitres());
+    }
+    else if (auto *v = dynamic_cast<const Video *>(&obj))
+    {
+        o.type = CatalogFile::VideoType;
+        o.duree = v->Duree;
+    }
+    else if (auto *p = dynamic_cast<const Photo *>(&obj))
+    {
+        o.type = CatalogFile::PhotoType;
+        o.latitude = p->latitude;
+        o.longitude = p->longitude;
+    }
+    else
+        return false;
+    return true;
+}
+
+// Remove the object from the secondary indexes of a version
+void MediaManager::unindex(Catalog &c, std::string_view key, const MultimediaObject *obj)
+{
+    if (auto *p = dynamic_cast<const Photo *>(obj))
+        c.places = c.places.erase(key, p->latitude, p->longitude);
+    else if (auto *v = dynamic_cast<const Video *>(obj))
+        c.durations = c.durations.erase(key, v->Duree);
+}
+
+// Publish a new version of the catalog: _update_ is applied to a copy of the current version,
+// which is retried if another stripe was published meanwhile
+void MediaManager::publish(const std::function<void(Catalog &)> &update)
+{
+    const Catalog *current;
+    {
+        // the current version may be retired by another writer while it is copied
+        EpochDomain::Guard guard(epochs);
+        current = catalog.load();
+        Catalog *next = new Catalog(*current);
+        update(*next);
+        while (!catalog.compare_exchange_weak(current, next))
+        {
+            *next = *current;
+            update(*next);
+        }
+    }
+    // readers that still use the previous version may keep it until they are done
+    epochs.retire(current);
+}
+
+// Add (or replace) an object, only its stripe is copied, returns the sequence of the mutation in the log
+uint64_t MediaManager::addObject(const std::string &name, MultimediaPtr obj)
+{
+    NewObject added{name, std::move(obj)};
+    return addObjects(std::span<const NewObject>(&added, 1));
+}
+
+// Add (or replace) objects with a single publication: the stripes of the objects are locked
+// (in order, like load()) and copied once, and each index is updated once for the
+// whole batch. If several objects have the same name, the last one replaces the others.
+// Returns the sequence of the last mutation in the log
+uint64_t MediaManager::addObjects(std::span<const NewObject> added)
+{
+    std::vector<size_t> hashes(added.size());
+    std::array<size_t, StripeCount> counts{};
+    for (size_t k = 0; k < added.size(); ++k)
+    {
+        hashes[k] = ObjectMap::hash(added[k].name);
+        ++counts[stripe(hashes[k])];
+    }
+    // only the last object of each name is added
+    std::vector<bool> last(added.size(), true);
+    if (added.size() > 1)
+    {
+        std::unordered_map<std::string_view, size_t> seen;
+        seen.reserve(added.size());
+        for (size_t k = 0; k < added.size(); ++k)
+        {
+            auto [it, inserted] = seen.try_emplace(added[k].name, k);
+            if (!inserted)
+            {
+                last[it->second] = false;
+                it->second = k;
+            }
+        }
+    }
+
+    std::array<std::unique_lock<std::mutex>, StripeCount> locks;
+    for (size_t i = 0; i < StripeCount; ++i)
+    {
+        if (counts[i])
+            locks[i] = std::unique_lock<std::mutex>(stripes[i].mutex);
+    }
+    std::lock_guard<std::mutex> textLock(textMutex);
+    std::array<std::shared_ptr<ObjectMap>, StripeCount> objects;
+    std::vector<size_t> kept; // objects that are added, in order
+    std::vector<std::string_view> keys;
+    std::vector<MultimediaPtr> olds;
+    std::vector<std::string> texts;
+    kept.reserve(added.size());
+    keys.reserve(added.size());
+    olds.reserve(added.size());
+    texts.reserve(added.size());
+    TextIndex textIndex;
+    bool indexed; // the secondary indexes are only updated once they were built
+    {
+        // the locked stripes can't change, but the version can be replaced
+        EpochDomain::Guard guard(epochs);
+        const Catalog *c = catalog.load();
+        textIndex = c->texts;
+        indexed = c->indexed;
+        for (size_t i = 0; i < StripeCount; ++i)
+        {
+            if (!counts[i])
+                continue;
+            objects[i] = std::make_shared<ObjectMap>(*c->objects[i]);
+            stripes[i].names.reserve(counts[i]);
+            stripes[i].texts.reserve(stripes[i].texts.size() + counts[i]);
+        }
+        for (size_t k = 0; k < added.size(); ++k)
+        {
+            if (!last[k])
+                continue;
+            size_t h = hashes[k], i = stripe(h);
+            // an object that had the same name is replaced in the secondary indexes too
+            // (the names of the batch are different, so its stripe did not change yet)
+            MultimediaPtr old;
+            Item found;
+            if (lookup(*c, added[k].name, h, found))
+                old = resolve(*c, found);
+            std::string_view key = stripes[i].names.intern(added[k].name);
+            auto text = stripes[i].texts.find(key);
+            if (text != stripes[i].texts.end())
+                textIndex = textIndex.remove(text->second);
+            if (old)
+                attach(old.get(), nullptr);
+            attach(added[k].object.get(), this);
+            // a replaced entry keeps the reference it took to its name
+            if (!objects[i]->assign(key, h, Item{added[k].object}))
+                stripes[i].names.release(key);
+            kept.push_back(k);
+            keys.push_back(key);
+            olds.push_back(std::move(old));
+            if (indexed)
+                texts.push_back(std::string(key) + ' ' + added[k].object->getNomFichier());
+        }
+        uint32_t first;
+        if (indexed)
+        {
+            textIndex = textIndex.add(keys, texts, first);
+            for (size_t j = 0; j < keys.size(); ++j)
+                stripes[stripe(hashes[kept[j]])].texts[keys[j]] = first + uint32_t(j);
+        }
+    }
+
+    // secondary indexes (photos: coordinates, videos and films: duration)
+    std::vector<GeoIndex::Place> places;
+    std::vector<DurationIndex::Entry> durations;
+    for (size_t j = 0; j < kept.size(); ++j)
+    {
+        const MultimediaObject *obj = added[kept[j]].object.get();
+        if (auto *p = dynamic_cast<const Photo *>(obj))
+            places.push_back({keys[j], p->latitude, p->longitude});
+        else if (auto *v = dynamic_cast<const Video *>(obj))
+            durations.push_back({keys[j], v->Duree});
+    }
+    publish([&](Catalog &c)
+            {
+                for (size_t i = 0; i < StripeCount; ++i)
+                {
+                    if (objects[i])
+                        c.objects[i] = objects[i];
+                }
+                if (!indexed)
+                    return;
+                c.texts = textIndex;
+                c.names = c.names.insert(keys);
+                for (size_t j = 0; j < kept.size(); ++j)
+                {
+                    if (olds[j])
+                        unindex(c, keys[j], olds[j].get());
+                }
+                c.places = c.places.insert(places);
+                c.durations = c.durations.insert(durations);
+            });
+    uint64_t seq = 0;
+    for (size_t j = 0; log && j < kept.size(); ++j)
+    {
+        CatalogFile::Object o;
+        if (!describe(*added[kept[j]].object, keys[j], o))
+            continue;
+        std::string record = mutation(CreateObject, keys[j]);
+        putValue(record, uint8_t(o.type));
+        putText(record, o.file);
+        putValue(record, o.latitude);
+        putValue(record, o.longitude);
+        putValue(record, int32_t(o.duree));
+        seq = log->append(record);
+    }
+    return seq;
+}
+
+// Create Photo (nullptr if the coordinates are not finite)
 std::shared_ptr<Photo> MediaManager::createPhoto(const std::string &name, const std::string &filename, double lat, double lon)
 {
-    std::shared_ptr<Photo> p(new Photo(name, filename, lat, lon));
-    objects[name] = std::static_pointer_cast<MultimediaObject>(p);
+    if (!validPosition(lat, lon))
+        return nullptr;
+    std::shared_ptr<Photo> p = make<Photo>(photoPool, name, filename, lat, lon);
+    commit(addObject(name, std::static_pointer_cast<MultimediaObject>(p)));
     return p;
 }
 
 // Create Video
 std::shared_ptr<Video> MediaManager::createVideo(const std::string &name, const std::string &filename, int duree)
 {
-    std::shared_ptr<Video> v(new Video(name, filename, duree));
-    objects[name] = std::static_pointer_cast<MultimediaObject>(v);
+    std::shared_ptr<Video> v = make<Video>(videoPool, name, filename, duree);
+    commit(addObject(name, std::static_pointer_cast<MultimediaObject>(v)));
     return v;
 }
 
 // Create Film
 std::shared_ptr<Film> MediaManager::createFilm(const std::string &name, const std::string &filename, int duree)
 {
-    std::shared_ptr<Film> f(new Film(name, filename, duree));
-    objects[name] = std::static_pointer_cast<MultimediaObject>(f);
+    std::shared_ptr<Film> f = make<Film>(filmPool, name, filename, duree);
+    commit(addObject(name, std::static_pointer_cast<MultimediaObject>(f)));
     return f;
 }
 
+// Create objects by batches: the objects and their descriptions for addObjects() are
+// stored in vectors allocated once (and the objects are contiguous in their pool)
+std::vector<std::shared_ptr<Photo>> MediaManager::createPhotos(std::span<const PhotoSpec> specs)
+{
+    std::vector<std::shared_ptr<Photo>> photos;
+    std::vector<NewObject> added;
+    photos.reserve(specs.size());
+    added.reserve(specs.size());
+    for (auto &s : specs)
+    {
+        if (!validPosition(s.lat, s.lon))
+            continue;
+        photos.push_back(make<Photo>(photoPool, s.name, s.filename, s.lat, s.lon));
+        added.push_back({s.name, photos.back()});
+    }
+    commit(addObjects(added));
+    return photos;
+}
+
+std::vector<std::shared_ptr<Video>> MediaManager::createVideos(std::span<const VideoSpec> specs)
+{
+    std::vector<std::shared_ptr<Video>> videos;
+    std::vector<NewObject> added;
+    videos.reserve(specs.size());
+    added.reserve(specs.size());
+    for (auto &s : specs)
+    {
+        videos.push_back(make<Video>(videoPool, s.name, s.filename, s.duree));
+        added.push_back({s.name, videos.back()});
+    }
+    commit(addObjects(added));
+    return videos;
+}
+
+std::vector<std::shared_ptr<Film>> MediaManager::createFilms(std::span<const FilmSpec> specs)
+{
+    std::vector<std::shared_ptr<Film>> films;
+    std::vector<NewObject> added;
+    films.reserve(specs.size());
+    added.reserve(specs.size());
+    for (auto &s : specs)
+    {
+        films.push_back(make<Film>(filmPool, s.name, s.filename, s.duree));
+        films.back()->setChapitres(s.chapitres.data(), int(s.chapitres.size()));
+        added.push_back({s.name, films.back()});
+    }
+    commit(addObjects(added));
+    return films;
+}
+
 // Create Groupe
 GroupePtr MediaManager::createGroupe(const std::string &name)
 {
     GroupePtr g(new Groupe(name));
-    groups[name] = g;
+    size_t h = GroupeMap::hash(name), i = stripe(h);
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(stripes[i].mutex);
+        std::shared_ptr<GroupeMap> groups;
+        {
+            EpochDomain::Guard guard(epochs);
+            groups = std::make_shared<GroupeMap>(*catalog.load()->groups[i]);
+        }
+        std::string_view key = stripes[i].names.intern(name);
+        // a replaced group keeps its key (which may be a name of the loaded file)
+        std::string *unused = groups->assign(key, h, g) ? nullptr : stripes[i].names.release(key);
+        publish([&](Catalog &c) { c.groups[i] = groups; });
+        if (unused)
+            epochs.retire(unused);
+        if (log)
+            seq = log->append(mutation(CreateGroupe, name));
+    }
+    commit(seq);
     return g;
 }
 
-// Display object
-void MediaManager::displayObject(const std::string &name, std::ostream &out) const
+// Find object (nullptr if not found)
+MultimediaPtr MediaManager::findObject(std::string_view name) const
 {
-    auto it = objects.find(name);
-    if (it == objects.end())
+    size_t h = ObjectMap::hash(name);
+    EpochDomain::Guard guard(epochs);
+    const Catalog *c = catalog.load();
+    Item item;
+    return lookup(*c, name, h, item) ? resolve(*c, item) : nullptr;
+}
+
+// Find groupe (nullptr if not found)
+GroupePtr MediaManager::findGroupe(std::string_view name) const
+{
+    size_t h = GroupeMap::hash(name);
+    EpochDomain::Guard guard(epochs);
+    const GroupePtr *g = catalog.load()->groups[stripe(h)]->find(name, h);
+    return g ? *g : nullptr;
+}
+
+// Display object (the object is kept alive by the version of the catalog, no copy is needed)
+void MediaManager::displayObject(std::string_view name, std::ostream &out) const
+{
+    size_t h = ObjectMap::hash(name);
+    EpochDomain::Guard guard(epochs);
+    const Catalog *c = catalog.load();
+    Item item;
+    if (!lookup(*c, name, h, item))
     {
         std::cout << "Objet '" << name << "' introuvable." << std::endl;
         return;
     }
-    it->second->affiche(out);
+    resolve(*c, item)->affiche(out);
     out << std::endl;
 }
 
 // Display groupe
-void MediaManager::displayGroupe(const std::string &name, std::ostream &out) const
+void MediaManager::displayGroupe(std::string_view name, std::ostream &out) const
 {
-    auto it = groups.find(name);
-    if (it == groups.end())
+    size_t h = GroupeMap::hash(name);
+    EpochDomain::Guard guard(epochs);
+    const GroupePtr *g = catalog.load()->groups[stripe(h)]->find(name, h);
+    if (!g)
     {
-        std::cout << "Groupe '" << name << "' introuvable." << std::endl;
+        out << "Groupe '" << name << "' introuvable." << std::endl;
+        return;
+    }
+    (*g)->affiche(out);
+    out << std::endl;
+}
+
+// List the names of all the objects, all the stripes are read from the same version
+void MediaManager::listObjects(std::ostream &out) const
+{
+    EpochDomain::Guard guard(epochs);
+    forEachItem(*catalog.load(), [&](std::string_view name, const Item &)
+                { out << name << std::endl; });
+}
+
+// Names of the objects that start with prefix (only the matching part of the trie is visited)
+std::vector<std::string> MediaManager::findPrefix(std::string_view prefix, size_t limit) const
+{
+    requireIndexes();
+    EpochDomain::Guard guard(epochs);
+    return catalog.load()->names.find(prefix, limit);
+}
+
+// Change the coordinates of a photo of the catalog and its place in the geographic index
+void MediaManager::movePhoto(Photo &photo, double lat, double lon)
+{
+    if (!validPosition(lat, lon))
         return;
+    const std::string &name = photo.getNom();
+    size_t h = ObjectMap::hash(name), i = stripe(h);
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(stripes[i].mutex);
+        double oldLat = photo.latitude, oldLon = photo.longitude;
+        bool indexed;
+        std::string_view key;
+        photo.latitude = lat;
+        photo.longitude = lon;
+        {
+            // the photo may have been removed (or renamed) meanwhile
+            EpochDomain::Guard guard(epochs);
+            const Catalog *c = catalog.load();
+            Item item;
+            if (!lookup(*c, name, h, item) || peek(*c, item) != &photo)
+                return;
+            indexed = c->indexed;
+            key = indexedName(*c, item, name);
+        }
+        // otherwise the index will be built from the photo itself
+        if (indexed)
+            publish([&](Catalog &c)
+                    { c.places = c.places.erase(key, oldLat, oldLon).insert({key, lat, lon}); });
+        if (log)
+        {
+            std::string record = mutation(MovePhoto, name);
+            putValue(record, lat);
+            putValue(record, lon);
+            seq = log->append(record);
+        }
     }
-    it->second->affiche(std::cout);
-    std::cout << std::endl;
+    commit(seq);
 }
 
-// Play object
-void MediaManager::playObject(const std::string &name, std::ostream &out) const
+// Change the duration of a video or film of the catalog and its place in the duration index
+void MediaManager::changeDuree(Video &video, int duree)
 {
-    auto it = objects.find(name);
-    if (it == objects.end())
+    const std::string &name = video.getNom();
+    size_t h = ObjectMap::hash(name), i = stripe(h);
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(stripes[i].mutex);
+        int old = video.Duree;
+        video.Duree = duree;
+        bool indexed;
+        std::string_view key;
+        {
+            EpochDomain::Guard guard(epochs);
+            const Catalog *c = catalog.load();
+            Item item;
+            if (!lookup(*c, name, h, item) || peek(*c, item) != &video)
+                return;
+            indexed = c->indexed;
+            key = indexedName(*c, item, name);
+        }
+        if (indexed)
+            publish([&](Catalog &c)
+                    { c.durations = c.durations.erase(key, old).insert(key, duree); });
+        if (log)
+        {
+            std::string record = mutation(ChangeDuree, name);
+            putValue(record, int32_t(duree));
+            seq = log->append(record);
+        }
+    }
+    commit(seq);
+}
+
+// Videos and films whose duration is between min and max, shortest first
+void MediaManager::forEachDuree(int min, int max, const std::function<bool(std::string_view, int)> &f) const
+{
+    requireIndexes();
+    EpochDomain::Guard guard(epochs);
+    catalog.load()->durations.forEach(min, max, [&](const DurationIndex::Entry &e)
+                                      { return f(e.name, e.duration); });
+}
+
+// Videos and films, longest first
+void MediaManager::forEachLongest(const std::function<bool(std::string_view, int)> &f) const
+{
+    requireIndexes();
+    EpochDomain::Guard guard(epochs);
+    catalog.load()->durations.forEachDescending([&](const DurationIndex::Entry &e)
+                                                { return f(e.name, e.duration); });
+}
+
+// Objects whose name or file contains all the words of the query
+void MediaManager::findText(std::string_view query, const std::function<bool(std::string_view)> &f) const
+{
+    requireIndexes();
+    EpochDomain::Guard guard(epochs);
+    catalog.load()->texts.find(query, f);
+}
+
+TextIndex::Stats MediaManager::textStats() const
+{
+    requireIndexes();
+    EpochDomain::Guard guard(epochs);
+    return catalog.load()->texts.stats();
+}
+
+// Photos at most radius km away, nearest first
+void MediaManager::findNear(double lat, double lon, double radius, size_t k,
+                            const std::function<void(const GeoIndex::Neighbor &)> &f) const
+{
+    requireIndexes();
+    EpochDomain::Guard guard(epochs);
+    for (auto &n : catalog.load()->places.near(lat, lon, radius, k))
+        f(n);
+}
+
+// Photos inside a box
+void MediaManager::findWithin(double minLat, double minLon, double maxLat, double maxLon, size_t limit,
+                              const std::function<void(const GeoIndex::Place &)> &f) const
+{
+    requireIndexes();
+    EpochDomain::Guard guard(epochs);
+    for (auto &p : catalog.load()->places.within(minLat, minLon, maxLat, maxLon, limit))
+        f(p);
+}
+
+// Play object (the catalog is not pinned while the object plays)
+void MediaManager::playObject(std::string_view name, std::ostream &out) const
+{
+    auto obj = findObject(name);
+    if (!obj)
     {
         out << "Objet '" << name << "' introuvable." << std::endl;
         return;
     }
-    it->second->jouer(out);
+    obj->jouer(out);
 }
 
-// Remove object
-bool MediaManager::removeObject(const std::string &name)
+// Remove object (it is destroyed with the last version of the catalog that contains it)
+bool MediaManager::removeObject(std::string_view name)
 {
-    auto it = objects.find(name);
-    if (it == objects.end())
-        return false;
-    objects.erase(it);
+    size_t h = ObjectMap::hash(name), i = stripe(h);
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(stripes[i].mutex);
+        std::lock_guard<std::mutex> textLock(textMutex);
+        std::shared_ptr<ObjectMap> objects;
+        MultimediaPtr removed;
+        TextIndex texts;
+        bool indexed, inFile;
+        {
+            EpochDomain::Guard guard(epochs);
+            const Catalog *c = catalog.load();
+            Item item;
+            uint32_t k;
+            if (!lookup(*c, name, h, item))
+                return false;
+            // an object that comes from a file is built to be removed from the secondary indexes
+            removed = resolve(*c, item);
+            objects = std::make_shared<ObjectMap>(*c->objects[i]);
+            texts = c->texts;
+            indexed = c->indexed;
+            inFile = c->file && c->file->find(name, k);
+        }
+        attach(removed.get(), nullptr);
+        if (indexed)
+        {
+            auto text = stripes[i].texts.find(name);
+            if (text != stripes[i].texts.end())
+            {
+                texts = texts.remove(text->second);
+                stripes[i].texts.erase(text);
+            }
+        }
+        // the stripe hides the record of the file, otherwise the name is released: it is deleted
+        // with the last version that uses it
+        std::string *unused = nullptr;
+        std::string_view key;
+        if (inFile)
+        {
+            key = stripes[i].names.intern(name);
+            if (!objects->assign(key, h, Item{}))
+                stripes[i].names.release(key);
+        }
+        else if (objects->erase(name, h, &key))
+            unused = stripes[i].names.release(key);
+        publish([&](Catalog &c)
+                {
+                    c.objects[i] = objects;
+                    if (!indexed)
+                        return;
+                    c.names = c.names.erase(name);
+                    c.texts = texts;
+                    unindex(c, name, removed.get());
+                });
+        if (unused)
+            epochs.retire(unused);
+        if (log)
+            seq = log->append(mutation(RemoveObject, name));
+    }
+    commit(seq);
     return true;
 }
 
 // Remove groupe
-bool MediaManager::removeGroupe(const std::string &name)
+bool MediaManager::removeGroupe(std::string_view name)
 {
-    auto it = groups.find(name);
-    if (it == groups.end())
+    size_t h = GroupeMap::hash(name), i = stripe(h);
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(stripes[i].mutex);
+        std::shared_ptr<GroupeMap> groups;
+        {
+            EpochDomain::Guard guard(epochs);
+            const GroupeMap &current = *catalog.load()->groups[i];
+            if (!current.find(name, h))
+                return false;
+            groups = std::make_shared<GroupeMap>(current);
+        }
+        std::string_view key;
+        groups->erase(name, h, &key);
+        std::string *unused = stripes[i].names.release(key);
+        publish([&](Catalog &c) { c.groups[i] = groups; });
+        if (unused)
+            epochs.retire(unused);
+        if (log)
+            seq = log->append(mutation(RemoveGroupe, name));
+    }
+    commit(seq);
+    return true;
+}
+
+bool MediaManager::save(const std::string &path) const
+{
+    uint64_t position;
+    return snapshot(path, log.get(), &position);
+}
+
+// Save the catalog: the writers are blocked while the records are copied (only in memory),
+// so that the file contains exactly the mutations of the log up to _position_.
+// The objects that were not built yet are copied from their file.
+bool MediaManager::snapshot(const std::string &path, MutationLog *log, uint64_t *position) const
+{
+    CatalogFile::Writer writer;
+    {
+        // the setters also change the indexed attributes of the objects under the lock of their stripe
+        std::array<std::unique_lock<std::mutex>, StripeCount> locks;
+        for (size_t i = 0; i < StripeCount; ++i)
+            locks[i] = std::unique_lock<std::mutex>(stripes[i].mutex);
+        writer.setSequence(log ? log->checkpoint(*position) : sequence);
+
+        EpochDomain::Guard guard(epochs);
+        const Catalog *c = catalog.load();
+        std::unordered_map<const MultimediaObject *, uint32_t> saved; // index of the objects in the file
+        forEachItem(*c, [&](std::string_view name, const Item &item)
+                    {
+                        const MultimediaObject *obj = peek(*c, item);
+                        CatalogFile::Object o;
+                        if (!obj)
+                        {
+                            c->file->objectAt(item.record - 1, o);
+                            writer.addObject(o);
+                        }
+                        else if (describe(*obj, name, o))
+                            saved[obj] = writer.addObject(o);
+                    });
+        for (auto &groups : c->groups)
+        {
+            groups->forEach([&](std::string_view name, const GroupePtr &g)
+                            {
+                                std::vector<uint32_t> members;
+                                for (auto &obj : *g)
+                                {
+                                    // objects that are not in the catalog anymore are only saved for their groups
+                                    auto found = saved.find(obj.get());
+                                    CatalogFile::Object o;
+                                    o.detached = true;
+                                    if (found == saved.end() && obj && describe(*obj, obj->getNom(), o))
+                                        found = saved.emplace(obj.get(), writer.addObject(o)).first;
+                                    if (found != saved.end())
+                                        members.push_back(found->second);
+                                }
+                                writer.addGroup(name, members);
+                            });
+        }
+    }
+    return writer.write(path);
+}
+
+// Replace the catalog by the one of a file: the objects are found in the file, which is not
+// read (except for the groups and their members), the secondary indexes are built when they are
+// first needed (see buildIndexes())
+bool MediaManager::load(const std::string &path)
+{
+    std::shared_ptr<const CatalogFile> file = log ? nullptr : CatalogFile::open(path);
+    if (!file)
         return false;
-    groups.erase(it);
+
+    // all the writers are blocked while the catalog is replaced
+    std::array<std::unique_lock<std::mutex>, StripeCount> locks;
+    for (size_t i = 0; i < StripeCount; ++i)
+        locks[i] = std::unique_lock<std::mutex>(stripes[i].mutex);
+    std::lock_guard<std::mutex> textLock(textMutex);
+
+    // the names of the groups point into the file
+    Catalog *next = new Catalog;
+    next->file = file;
+    next->indexed = file->objectCount() == 0;
+    std::array<std::shared_ptr<GroupeMap>, StripeCount> groups;
+    for (size_t i = 0; i < StripeCount; ++i)
+    {
+        next->objects[i] = std::make_shared<ObjectMap>();
+        groups[i] = std::make_shared<GroupeMap>();
+        stripes[i].texts.clear();
+    }
+    for (uint32_t k = 0; k < file->groupCount(); ++k)
+    {
+        CatalogFile::Group gr;
+        if (!file->groupAt(k, gr))
+            continue;
+        GroupePtr g(new Groupe(std::string(gr.name)));
+        for (uint32_t m = 0; m < gr.memberCount; ++m)
+        {
+            CatalogFile::Object o;
+            if (!file->objectAt(gr.members[m], o))
+                continue;
+            g->push_back(file->object(gr.members[m], [&]
+                                      {
+                                          MultimediaPtr obj = build(o);
+                                          if (!o.detached)
+                                              attach(obj.get(), this);
+                                          return obj;
+                                      }));
+        }
+        size_t h = GroupeMap::hash(gr.name);
+        groups[stripe(h)]->assign(gr.name, h, g);
+    }
+    for (size_t i = 0; i < StripeCount; ++i)
+        next->groups[i] = groups[i];
+    files.push_back(file);
+    sequence = file->sequence();
+
+    // no other writer can retire the previous version, its objects are detached
+    // (objects that readers build from the previous file afterwards are not attached, see resolve())
+    // and the names of its stripes are released
+    const Catalog *previous = catalog.exchange(next);
+    std::vector<std::string *> unused;
+    for (size_t i = 0; i < StripeCount; ++i)
+    {
+        auto release = [&](std::string_view name)
+        {
+            if (std::string *text = stripes[i].names.release(name))
+                unused.push_back(text);
+        };
+        previous->objects[i]->forEach([&](std::string_view name, const Item &item)
+                                      {
+                                          attach(item.object.get(), nullptr);
+                                          release(name);
+                                      });
+        previous->groups[i]->forEach([&](std::string_view name, const GroupePtr &)
+                                     { release(name); });
+    }
+    if (previous->file)
+        previous->file->forEachBuilt([](MultimediaObject *obj)
+                                     { attach(obj, nullptr); });
+    epochs.retire(previous);
+    for (std::string *text : unused)
+        epochs.retire(text);
     return true;
 }
+
+// Build the secondary indexes of a catalog loaded from a file if they were not built yet
+void MediaManager::requireIndexes() const
+{
+    {
+        EpochDomain::Guard guard(epochs);
+        if (catalog.load()->indexed)
+            return;
+    }
+    const_cast<MediaManager *>(this)->buildIndexes();
+}
+
+// Build the secondary indexes from all the objects of the catalog: the writers, which don't
+// update them until then, are blocked meanwhile. Each index is built at once, from the
+// objects that were built (they may have been changed) or else from their records
+void MediaManager::buildIndexes()
+{
+    std::array<std::unique_lock<std::mutex>, StripeCount> locks;
+    for (size_t i = 0; i < StripeCount; ++i)
+        locks[i] = std::unique_lock<std::mutex>(stripes[i].mutex);
+    std::lock_guard<std::mutex> textLock(textMutex);
+
+    std::vector<std::string_view> names;
+    std::vector<std::string> texts;
+    std::vector<GeoIndex::Place> places;
+    std::vector<DurationIndex::Entry> durations;
+    {
+        EpochDomain::Guard guard(epochs);
+        const Catalog *c = catalog.load();
+        if (c->indexed) // built by another reader meanwhile
+            return;
+        forEachItem(*c, [&](std::string_view name, const Item &item)
+                    {
+                        CatalogFile::Object o;
+                        if (const MultimediaObject *obj = peek(*c, item))
+                        {
+                            if (!describe(*obj, name, o))
+                                o.type = CatalogFile::Type(0);
+                        }
+                        else
+                            c->file->objectAt(item.record - 1, o);
+                        names.push_back(name);
+                        texts.push_back(std::string(name) + ' ' + std::string(o.file));
+                        if (o.type == CatalogFile::PhotoType)
+                            places.push_back({name, o.latitude, o.longitude});
+                        else if (o.type)
+                            durations.push_back({name, o.duree});
+                    });
+    }
+    uint32_t first;
+    TextIndex textIndex = TextIndex().add(names, texts, first);
+    for (size_t j = 0; j < names.size(); ++j)
+        stripes[stripe(ObjectMap::hash(names[j]))].texts[names[j]] = first + uint32_t(j);
+    publish([&](Catalog &c)
+            {
+                c.names = PrefixIndex().insert(names);
+                c.places = GeoIndex().insert(places);
+                c.durations = DurationIndex().insert(durations);
+                c.texts = textIndex;
+                c.indexed = true;
+            });
+}
+
+// Wait until a mutation is durable (if the log is synchronous)
+void MediaManager::commit(uint64_t seq)
+{
+    if (seq && !log->commit(seq))
+        std::cerr << "Could not write the mutation log" << std::endl;
+}
+
+// Apply a mutation of the log (which is not logged again)
+void MediaManager::replay(std::string_view record)
+{
+    MutationReader r{record};
+    auto kind = r.value<uint8_t>();
+    std::string name(r.text());
+    if (!r.ok)
+        return;
+    switch (kind)
+    {
+    case CreateObject:
+    {
+        CatalogFile::Object o;
+        o.type = CatalogFile::Type(r.value<uint8_t>());
+        o.name = name;
+        o.file = r.text();
+        o.latitude = r.value<double>();
+        o.longitude = r.value<double>();
+        o.duree = r.value<int32_t>();
+        if (r.ok && o.type >= CatalogFile::PhotoType && o.type <= CatalogFile::FilmType &&
+            (o.type != CatalogFile::PhotoType || validPosition(o.latitude, o.longitude)))
+            addObject(name, build(o));
+        break;
+    }
+    case CreateGroupe:
+        createGroupe(name);
+        break;
+    case RemoveObject:
+        removeObject(name);
+        break;
+    case RemoveGroupe:
+        removeGroupe(name);
+        break;
+    case MovePhoto:
+    {
+        double lat = r.value<double>(), lon = r.value<double>();
+        if (auto p = std::dynamic_pointer_cast<Photo>(findObject(name)); p && r.ok)
+            movePhoto(*p, lat, lon);
+        break;
+    }
+    case ChangeDuree:
+    {
+        int duree = r.value<int32_t>();
+        if (auto v = std::dynamic_pointer_cast<Video>(findObject(name)); v && r.ok)
+            changeDuree(*v, duree);
+        break;
+    }
+    }
+}
+
+// Replay the mutations that are not in the loaded file, then log the next ones
+long MediaManager::openLog(const std::string &path, const std::string &snapshotPath, unsigned syncInterval,
+                           uint64_t compactSize)
+{
+    if (log)
+        return -1;
+    long replayed = 0;
+    log = MutationLog::open(path, syncInterval, sequence + 1, [&](uint64_t, std::string_view record)
+                            {
+                                replay(record);
+                                ++replayed;
+                            });
+    if (!log)
+        return -1;
+    logSnapshot = snapshotPath;
+    if (compactSize > 0)
+        log->setCompaction(compactSize, [this, l = log.get()]
+                           { compact(*l); });
+    return replayed;
+}
+
+// Save the catalog, then remove the mutations that it contains from the log
+bool MediaManager::compact(MutationLog &log)
+{
+    std::lock_guard<std::mutex> lock(compactMutex);
+    uint64_t position;
+    return snapshot(logSnapshot, &log, &position) && log.discard(position);
+}
+
+bool MediaManager::compact()
+{
+    return log && compact(*log);
+}
@@ -13,12 +13,12 @@ MultimediaObject::~MultimediaObject() {
 }
 
 // Getter
-std::string MultimediaObject::getNom() const
+const std::string &MultimediaObject::getNom() const
 {
     return nom;
 }
 
-std::string MultimediaObject::getNomFichier() const
+const std::string &MultimediaObject::getNomFichier() const
 {
     return nomFichier;
 }
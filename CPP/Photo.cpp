@@ -1,4 +1,5 @@
 #include "Photo.h"
+#include "MediaManager.h"
 #include <iostream>
 
 Photo::Photo() : MultimediaObject(), latitude(0.0), longitude(0.0) {}
@@ -8,8 +9,22 @@ Photo::~Photo() {}
 double Photo::getLatitude() const { return latitude; }
 double Photo::getLongitude() const { return longitude; }
 
-void Photo::setLatitude(double lat) { latitude = lat; }
-void Photo::setLongitude(double lon) { longitude = lon; }
+// the catalog changes the coordinates itself so that its index stays consistent
+void Photo::setLatitude(double lat)
+{
+    if (manager)
+        manager->movePhoto(*this, lat, longitude);
+    else
+        latitude = lat;
+}
+
+void Photo::setLongitude(double lon)
+{
+    if (manager)
+        manager->movePhoto(*this, latitude, lon);
+    else
+        longitude = lon;
+}
 
 void Photo::affiche(std::ostream &os) const
 {
@@ -1,4 +1,5 @@
 #include "Video.h"
+#include "MediaManager.h"
 
 Video::Video() : MultimediaObject(), Duree(0) {}
 
@@ -6,7 +7,14 @@ Video::~Video() {}
 
 double Video::getDuree() const { return Duree; }
 
-void Video::setDuree(double d) { Duree = static_cast<int>(d); }
+// the catalog changes the duration itself so that its index stays consistent
+void Video::setDuree(double d)
+{
+    if (manager)
+        manager->changeDuree(*this, static_cast<int>(d));
+    else
+        Duree = static_cast<int>(d);
+}
 
 void Video::affiche(std::ostream &os) const
 {
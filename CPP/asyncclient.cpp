@@ -0,0 +1,279 @@
+//
+//  asyncclient: asynchronous TCP/IP clients based on C++20 coroutines.
+//
+
+#include <iostream>
+#include "asyncclient.h"
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+#if defined(__linux__)
+
+/// Coroutine that starts immediately and destroys itself when it completes.
+struct AsyncDetached {
+  struct promise_type {
+    AsyncDetached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept {}
+  };
+
+  static AsyncDetached start(AsyncReactor& reactor, AsyncTask<void> task) {
+    try {
+      co_await task;
+    }
+    catch (std::exception const& e) {
+      std::cerr << "AsyncReactor: uncaught exception: " << e.what() << std::endl;
+    }
+    catch (...) {
+      std::cerr << "AsyncReactor: uncaught exception" << std::endl;
+    }
+    --reactor.tasks_;
+  }
+};
+
+
+AsyncReactor::AsyncReactor() :
+epfd_(::epoll_create1(EPOLL_CLOEXEC)) {
+}
+
+
+AsyncReactor::~AsyncReactor() {
+  if (epfd_ >= 0) ::close(epfd_);
+}
+
+
+void AsyncReactor::spawn(AsyncTask<void> task) {
+  ++tasks_;
+  AsyncDetached::start(*this, std::move(task));
+}
+
+
+void AsyncReactor::run() {
+  while (tasks_ > 0) poll();
+}
+
+
+int AsyncReactor::add(int fd, uint32_t events, AsyncHandler* handler) {
+  if (epfd_ < 0) return Socket::InvalidSocket;
+  struct epoll_event ev{};
+  ev.events = events | EPOLLET;
+  ev.data.ptr = handler;
+  return ::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0 ? Socket::Failed : 0;
+}
+
+
+void AsyncReactor::remove(int fd, AsyncHandler* handler) {
+  if (epfd_ >= 0) ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+  removed_.push_back(handler);
+}
+
+
+// waits for events and resumes the tasks waiting for them
+void AsyncReactor::poll() {
+  const int MaxEvents = 64;
+  struct epoll_event events[MaxEvents];
+
+  int count = ::epoll_wait(epfd_, events, MaxEvents, -1);
+  if (count < 0) {
+    if (errno != EINTR) std::cerr << "AsyncReactor: epoll_wait failed" << std::endl;
+    return;
+  }
+
+  removed_.clear();
+  for (int k = 0; k < count; ++k) {
+    auto* handler = static_cast<AsyncHandler*>(events[k].data.ptr);
+    // the handler may have been destroyed by a task resumed by a previous event
+    bool removed = false;
+    for (auto* h : removed_) if (h == handler) removed = true;
+    if (!removed) handler->onEvent(events[k].events);
+  }
+  removed_.clear();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+AsyncClient::AsyncClient(AsyncReactor& reactor) :
+reactor_(reactor),
+sockbuf_(sock_) {
+}
+
+
+AsyncClient::~AsyncClient() {
+  close();
+}
+
+
+void AsyncClient::close() {
+  if (watched_) reactor_.remove(sock_.descriptor(), this);
+  watched_ = false;
+  connected_ = false;
+  sock_.close();
+  fail(Socket::InvalidSocket);
+}
+
+
+AsyncTask<int> AsyncClient::connect(std::string host, int port) {
+  if (connected_) co_return 0;
+  if (sock_.isClosed() || sock_.setBlocking(false) < 0) co_return Socket::InvalidSocket;
+
+  // a non-blocking connect() completes when the socket becomes writable
+  int status = sock_.connect(host, port);
+  if (status == Socket::UnknownHost) co_return status;
+  if (status < 0 && errno != EINPROGRESS) co_return Socket::Failed;
+
+  if (!watched_) {
+    if (reactor_.add(sock_.descriptor(), EPOLLIN | EPOLLOUT | EPOLLRDHUP, this) < 0) {
+      co_return Socket::Failed;
+    }
+    watched_ = true;
+  }
+
+  if (status < 0) {
+    co_await WritableAwaiter{*this};
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (::getsockopt(sock_.descriptor(), SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+      co_return Socket::Failed;
+    }
+  }
+
+  connected_ = true;
+  co_return 0;
+}
+
+
+AsyncTask<SOCKSIZE> AsyncClient::request(std::string request, std::string& response) {
+  std::vector<std::string> responses;
+  std::vector<std::string> requests;
+  requests.push_back(std::move(request));
+  SOCKSIZE status = co_await requestMany(std::move(requests), responses);
+  response.clear();
+  if (!responses.empty()) response = std::move(responses[0]);
+  co_return status;
+}
+
+
+AsyncTask<SOCKSIZE> AsyncClient::requestMany(std::vector<std::string> requests,
+                                             std::vector<std::string>& responses) {
+  responses.clear();
+  if (!connected_) co_return Socket::InvalidSocket;
+  if (requests.empty()) co_return 0;
+
+  Waiter waiter;
+  waiter.responses = &responses;
+  waiter.expected = requests.size();
+  waiters_.push_back(&waiter);
+
+  // responses that were received before being awaited (should not happen with a TCPServer)
+  std::vector<std::coroutine_handle<>> ready;
+  while (!unclaimed_.empty() && !waiter.done) {
+    auto response = std::move(unclaimed_.front());
+    unclaimed_.pop_front();
+    SOCKSIZE received = response.size() + 1;
+    deliver(std::move(response), received, ready);
+  }
+
+  // all the requests are sent together, then the responses arrive in the same order
+  if (!waiter.done) {
+    for (auto& r : requests) {
+      output_ += r;
+      output_ += '\n';
+    }
+    if (!flush()) fail(Socket::Failed);
+  }
+
+  co_return co_await ResponseAwaiter{waiter};
+}
+
+
+void AsyncClient::onEvent(uint32_t events) {
+  // the connection has been established (or has failed)
+  if (connecting_) {
+    std::exchange(connecting_, nullptr).resume();
+    return;
+  }
+
+  if ((events & EPOLLOUT) && !flush()) {
+    fail(Socket::Failed);
+    return;
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) receive();
+}
+
+
+// sends pending requests until the socket would block.
+bool AsyncClient::flush() {
+  while (outpos_ < output_.size()) {
+    auto sent = sock_.send(output_.data() + outpos_, output_.size() - outpos_);
+    if (sent < 0 && Socket::wouldBlock()) return true;   // EPOLLOUT will tell when to go on
+    if (sent <= 0) return false;
+    outpos_ += sent;
+  }
+  output_.clear();
+  outpos_ = 0;
+  return true;
+}
+
+
+// gives a response to the oldest waiting task, adds it to _ready_ if it has all its responses.
+bool AsyncClient::deliver(std::string&& response, SOCKSIZE received,
+                          std::vector<std::coroutine_handle<>>& ready) {
+  if (waiters_.empty()) return false;
+  Waiter* w = waiters_.front();
+  w->responses->push_back(std::move(response));
+  w->status += received;
+  if (w->responses->size() == w->expected) {
+    waiters_.pop_front();
+    w->done = true;
+    if (w->handle) ready.push_back(w->handle);
+  }
+  return true;
+}
+
+
+// reads all available responses, then resumes the tasks that have all their responses.
+void AsyncClient::receive() {
+  std::vector<std::coroutine_handle<>> ready;
+  std::string response;
+
+  while (true) {
+    auto received = sockbuf_.tryReadLine(response);
+    if (received == Socket::WouldBlock) break;
+    if (received <= 0) {
+      connected_ = false;
+      for (auto* w : waiters_) {
+        w->status = received;
+        w->done = true;
+        if (w->handle) ready.push_back(w->handle);
+      }
+      waiters_.clear();
+      break;
+    }
+    if (!deliver(std::move(response), received, ready)) unclaimed_.push_back(std::move(response));
+  }
+
+  // this client must not be used anymore here: a task may destroy it
+  for (auto h : ready) h.resume();
+}
+
+
+// all waiting tasks fail with _status_.
+void AsyncClient::fail(SOCKSIZE status) {
+  std::vector<std::coroutine_handle<>> ready;
+  for (auto* w : waiters_) {
+    w->status = status;
+    w->done = true;
+    if (w->handle) ready.push_back(w->handle);
+  }
+  waiters_.clear();
+  for (auto h : ready) h.resume();
+}
+
+#endif
@@ -0,0 +1,358 @@
+//
+//  catalogfile: binary snapshot of a catalog of multimedia objects, read through mmap.
+//
+
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include "catalogfile.h"
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+static const char Magic[8] = {'I','N','F','2','2','4','C','F'};
+static const uint32_t ByteOrder = 0x01020304;
+
+// sections are aligned on 8 bytes so that the records can be read in place
+struct CatalogFile::Header {
+  char magic[8];
+  uint32_t version, byteOrder;
+  uint32_t objectCount, groupCount, memberCount, chapterCount;
+  uint64_t sequence;                                    // last mutation of the log it contains
+  uint64_t objects, groups, members, chapters, names, strings;   // offsets in the file
+  uint64_t nameCount, stringsSize;
+};
+
+struct CatalogFile::ObjectRecord {
+  double latitude, longitude;
+  uint32_t name, nameLength, file, fileLength;   // offsets in the strings
+  int32_t duree;
+  uint32_t chapters, chapterCount;               // chapters of films
+  uint8_t type, flags, padding[2];
+};
+
+struct CatalogFile::GroupRecord {
+  uint32_t name, nameLength, members, memberCount;
+};
+
+enum { DetachedFlag = 1 };
+
+static uint64_t align(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+
+// hash of the names in the files, which must not depend on the library (FNV-1a)
+static uint64_t nameHash(std::string_view name) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (unsigned char c : name) h = (h ^ c) * 0x100000001b3ull;
+  return h;
+}
+
+
+uint32_t CatalogFile::Writer::addString(std::string_view s) {
+  uint32_t offset = uint32_t(strings_.size());
+  strings_.insert(strings_.end(), s.begin(), s.end());
+  return offset;
+}
+
+
+uint32_t CatalogFile::Writer::addObject(Object const& object) {
+  ObjectRecord r{};
+  r.latitude = object.latitude;
+  r.longitude = object.longitude;
+  r.nameLength = uint32_t(object.name.size());
+  r.name = addString(object.name);
+  r.fileLength = uint32_t(object.file.size());
+  r.file = addString(object.file);
+  r.duree = object.duree;
+  r.chapters = uint32_t(chapters_.size());
+  r.chapterCount = object.chapterCount;
+  chapters_.insert(chapters_.end(), object.chapters, object.chapters + object.chapterCount);
+  r.type = object.type;
+  r.flags = object.detached ? DetachedFlag : 0;
+  const char* p = reinterpret_cast<const char*>(&r);
+  objects_.insert(objects_.end(), p, p + sizeof(r));
+  return objectCount_++;
+}
+
+
+void CatalogFile::Writer::addGroup(std::string_view name, std::vector<uint32_t> const& members) {
+  GroupRecord r{};
+  r.nameLength = uint32_t(name.size());
+  r.name = addString(name);
+  r.members = uint32_t(members_.size());
+  r.memberCount = uint32_t(members.size());
+  members_.insert(members_.end(), members.begin(), members.end());
+  const char* p = reinterpret_cast<const char*>(&r);
+  groups_.insert(groups_.end(), p, p + sizeof(r));
+  ++groupCount_;
+}
+
+
+bool CatalogFile::Writer::write(std::string const& path) const {
+  // offsets are stored on 32 bits
+  if (strings_.size() > std::numeric_limits<uint32_t>::max()
+      || chapters_.size() > std::numeric_limits<uint32_t>::max()
+      || members_.size() > std::numeric_limits<uint32_t>::max()) return false;
+
+  // table of the names of the objects that are in the catalog, at most half full (linear probing)
+  auto record = [this](uint32_t index) {
+    ObjectRecord r;
+    memcpy(&r, objects_.data() + size_t(index) * sizeof(r), sizeof(r));
+    return r;
+  };
+  auto nameOf = [this](ObjectRecord const& r) {return std::string_view(strings_.data() + r.name, r.nameLength);};
+  uint32_t attached = 0;
+  for (uint32_t k = 0; k < objectCount_; ++k) {
+    if (!(record(k).flags & DetachedFlag)) ++attached;
+  }
+  std::vector<uint32_t> names(attached ? std::bit_ceil(2 * uint64_t(attached)) : 0);
+  for (uint32_t k = 0; k < objectCount_; ++k) {
+    ObjectRecord r = record(k);
+    if (r.flags & DetachedFlag) continue;
+    std::string_view name = nameOf(r);
+    for (size_t b = nameHash(name) & (names.size() - 1);; b = (b + 1) & (names.size() - 1)) {
+      if (!names[b]) {names[b] = k + 1; break;}
+      if (nameOf(record(names[b] - 1)) == name) break;     // only the first one is found
+    }
+  }
+
+  Header h{};
+  memcpy(h.magic, Magic, sizeof(Magic));
+  h.version = FormatVersion;
+  h.byteOrder = ByteOrder;
+  h.objectCount = objectCount_;
+  h.groupCount = groupCount_;
+  h.memberCount = uint32_t(members_.size());
+  h.chapterCount = uint32_t(chapters_.size());
+  h.sequence = sequence_;
+  h.objects = align(sizeof(Header));
+  h.groups = align(h.objects + objects_.size());
+  h.members = align(h.groups + groups_.size());
+  h.chapters = align(h.members + members_.size() * sizeof(uint32_t));
+  h.names = align(h.chapters + chapters_.size() * sizeof(int32_t));
+  h.nameCount = names.size();
+  h.strings = align(h.names + names.size() * sizeof(uint32_t));
+  h.stringsSize = strings_.size();
+
+  // the snapshot replaces the previous one only once it is complete
+  std::string tmp = path + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (!f) return false;
+  uint64_t written = 0;
+  auto put = [&](uint64_t offset, const void* data, size_t size) {
+    static const char zeros[8] = {};
+    bool ok = fwrite(zeros, 1, size_t(offset - written), f) == offset - written
+              && (size == 0 || fwrite(data, 1, size, f) == size);
+    written = offset + size;
+    return ok;
+  };
+  bool ok = put(0, &h, sizeof(h))
+    && put(h.objects, objects_.data(), objects_.size())
+    && put(h.groups, groups_.data(), groups_.size())
+    && put(h.members, members_.data(), members_.size() * sizeof(uint32_t))
+    && put(h.chapters, chapters_.data(), chapters_.size() * sizeof(int32_t))
+    && put(h.names, names.data(), names.size() * sizeof(uint32_t))
+    && put(h.strings, strings_.data(), strings_.size())
+    && fflush(f) == 0;
+#if !defined(_WIN32) && !defined(_WIN64)
+  ok = ok && fsync(fileno(f)) == 0;
+#endif
+  ok = (fclose(f) == 0) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+  if (ok) remove(path.c_str());     // rename() does not replace existing files
+#endif
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+#if !defined(_WIN32) && !defined(_WIN64)
+  // the new name is only durable once the directory is synced (see MutationLog)
+  size_t slash = path.rfind('/');
+  int dir = ::open(slash == std::string::npos ? "." : path.substr(0, slash + 1).c_str(), O_RDONLY);
+  if (dir >= 0) {fsync(dir); ::close(dir);}
+#endif
+  return true;
+}
+
+
+std::shared_ptr<CatalogFile> CatalogFile::open(std::string const& path) {
+  std::shared_ptr<CatalogFile> file(new CatalogFile);
+#if defined(_WIN32) || defined(_WIN64)
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return nullptr;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size <= 0) {fclose(f); return nullptr;}
+  file->buffer_.reset(new char[size]);
+  bool ok = fread(file->buffer_.get(), 1, size_t(size), f) == size_t(size);
+  fclose(f);
+  if (!ok) return nullptr;
+  file->data_ = file->buffer_.get();
+  file->size_ = size_t(size);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {::close(fd); return nullptr;}
+  // pages are only read when they are accessed, the mapping remains valid after close()
+  void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) return nullptr;
+  file->data_ = static_cast<const char*>(data);
+  file->size_ = size_t(st.st_size);
+#endif
+  if (!file->validate(file->size_)) return nullptr;
+  file->chunks_.reset(new std::atomic<Slot*>[(file->objectCount_ + ChunkSize - 1) / ChunkSize]());
+  return file;
+}
+
+
+CatalogFile::~CatalogFile() {
+  for (uint32_t c = 0; chunks_ && c < (objectCount_ + ChunkSize - 1) / ChunkSize; ++c) delete[] chunks_[c].load();
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (data_ && !buffer_) munmap(const_cast<char*>(data_), size_);
+#endif
+}
+
+
+// checks the header and that the sections are inside the file (the records are checked when
+// they are read, see objectAt() and groupAt())
+bool CatalogFile::validate(size_t size) {
+  if (size < sizeof(Header)) return false;
+  Header h;
+  memcpy(&h, data_, sizeof(h));
+  if (memcmp(h.magic, Magic, sizeof(Magic)) != 0 || h.version != FormatVersion
+      || h.byteOrder != ByteOrder) return false;
+
+  auto fits = [size](uint64_t offset, uint64_t count, uint64_t itemSize) {
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / itemSize;
+  };
+  if (!fits(h.objects, h.objectCount, sizeof(ObjectRecord))
+      || !fits(h.groups, h.groupCount, sizeof(GroupRecord))
+      || !fits(h.members, h.memberCount, sizeof(uint32_t))
+      || !fits(h.chapters, h.chapterCount, sizeof(int32_t))
+      || !fits(h.names, h.nameCount, sizeof(uint32_t)) || (h.nameCount & (h.nameCount - 1)) != 0
+      || !fits(h.strings, h.stringsSize, 1)) return false;
+
+  objects_ = reinterpret_cast<const ObjectRecord*>(data_ + h.objects);
+  groups_ = reinterpret_cast<const GroupRecord*>(data_ + h.groups);
+  members_ = reinterpret_cast<const uint32_t*>(data_ + h.members);
+  chapters_ = reinterpret_cast<const int32_t*>(data_ + h.chapters);
+  names_ = reinterpret_cast<const uint32_t*>(data_ + h.names);
+  strings_ = data_ + h.strings;
+  objectCount_ = h.objectCount;
+  groupCount_ = h.groupCount;
+  memberCount_ = h.memberCount;
+  chapterCount_ = h.chapterCount;
+  nameCount_ = h.nameCount;
+  stringsSize_ = h.stringsSize;
+  sequence_ = h.sequence;
+  return true;
+}
+
+
+// checks that a record only refers to data inside the file
+bool CatalogFile::valid(ObjectRecord const& r) const {
+  return r.type >= PhotoType && r.type <= FilmType
+    && uint64_t(r.name) + r.nameLength <= stringsSize_ && uint64_t(r.file) + r.fileLength <= stringsSize_
+    && uint64_t(r.chapters) + r.chapterCount <= chapterCount_;
+}
+
+
+std::string_view CatalogFile::string(uint32_t offset, uint32_t length) const {
+  return std::string_view(strings_ + offset, length);
+}
+
+
+bool CatalogFile::objectAt(uint32_t index, Object& o) const {
+  if (index >= objectCount_ || !valid(objects_[index])) return false;
+  const ObjectRecord& r = objects_[index];
+  o.type = Type(r.type);
+  o.detached = (r.flags & DetachedFlag) != 0;
+  o.name = string(r.name, r.nameLength);
+  o.file = string(r.file, r.fileLength);
+  o.latitude = r.latitude;
+  o.longitude = r.longitude;
+  o.duree = r.duree;
+  o.chapters = chapters_ + r.chapters;
+  o.chapterCount = r.chapterCount;
+  return true;
+}
+
+
+bool CatalogFile::groupAt(uint32_t index, Group& g) const {
+  if (index >= groupCount_) return false;
+  const GroupRecord& r = groups_[index];
+  if (uint64_t(r.name) + r.nameLength > stringsSize_ || uint64_t(r.members) + r.memberCount > memberCount_)
+    return false;
+  for (uint32_t m = 0; m < r.memberCount; ++m) {
+    if (members_[r.members + m] >= objectCount_) return false;
+  }
+  g = Group{string(r.name, r.nameLength), members_ + r.members, r.memberCount};
+  return true;
+}
+
+
+bool CatalogFile::find(std::string_view name, uint32_t& index) const {
+  // the table of a valid file is never full, but the probes are bounded for the others
+  uint64_t mask = nameCount_ - 1, b = nameHash(name) & mask;
+  for (uint64_t probes = 0; probes < nameCount_ && names_[b]; ++probes, b = (b + 1) & mask) {
+    Object o;
+    if (objectAt(names_[b] - 1, o) && !o.detached && o.name == name) {
+      index = names_[b] - 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// slot of object _index_, nullptr if its chunk was not allocated yet and _create_ is false
+CatalogFile::Slot* CatalogFile::slot(uint32_t index, bool create) const {
+  std::atomic<Slot*>& chunk = chunks_[index / ChunkSize];
+  Slot* slots = chunk.load(std::memory_order_acquire);
+  if (!slots && create) {
+    Slot* fresh = new Slot[ChunkSize];
+    if (chunk.compare_exchange_strong(slots, fresh, std::memory_order_acq_rel)) slots = fresh;
+    else delete[] fresh;
+  }
+  return slots ? slots + index % ChunkSize : nullptr;
+}
+
+
+MultimediaPtr CatalogFile::object(uint32_t index, std::function<MultimediaPtr()> const& build) const {
+  Slot& slot = *this->slot(index, true);
+  if (slot.ready.load(std::memory_order_acquire)) return slot.object;
+  lock_guard<mutex> lock(mutexes_[index % 16]);
+  if (!slot.ready.load(std::memory_order_relaxed)) {
+    slot.object = build();
+    slot.ready.store(true, std::memory_order_release);
+  }
+  return slot.object;
+}
+
+
+MultimediaPtr CatalogFile::built(uint32_t index) const {
+  Slot* found = slot(index, false);
+  if (!found) return nullptr;
+  Slot& slot = *found;
+  if (slot.ready.load(std::memory_order_acquire)) return slot.object;
+  // waits for the object if it is being built
+  lock_guard<mutex> lock(mutexes_[index % 16]);
+  return slot.ready.load(std::memory_order_relaxed) ? slot.object : nullptr;
+}
+
+
+void CatalogFile::forEachBuilt(std::function<void(MultimediaObject*)> const& f) const {
+  for (uint32_t c = 0; c < (objectCount_ + ChunkSize - 1) / ChunkSize; ++c) {
+    if (!chunks_[c].load(std::memory_order_acquire)) continue;
+    for (uint32_t k = c * ChunkSize; k < objectCount_ && k < (c + 1) * ChunkSize; ++k) {
+      if (MultimediaPtr obj = built(k)) f(obj.get());
+    }
+  }
+}
@@ -3,6 +3,7 @@
 //  (c) Eric Lecolinet 2016/2020 - http://www.telecom-paristech.fr/~elc
 //
 
+#include <algorithm>
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
@@ -13,13 +14,23 @@
 
 #else
 #include <unistd.h>      // fcntl.h  won't compile without unistd.h !
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <climits>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #endif
 #include <fcntl.h>
+#include <cerrno>
 #include <csignal>
 #include "ccsocket.h"
 
+// SSE2/AVX2 separator scanning (selected at runtime, see findSeparator())
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define CCSOCKET_SIMD 1
+#  include <immintrin.h>
+#endif
+
 using namespace std;
 
 void Socket::startup() {
@@ -61,6 +72,21 @@ Socket::Socket(int type) {
 }
 
 
+Socket::Socket(Family family, int type) {
+  startup();
+#if defined(_WIN32) || defined(_WIN64)
+  sockfd_ = (family == Local) ? INVALID_SOCKET : ::socket(AF_INET, type, 0);
+#else
+  sockfd_ = ::socket(family == Local ? AF_UNIX : AF_INET, type, 0);
+#endif
+
+#if defined(SO_NOSIGPIPE)
+  int set = 1;
+  setsockopt(sockfd_, SOL_SOCKET, SO_NOSIGPIPE, (void*)&set, sizeof(int));
+#endif
+}
+
+
 Socket::Socket(int, SOCKET sockfd) : sockfd_(sockfd) {
   startup();
 }
@@ -131,6 +157,32 @@ int Socket::connect(const string& host, int port) {
 }
 
 
+// for Local sockets
+int Socket::localAddress(const string& path, bool connect) {
+  if (sockfd_ == INVALID_SOCKET) return InvalidSocket;
+#if defined(_WIN32) || defined(_WIN64)
+  return InvalidSocket;
+#else
+  struct sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) return UnknownHost;
+  ::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return connect ? ::connect(sockfd_, (SOCKADDR*)&addr, sizeof(addr))
+                 : ::bind(sockfd_, (SOCKADDR*)&addr, sizeof(addr));
+#endif
+}
+
+
+int Socket::connect(const string& path) {
+  return localAddress(path, true);
+}
+
+
+int Socket::bind(const string& path) {
+  return localAddress(path, false);
+}
+
+
 int Socket::close() {
   int stat = 0;
   if (sockfd_ != INVALID_SOCKET) {
@@ -146,6 +198,29 @@ int Socket::close() {
 }
 
 
+int Socket::setBlocking(bool state) {
+  if (sockfd_ == INVALID_SOCKET) return InvalidSocket;
+#if defined(_WIN32) || defined(_WIN64)
+  u_long mode = state ? 0 : 1;
+  return ::ioctlsocket(sockfd_, FIONBIO, &mode) == 0 ? 0 : Failed;
+#else
+  int flags = ::fcntl(sockfd_, F_GETFL, 0);
+  if (flags < 0) return Failed;
+  flags = state ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+  return ::fcntl(sockfd_, F_SETFL, flags) < 0 ? Failed : 0;
+#endif
+}
+
+
+bool Socket::wouldBlock() {
+#if defined(_WIN32) || defined(_WIN64)
+  return ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+
 void Socket::shutdownInput() {
   ::shutdown(sockfd_, 0);
 }
@@ -194,9 +269,13 @@ int Socket::setTcpNoDelay(bool state) {
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 
-ServerSocket::ServerSocket() {
+ServerSocket::ServerSocket(Socket::Family family) {
   Socket::startup();
-  sockfd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+#if defined(_WIN32) || defined(_WIN64)
+  sockfd_ = (family == Socket::Local) ? INVALID_SOCKET : ::socket(AF_INET, SOCK_STREAM, 0);
+#else
+  sockfd_ = ::socket(family == Socket::Local ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+#endif
 }
 
 ServerSocket::~ServerSocket() {
@@ -231,6 +310,25 @@ int ServerSocket::bind(int port, int backlog) {
 }
 
 
+int ServerSocket::bind(const std::string& path, int backlog) {
+  if (sockfd_ == INVALID_SOCKET) return Socket::InvalidSocket;
+#if defined(_WIN32) || defined(_WIN64)
+  return Socket::InvalidSocket;
+#else
+  struct sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) return Socket::UnknownHost;
+  ::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  ::unlink(path.c_str());   // removes the file of a previous server
+  if (::bind(sockfd_, (SOCKADDR*)&addr, sizeof(addr)) < 0) return -1;
+  path_ = path;
+  if (::listen(sockfd_, backlog) < 0) return -1;
+  return 0;
+#endif
+}
+
+
 int ServerSocket::close() {
   int stat = 0;
   if (sockfd_ != INVALID_SOCKET) {
@@ -239,13 +337,20 @@ int ServerSocket::close() {
     ::closesocket(sockfd_);
 #else
     ::close(sockfd_);
+    if (!path_.empty()) ::unlink(path_.c_str());
 #endif
   }
+  path_.clear();
   sockfd_ = INVALID_SOCKET;
   return stat;
 }
 
 
+void ServerSocket::shutdown() {
+  if (sockfd_ != INVALID_SOCKET) ::shutdown(sockfd_, 2);  // SHUT_RDWR=2
+}
+
+
 Socket* ServerSocket::accept() {
   SOCKET sock_com{};
 
@@ -274,6 +379,16 @@ int ServerSocket::setReuseAddress(bool state) {
 }
 
 
+int ServerSocket::setReusePort(bool state) {
+#if defined(SO_REUSEPORT)
+  int set = state;
+  return ::setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT, &set, sizeof(int));
+#else
+  return state ? -1 : 0;
+#endif
+}
+
+
 int ServerSocket::setSoTimeout(int timeout) {
   struct timeval tv;
   tv.tv_sec = timeout / 1000;             // ms to seconds
@@ -307,6 +422,26 @@ struct InputBuffer {
   char* begin;
   char* end;
   SOCKSIZE remaining;
+  std::string partial;  // beginning of the current line (used by tryReadLine())
+};
+
+
+struct OutputBuffer {
+  OutputBuffer(size_t size) :
+  buffer(new char[size]),
+  size(size) {
+  }
+
+  ~OutputBuffer() {
+    delete[] buffer;
+  }
+  char* buffer;
+  size_t size;
+  size_t used{};
+#if !defined(_WIN32) && !defined(_WIN64)
+  std::vector<struct iovec> iov;  // reused by gathered writes
+  std::vector<char> headers;      // frame headers, see writeFrames()
+#endif
 };
 
 
@@ -326,6 +461,7 @@ SocketBuffer::SocketBuffer(Socket& sock, size_t inSize, size_t outSize)
 
 SocketBuffer::~SocketBuffer() {
   delete in_;
+  delete out_;
 }
 
 
@@ -356,39 +492,239 @@ SOCKSIZE SocketBuffer::readLine(string& str) {
 }
 
 
-bool SocketBuffer::retrieveLine(string& str, SOCKSIZE received) {
-  if (received <= 0 || in_->begin > in_->end) {
-    in_->begin = in_->buffer;
-    return false;
+SOCKSIZE SocketBuffer::tryReadLine(string& str) {
+  str.clear();
+  if (!sock_) return Socket::InvalidSocket;
+  if (!in_) in_ = new InputBuffer(insize_);
+
+  // the beginning of the line may have been received by a previous call
+  while (true) {
+    if (retrieveLine(in_->partial, in_->remaining)) break;
+    SOCKSIZE received = sock_->receive(in_->begin, in_->end - in_->begin);
+    if (received < 0 && Socket::wouldBlock()) return Socket::WouldBlock;
+    if (received <= 0) return received;     // -1 (error) or 0 (shutdown)
+    if (retrieveLine(in_->partial, received)) break;
   }
+  str.swap(in_->partial);
+  return str.length() + 1;
+}
 
-  // search for separator
-  char* sep = nullptr;
-  int sepLen = 1;
 
-  if (insep_ < 0) {     // means: '\r' or '\n' or "\r\n"
-    for (char* p = in_->begin; p < in_->begin + received; ++p) {
-      if (*p == '\n') {
-        sep = p;
-        sepLen = 1;
-        break;
-      }
-      else if (*p == '\r') {
-        sep = p;
-        if (p < in_->begin + received - 1 && *(p + 1) == '\n') {
-          sepLen = 2;
-        }
-        break;
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Binary framing
+
+void SocketBuffer::encodeFrameHeader(char* header, size_t len, int opcode) {
+  header[0] = char((len >> 24) & 0xff);
+  header[1] = char((len >> 16) & 0xff);
+  header[2] = char((len >> 8) & 0xff);
+  header[3] = char(len & 0xff);
+  header[4] = char(opcode);
+}
+
+
+static size_t decodeFrameLength(const char* header) {
+  auto* h = reinterpret_cast<const unsigned char*>(header);
+  return (size_t(h[0]) << 24) | (size_t(h[1]) << 16) | (size_t(h[2]) << 8) | size_t(h[3]);
+}
+
+
+SOCKSIZE SocketBuffer::readFrame(string& payload, int& opcode) {
+  return receiveFrame(payload, opcode, true);
+}
+
+
+SOCKSIZE SocketBuffer::tryReadFrame(string& payload, int& opcode) {
+  return receiveFrame(payload, opcode, false);
+}
+
+
+// the frame is accumulated in in_->partial (header then payload) until it is complete.
+SOCKSIZE SocketBuffer::receiveFrame(string& payload, int& opcode, bool block) {
+  payload.clear();
+  if (!sock_) return Socket::InvalidSocket;
+  if (!in_) in_ = new InputBuffer(insize_);
+  string& frame = in_->partial;
+
+  while (true) {
+    // number of bytes that are still needed to complete the header or the frame
+    size_t needed = FrameHeaderSize;
+    if (frame.size() >= FrameHeaderSize) {
+      size_t len = decodeFrameLength(frame.data());
+      if (len > maxFrameSize_) {
+        frame.clear();
+        return Socket::Failed;
       }
+      needed += len;
+    }
+    needed -= frame.size();
+
+    if (needed == 0) {
+      opcode = static_cast<unsigned char>(frame[4]);
+      payload.assign(frame, FrameHeaderSize, string::npos);
+      SOCKSIZE total = frame.size();
+      frame.clear();
+      return total;
+    }
+
+    if (in_->remaining > 0) {
+      size_t count = std::min(needed, size_t(in_->remaining));
+      frame.append(in_->begin, count);
+      in_->begin += count;
+      in_->remaining -= count;
+      if (in_->remaining == 0) in_->begin = in_->buffer;
+      continue;
     }
+
+    in_->begin = in_->buffer;
+    SOCKSIZE received = sock_->receive(in_->begin, in_->end - in_->begin);
+    if (received < 0 && !block && Socket::wouldBlock()) return Socket::WouldBlock;
+    if (received <= 0) return received;     // -1 (error) or 0 (shutdown)
+    in_->remaining = received;
   }
-  else {
-    for (char* p = in_->begin; p < in_->begin + received; ++p)
-    if (*p == insep_) {
-      sep = p;
-      break;
+}
+
+
+bool SocketBuffer::hasFrame() const {
+  if (!in_ || in_->remaining <= 0 || in_->begin > in_->end) return false;
+  size_t available = in_->partial.size() + in_->remaining;
+  if (available < FrameHeaderSize) return false;
+
+  // the header may be partly in in_->partial
+  char header[FrameHeaderSize];
+  size_t k = 0;
+  for (; k < FrameHeaderSize && k < in_->partial.size(); ++k) header[k] = in_->partial[k];
+  for (size_t j = 0; k < FrameHeaderSize; ++k, ++j) header[k] = in_->begin[j];
+  return available >= FrameHeaderSize + decodeFrameLength(header);
+}
+
+
+// Scanning kernels: return the first byte equal to c1 or c2 in [p, end[, or end if there is none.
+// The vector kernels compare 16 (SSE2) or 64 (AVX2) bytes per iteration.
+
+static const char* scanScalar(const char* p, const char* end, char c1, char c2) {
+  for (; p < end; ++p) {
+    if (*p == c1 || *p == c2) return p;
+  }
+  return end;
+}
+
+#if defined(CCSOCKET_SIMD)
+
+__attribute__((target("sse2")))
+static const char* scanSSE2(const char* p, const char* end, char c1, char c2) {
+  const __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2);
+  for (; end - p >= 16; p += 16) {
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, v1), _mm_cmpeq_epi8(b, v2)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return scanScalar(p, end, c1, c2);
+}
+
+__attribute__((target("avx2")))
+static const char* scanAVX2(const char* p, const char* end, char c1, char c2) {
+  const __m256i v1 = _mm256_set1_epi8(c1), v2 = _mm256_set1_epi8(c2);
+
+  // 2 x 32 bytes per iteration, the masks are only computed when there is a match
+  for (; end - p >= 64; p += 64) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+    __m256i ma = _mm256_or_si256(_mm256_cmpeq_epi8(a, v1), _mm256_cmpeq_epi8(a, v2));
+    __m256i mb = _mm256_or_si256(_mm256_cmpeq_epi8(b, v1), _mm256_cmpeq_epi8(b, v2));
+    if (!_mm256_testz_si256(_mm256_or_si256(ma, mb), _mm256_or_si256(ma, mb))) {
+      unsigned maskA = unsigned(_mm256_movemask_epi8(ma));
+      if (maskA) return p + __builtin_ctz(maskA);
+      return p + 32 + __builtin_ctz(unsigned(_mm256_movemask_epi8(mb)));
     }
   }
+  for (; end - p >= 32; p += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(a, v1),
+                                                                  _mm256_cmpeq_epi8(a, v2))));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return scanSSE2(p, end, c1, c2);
+}
+
+#endif
+
+using ScanFunc = const char* (*)(const char*, const char*, char, char);
+
+// chooses the best kernel supported by the CPU (once, when the program starts)
+static ScanFunc selectScan() {
+#if defined(CCSOCKET_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return scanAVX2;
+  if (__builtin_cpu_supports("sse2")) return scanSSE2;
+#endif
+  return scanScalar;
+}
+
+static const ScanFunc scanSeparator = selectScan();
+
+
+bool SocketBuffer::hasScanKernel(ScanKernel kernel) {
+#if defined(CCSOCKET_SIMD)
+  __builtin_cpu_init();
+  if (kernel == ScanAVX2) return __builtin_cpu_supports("avx2");
+  if (kernel == ScanSSE2) return __builtin_cpu_supports("sse2");
+  return true;
+#else
+  return kernel == ScanBest || kernel == ScanScalar;
+#endif
+}
+
+
+const char* SocketBuffer::scan(ScanKernel kernel, const char* begin, const char* end, char c1, char c2) {
+  switch (kernel) {
+#if defined(CCSOCKET_SIMD)
+  case ScanAVX2: return scanAVX2(begin, end, c1, c2);
+  case ScanSSE2: return scanSSE2(begin, end, c1, c2);
+#endif
+  case ScanScalar: return scanScalar(begin, end, c1, c2);
+  default: return scanSeparator(begin, end, c1, c2);
+  }
+}
+
+
+// returns the first separator in [begin, end[ and its length, or nullptr if there is none.
+const char* SocketBuffer::findSeparator(const char* begin, const char* end, int& sepLen) const {
+  sepLen = 1;
+
+  if (insep_ < 0) {     // means: '\r' or '\n' or "\r\n"
+    const char* p = scanSeparator(begin, end, '\n', '\r');
+    if (p == end) return nullptr;
+    if (*p == '\r' && p < end - 1 && *(p + 1) == '\n') sepLen = 2;
+    return p;
+  }
+  else {
+    const char* p = scanSeparator(begin, end, char(insep_), char(insep_));
+    return p == end ? nullptr : p;
+  }
+}
+
+
+bool SocketBuffer::hasLine() const {
+  if (!in_ || in_->remaining <= 0 || in_->begin > in_->end) return false;
+  int sepLen;
+  return findSeparator(in_->begin, in_->begin + in_->remaining, sepLen) != nullptr;
+}
+
+
+bool SocketBuffer::hasPendingInput() const {
+  return in_ && (!in_->partial.empty() || in_->remaining > 0);
+}
+
+
+bool SocketBuffer::retrieveLine(string& str, SOCKSIZE received) {
+  if (received <= 0 || in_->begin > in_->end) {
+    in_->begin = in_->buffer;
+    return false;
+  }
+
+  // search for separator
+  int sepLen = 1;
+  char* sep = const_cast<char*>(findSeparator(in_->begin, in_->begin + received, sepLen));
 
   if (sep) {
     str.append(in_->begin, sep - in_->begin);
@@ -405,34 +741,222 @@ bool SocketBuffer::retrieveLine(string& str, SOCKSIZE received) {
 }
 
 
+#if !defined(_WIN32) && !defined(_WIN64)
+
+// sends all the buffers in _iov_ by as few system calls as possible (iov is modified).
+static SOCKSIZE sendGathered(Socket* sock, std::vector<struct iovec>& iov) {
+  struct msghdr msg{};
+  size_t first = 0;
+  SOCKSIZE total = 0;
+
+  while (first < iov.size()) {
+    msg.msg_iov = &iov[first];
+    msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+    // sendmsg() rather than writev() so that SIGPIPE can be ignored
+    SOCKSIZE sent = ::sendmsg(sock->descriptor(), &msg, NO_SIGPIPE_(0));
+    if (sent <= 0) return sent;     // -1 (error) or 0 (shutdown)
+    total += sent;
+
+    // skips the buffers that were entirely sent, adjusts the one that was partially sent
+    while (first < iov.size() && size_t(sent) >= iov[first].iov_len) {
+      sent -= iov[first].iov_len;
+      ++first;
+    }
+    if (sent > 0) {
+      iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + sent;
+      iov[first].iov_len -= sent;
+    }
+  }
+  return total;
+}
+
+#endif
+
+
+void SocketBuffer::setAutoFlush(bool state) {
+  autoFlush_ = state;
+}
+
+
+SOCKSIZE SocketBuffer::flush() {
+  if (!sock_) return Socket::InvalidSocket;
+  if (!out_ || out_->used == 0) return 0;
+  size_t used = out_->used;
+  out_->used = 0;     // the buffer is emptied even if an error occurs
+  return write(out_->buffer, used);
+}
+
+
 SOCKSIZE SocketBuffer::writeLine(const string& str) {
   if (!sock_) return Socket::InvalidSocket;
+  if (!out_) out_ = new OutputBuffer(outsize_);
+
+  // a negative value of outsep means that \r\n must be added
+  const char sep[] = {outsep_ < 0 ? '\r' : char(outsep_), '\n'};
+  size_t sepLen = (outsep_ < 0 ? 2 : 1);
+  size_t msglen = str.length() + sepLen;
+
+#if !defined(_WIN32) && !defined(_WIN64)
+  // pending data, message and separator are sent together without being copied
+  if (autoFlush_ || out_->used + msglen > out_->size) {
+    auto& iov = out_->iov;
+    iov.clear();
+    if (out_->used > 0) iov.push_back({out_->buffer, out_->used});
+    if (!str.empty()) iov.push_back({const_cast<char*>(str.data()), str.length()});
+    iov.push_back({const_cast<char*>(sep), sepLen});
+    out_->used = 0;
+
+    SOCKSIZE stat = sendGathered(sock_, iov);
+    return stat <= 0 ? stat : SOCKSIZE(msglen);
+  }
+#else
+  if (out_->used + msglen > out_->size) {
+    SOCKSIZE stat = flush();
+    if (stat < 0) return stat;
+    if (msglen > out_->size) {
+      stat = write(str.data(), str.length());
+      if (stat <= 0) return stat;
+      stat = write(sep, sepLen);
+      return stat <= 0 ? stat : SOCKSIZE(msglen);
+    }
+  }
+#endif
+
+  // the message is copied into the output buffer, which is sent by flush()
+  ::memcpy(out_->buffer + out_->used, str.data(), str.length());
+  ::memcpy(out_->buffer + out_->used + str.length(), sep, sepLen);
+  out_->used += msglen;
+
+  if (!autoFlush_) return msglen;
+  SOCKSIZE stat = flush();
+  return stat <= 0 ? stat : SOCKSIZE(msglen);
+}
+
+
+SOCKSIZE SocketBuffer::writeLines(const std::vector<string>& messages) {
+  if (!sock_) return Socket::InvalidSocket;
 
-  size_t strlen = str.length();
-  // a negature value of outsep means that \r\n must be added
-  size_t msglen = strlen + (outsep_ < 0 ? 2 : 1);
+#if defined(_WIN32) || defined(_WIN64)
+  bool autoFlush = autoFlush_;
+  autoFlush_ = false;
+  SOCKSIZE total = 0;
+  for (auto& m : messages) {
+    SOCKSIZE sent = writeLine(m);
+    if (sent <= 0) {autoFlush_ = autoFlush; return sent;}
+    total += sent;
+  }
+  autoFlush_ = autoFlush;
+  if (autoFlush_) {
+    SOCKSIZE stat = flush();
+    if (stat < 0) return stat;
+  }
+  return total;
+#else
+  if (!out_) out_ = new OutputBuffer(outsize_);
+
+  // a negative value of outsep means that \r\n must be added
+  char sep[] = {outsep_ < 0 ? '\r' : char(outsep_), '\n'};
+  size_t sepLen = (outsep_ < 0 ? 2 : 1);
+
+  // pending data then each message followed by the separator
+  auto& iov = out_->iov;
+  iov.clear();
+  if (out_->used > 0) iov.push_back({out_->buffer, out_->used});
+  for (auto& m : messages) {
+    if (!m.empty()) iov.push_back({const_cast<char*>(m.data()), m.size()});
+    iov.push_back({sep, sepLen});
+  }
+  out_->used = 0;
+  return sendGathered(sock_, iov);
+#endif
+}
 
-  // if msglen is not too large, try to write string + outsep in one block
-  if (msglen <= outsize_) {
-    char* buf = new char[msglen];
-    ::memcpy(buf, str.data(), strlen);
 
-    if (outsep_ >= 0) buf[msglen - 1] = char(outsep_);
-    else {
-      buf[msglen - 2] = '\r';
-      buf[msglen - 1] = '\n';
+SOCKSIZE SocketBuffer::writeFrame(const string& payload, int opcode) {
+  if (!sock_) return Socket::InvalidSocket;
+  if (!out_) out_ = new OutputBuffer(outsize_);
+
+  char header[FrameHeaderSize];
+  encodeFrameHeader(header, payload.size(), opcode);
+  size_t framelen = FrameHeaderSize + payload.size();
+
+#if !defined(_WIN32) && !defined(_WIN64)
+  // pending data, header and payload are sent together without being copied
+  if (autoFlush_ || out_->used + framelen > out_->size) {
+    auto& iov = out_->iov;
+    iov.clear();
+    if (out_->used > 0) iov.push_back({out_->buffer, out_->used});
+    iov.push_back({header, FrameHeaderSize});
+    if (!payload.empty()) iov.push_back({const_cast<char*>(payload.data()), payload.size()});
+    out_->used = 0;
+
+    SOCKSIZE stat = sendGathered(sock_, iov);
+    return stat <= 0 ? stat : SOCKSIZE(framelen);
+  }
+#else
+  if (out_->used + framelen > out_->size) {
+    SOCKSIZE stat = flush();
+    if (stat < 0) return stat;
+    if (framelen > out_->size) {
+      stat = write(header, FrameHeaderSize);
+      if (stat <= 0) return stat;
+      if (!payload.empty()) stat = write(payload.data(), payload.size());
+      return stat <= 0 ? stat : SOCKSIZE(framelen);
     }
-    auto stat = write(buf, msglen);
-    delete[] buf;
-    return stat;
   }
-  else {
-    SOCKSIZE sent = write(str.data(), strlen);
-    char buf[] = {char(outsep_), 0};
-    if (outsep_ >= 0) sent += sock_->send(buf, 1);
-    else sent += sock_->send("\r\n", 2);
-    return sent;
+#endif
+
+  // the frame is copied into the output buffer, which is sent by flush()
+  ::memcpy(out_->buffer + out_->used, header, FrameHeaderSize);
+  ::memcpy(out_->buffer + out_->used + FrameHeaderSize, payload.data(), payload.size());
+  out_->used += framelen;
+
+  if (!autoFlush_) return framelen;
+  SOCKSIZE stat = flush();
+  return stat <= 0 ? stat : SOCKSIZE(framelen);
+}
+
+
+SOCKSIZE SocketBuffer::writeFrames(const std::vector<string>& payloads, int opcode) {
+  if (!sock_) return Socket::InvalidSocket;
+
+#if defined(_WIN32) || defined(_WIN64)
+  bool autoFlush = autoFlush_;
+  autoFlush_ = false;
+  SOCKSIZE total = 0;
+  for (auto& p : payloads) {
+    SOCKSIZE sent = writeFrame(p, opcode);
+    if (sent <= 0) {autoFlush_ = autoFlush; return sent;}
+    total += sent;
   }
+  autoFlush_ = autoFlush;
+  if (autoFlush_) {
+    SOCKSIZE stat = flush();
+    if (stat < 0) return stat;
+  }
+  return total;
+#else
+  if (!out_) out_ = new OutputBuffer(outsize_);
+
+  // the headers must not move once the iovecs point to them
+  auto& headers = out_->headers;
+  headers.resize(payloads.size() * FrameHeaderSize);
+
+  // pending data then the header and the payload of each frame
+  auto& iov = out_->iov;
+  iov.clear();
+  if (out_->used > 0) iov.push_back({out_->buffer, out_->used});
+  for (size_t k = 0; k < payloads.size(); ++k) {
+    char* header = &headers[k * FrameHeaderSize];
+    encodeFrameHeader(header, payloads[k].size(), opcode);
+    iov.push_back({header, FrameHeaderSize});
+    if (!payloads[k].empty()) {
+      iov.push_back({const_cast<char*>(payloads[k].data()), payloads[k].size()});
+    }
+  }
+  out_->used = 0;
+  return sendGathered(sock_, iov);
+#endif
 }
 
 
@@ -16,28 +16,50 @@ static const int PORT = 3331;
 /// recupere sa reponse et l'affiche sur le Terminal.
 /// Noter que le programme bloque si le serveur ne repond pas.
 ///
+/// Option -binary : utilise des trames binaires (cf. SocketBuffer::readFrame())
+/// au lieu de lignes, les reponses peuvent alors contenir des '\n'.
+/// Option -local path : se connecte au socket Unix _path_ du serveur
+/// (cf. TCPServer::setLocalPath()) au lieu du port TCP.
+///
+
+int main(int argc, char* argv[]) {
+  bool binary = false;
+  std::string localPath;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-binary") binary = true;
+    else if (arg == "-local" && i + 1 < argc) localPath = argv[++i];
+  }
 
-int main() {
-  Socket sock;
+  Socket sock(localPath.empty() ? Socket::Inet : Socket::Local);
   SocketBuffer sockbuf(sock);
 
-  int status = sock.connect(HOST, PORT);
+  int status = localPath.empty() ? sock.connect(HOST, PORT) : sock.connect(localPath);
+  std::string address = localPath.empty() ? HOST + ":" + std::to_string(PORT) : localPath;
 
   if (status < 0) {
     switch (status) {
       case Socket::Failed:
-        std::cerr << "Client: Couldn't reach host " << HOST << ":" << PORT << std::endl;
+        std::cerr << "Client: Couldn't reach host " << address << std::endl;
         return 1;
       case Socket::UnknownHost:
-        std::cerr << "Client: Couldn't find host " << HOST << ":" << PORT << std::endl;
+        std::cerr << "Client: Couldn't find host " << address << std::endl;
         return 1;
       default:
-        std::cerr << "Client: Couldn't connect host " << HOST << ":" << PORT << std::endl;
+        std::cerr << "Client: Couldn't connect host " << address << std::endl;
         return 1;
     }
   }
 
-  std::cout << "Client connected to " << HOST << ":" << PORT << std::endl;
+  std::cout << "Client connected to " << address << std::endl;
+
+  if (binary) {
+    std::string response;
+    if (sockbuf.writeLine("FRAMING BINARY") < 0 || sockbuf.readLine(response) < 0 || response != "OK") {
+      std::cerr << "Client: Server does not support binary framing" << std::endl;
+      return 2;
+    }
+  }
 
   while (std::cin) {
     std::cout << "Request: ";
@@ -47,21 +69,23 @@ int main() {
     if (request == "quit") return 0;
 
     // Envoyer la requete au serveur
-    if (sockbuf.writeLine(request) < 0) {
+    // (1 et 2 sont les opcodes des requetes et des reponses, cf. TCPServer::FrameOpcode)
+    int opcode = 1;
+    if ((binary ? sockbuf.writeFrame(request, opcode) : sockbuf.writeLine(request)) < 0) {
       std::cerr << "Client: Couldn't send message" << std::endl;
       return 2;
     }
 
     // Recuperer le resultat envoye par le serveur
-    if (sockbuf.readLine(response) < 0) {
+    if ((binary ? sockbuf.readFrame(response, opcode) : sockbuf.readLine(response)) < 0) {
       std::cerr << "Client: Couldn't receive message" << std::endl;
       return 2;
     }
 
     // Le serveur remplace les '\n' par des ';' car '\n' sert a indiquer la
     // fin d'un message entre le client et le serveur
-    // On fait ici la transformation inverse
-    std::replace(response.begin(), response.end(), ';', '\n');
+    // On fait ici la transformation inverse (inutile en mode binaire)
+    if (!binary) std::replace(response.begin(), response.end(), ';', '\n');
 
     std::cout << "Response: " << response << std::endl;
   }
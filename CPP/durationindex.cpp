@@ -0,0 +1,152 @@
+//
+//  durationindex: persistent ordered index of names by duration.
+//
+
+#include <algorithm>
+#include <functional>
+#include "durationindex.h"
+using namespace std;
+
+
+bool DurationIndex::less(Entry const& a, Entry const& b) {
+  return a.duration < b.duration || (a.duration == b.duration && a.name < b.name);
+}
+
+
+size_t DurationIndex::priority(std::string_view name) {
+  return std::hash<std::string_view>()(name) * 0x9E3779B97F4A7C15ull;
+}
+
+
+bool DurationIndex::contains(Entry const& entry) const {
+  Node const* node = root_.get();
+  while (node) {
+    if (less(entry, node->entry)) node = node->left.get();
+    else if (less(node->entry, entry)) node = node->right.get();
+    else return true;
+  }
+  return false;
+}
+
+
+DurationIndex DurationIndex::insert(std::string_view name, int duration) const {
+  if (contains(Entry{name, duration})) return *this;
+  auto added = std::make_shared<Node>();
+  added->entry = Entry{name, duration};
+  added->priority = priority(name);
+  return DurationIndex(insert(root_, added), size_ + 1);
+}
+
+
+DurationIndex DurationIndex::insert(std::vector<Entry> entries) const {
+  std::sort(entries.begin(), entries.end(), less);
+  auto same = [](Entry const& a, Entry const& b) {return !less(a, b) && !less(b, a);};
+  entries.erase(std::unique(entries.begin(), entries.end(), same), entries.end());
+  entries.erase(std::remove_if(entries.begin(), entries.end(), [this](Entry const& e) {return contains(e);}),
+                entries.end());
+  if (entries.empty()) return *this;
+
+  // the entries are sorted: their tree is built from left to right, _path_ is its right spine
+  std::vector<std::shared_ptr<Node>> path;
+  for (auto& e : entries) {
+    auto node = std::make_shared<Node>();
+    node->entry = e;
+    node->priority = priority(e.name);
+    std::shared_ptr<Node> below;
+    while (!path.empty() && path.back()->priority < node->priority) {
+      below = path.back();
+      path.pop_back();
+    }
+    node->left = below;
+    if (!path.empty()) path.back()->right = node;
+    path.push_back(node);
+  }
+  return DurationIndex(unite(root_, path.front()), size_ + entries.size());
+}
+
+
+DurationIndex DurationIndex::erase(std::string_view name, int duration) const {
+  bool removed = false;
+  NodePtr root = erase(root_, Entry{name, duration}, removed);
+  return DurationIndex(root, removed ? size_ - 1 : size_);
+}
+
+
+// copies the path of _entry_: the entries of _node_ that are smaller go to _left_, the others to _right_
+void DurationIndex::split(NodePtr const& node, Entry const& entry, NodePtr& left, NodePtr& right) {
+  if (!node) {
+    left = right = nullptr;
+    return;
+  }
+  auto copy = std::make_shared<Node>(*node);
+  if (less(node->entry, entry)) {
+    split(node->right, entry, copy->right, right);
+    left = copy;
+  }
+  else {
+    split(node->left, entry, left, copy->left);
+    right = copy;
+  }
+}
+
+
+// the entries of _left_ are smaller than those of _right_
+DurationIndex::NodePtr DurationIndex::merge(NodePtr const& left, NodePtr const& right) {
+  if (!left) return right;
+  if (!right) return left;
+  if (left->priority > right->priority) {
+    auto copy = std::make_shared<Node>(*left);
+    copy->right = merge(left->right, right);
+    return copy;
+  }
+  auto copy = std::make_shared<Node>(*right);
+  copy->left = merge(left, right->left);
+  return copy;
+}
+
+
+// union of two trees that have no entry in common: only the nodes of _a_ and _b_ whose
+// subtrees overlap the other tree are copied
+DurationIndex::NodePtr DurationIndex::unite(NodePtr const& a, NodePtr const& b) {
+  if (!a) return b;
+  if (!b) return a;
+  if (a->priority < b->priority) return unite(b, a);
+  auto copy = std::make_shared<Node>(*a);
+  NodePtr left, right;
+  split(b, a->entry, left, right);
+  copy->left = unite(a->left, left);
+  copy->right = unite(a->right, right);
+  return copy;
+}
+
+
+// returns a copy of _node_ with _added_, whose entry is not in _node_
+DurationIndex::NodePtr DurationIndex::insert(NodePtr const& node, std::shared_ptr<Node> const& added) {
+  if (!node) return added;
+  if (added->priority > node->priority) {
+    // _added_ becomes the root of this subtree
+    split(node, added->entry, added->left, added->right);
+    return added;
+  }
+  auto copy = std::make_shared<Node>(*node);
+  if (less(added->entry, node->entry)) copy->left = insert(node->left, added);
+  else copy->right = insert(node->right, added);
+  return copy;
+}
+
+
+// returns _node_ without _entry_ (_node_ itself if it was not found)
+DurationIndex::NodePtr DurationIndex::erase(NodePtr const& node, Entry const& entry, bool& removed) {
+  if (!node) return node;
+  bool smaller = less(entry, node->entry);
+  if (!smaller && !less(node->entry, entry)) {
+    removed = true;
+    return merge(node->left, node->right);
+  }
+  NodePtr const& child = smaller ? node->left : node->right;
+  NodePtr newChild = erase(child, entry, removed);
+  if (!removed) return node;
+  auto copy = std::make_shared<Node>(*node);
+  (smaller ? copy->left : copy->right) = newChild;
+  return copy;
+}
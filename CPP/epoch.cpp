@@ -0,0 +1,83 @@
+//
+//  epoch: epoch-based reclamation of the memory shared with lock-free readers.
+//
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
+#include "epoch.h"
+using namespace std;
+
+// slot where the current thread starts looking for a free slot: threads use different
+// slots most of the time, so that they don't write to the same cache lines
+static thread_local size_t slotHint = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+
+EpochDomain::Guard::Guard(EpochDomain& domain) {
+  // announcing an epoch older than the current one is harmless: it only delays reclamation
+  uint64_t epoch = domain.epoch_.load();
+  for (size_t k = slotHint;; ++k) {
+    auto& slot = domain.slots_[k % SlotCount].epoch;
+    uint64_t free = 0;
+    if (slot.load(std::memory_order_relaxed) == 0 && slot.compare_exchange_strong(free, epoch)) {
+      slot_ = &slot;
+      slotHint = k % SlotCount;
+      return;
+    }
+    // all the slots are used: waits for a reader to leave
+    if ((k + 1 - slotHint) % SlotCount == 0) std::this_thread::yield();
+  }
+}
+
+
+EpochDomain::Guard::~Guard() {
+  slot_->store(0, std::memory_order_release);
+}
+
+
+EpochDomain::~EpochDomain() {
+  for (auto& r : retired_) r.deleter(r.object);
+}
+
+
+// oldest epoch announced by a reader (max value if there is no reader)
+uint64_t EpochDomain::oldestReader() const {
+  uint64_t oldest = std::numeric_limits<uint64_t>::max();
+  for (auto& s : slots_) {
+    uint64_t epoch = s.epoch.load();
+    if (epoch != 0 && epoch < oldest) oldest = epoch;
+  }
+  return oldest;
+}
+
+
+void EpochDomain::retire(void* p, void (*deleter)(void*)) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    // readers that announce a later epoch cannot reach _p_
+    retired_.push_back({p, deleter, epoch_.fetch_add(1)});
+  }
+  collect();
+}
+
+
+void EpochDomain::collect() {
+  vector<Retired> expired;
+  {
+    lock_guard<mutex> lock(mutex_);
+    uint64_t oldest = oldestReader();
+    auto it = std::partition(retired_.begin(), retired_.end(),
+                             [oldest](Retired const& r) {return r.epoch >= oldest;});
+    expired.assign(it, retired_.end());
+    retired_.erase(it, retired_.end());
+  }
+  // deleted without holding the lock (deleters may be slow)
+  for (auto& r : expired) r.deleter(r.object);
+}
+
+
+size_t EpochDomain::retired() const {
+  lock_guard<mutex> lock(mutex_);
+  return retired_.size();
+}
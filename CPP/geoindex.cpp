@@ -0,0 +1,316 @@
+//
+//  geoindex: persistent geohash quadtree of named places for location queries.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include "geoindex.h"
+using namespace std;
+
+struct GeoIndex::Node {
+  size_t count{};                       // number of places in the cell
+  bool leaf{true};
+  std::vector<Entry> entries;           // if leaf
+  std::array<NodePtr, 4> children;      // otherwise, indexed by the bits of the geohash
+};
+
+static const double EarthRadius = 6371.0088;    // mean radius in km
+static const double Pi = 3.14159265358979323846;
+
+
+// quarter of a cell of level _depth_ that contains _key_ (longitude bit, then latitude bit)
+static unsigned quarter(uint64_t key, unsigned depth) {
+  return unsigned(key >> (62 - 2 * depth)) & 3;
+}
+
+
+// interleaves the bits of the longitude and of the latitude quantized on 32 bits
+// (NaN, which the callers reject, is quantized to 0 rather than converted)
+uint64_t GeoIndex::geohash(double latitude, double longitude) {
+  auto quantize = [](double v, double min, double max) -> uint64_t {
+    double q = std::floor((v - min) / (max - min) * 4294967296.0);
+    return q >= 4294967295.0 ? 4294967295u : q > 0 ? uint64_t(q) : 0;
+  };
+  uint64_t x = quantize(longitude, -180, 180), y = quantize(latitude, -90, 90), key = 0;
+  for (int b = 31; b >= 0; --b) key = (key << 2) | (((x >> b) & 1) << 1) | ((y >> b) & 1);
+  return key;
+}
+
+
+double GeoIndex::distance(double latitude1, double longitude1, double latitude2, double longitude2) {
+  double rad = Pi / 180;
+  double dlat = (latitude2 - latitude1) * rad, dlon = (longitude2 - longitude1) * rad;
+  double a = std::sin(dlat / 2) * std::sin(dlat / 2) +
+    std::cos(latitude1 * rad) * std::cos(latitude2 * rad) * std::sin(dlon / 2) * std::sin(dlon / 2);
+  return 2 * EarthRadius * std::asin(std::min(1.0, std::sqrt(a)));
+}
+
+
+GeoIndex::GeoIndex() {}
+
+
+size_t GeoIndex::size() const {
+  return root_ ? root_->count : 0;
+}
+
+
+GeoIndex GeoIndex::insert(Place const& place) const {
+  return GeoIndex(insert(root_, 0, Entry{geohash(place.latitude, place.longitude), place}));
+}
+
+
+GeoIndex GeoIndex::insert(std::vector<Place> const& places) const {
+  if (places.empty()) return *this;
+  std::vector<Entry> entries;
+  entries.reserve(places.size());
+  for (auto& p : places) entries.push_back(Entry{geohash(p.latitude, p.longitude), p});
+  std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) {return a.key < b.key;});
+  return GeoIndex(insert(root_, 0, entries.data(), entries.data() + entries.size()));
+}
+
+
+GeoIndex GeoIndex::erase(std::string_view name, double latitude, double longitude) const {
+  if (!root_) return *this;
+  return GeoIndex(erase(root_, 0, geohash(latitude, longitude), name));
+}
+
+
+// returns a copy of _node_ (cell of level _depth_) that also contains _entry_
+GeoIndex::NodePtr GeoIndex::insert(NodePtr const& node, unsigned depth, Entry const& entry) {
+  auto copy = node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+  ++copy->count;
+
+  if (!copy->leaf) {
+    auto& child = copy->children[quarter(entry.key, depth)];
+    child = insert(child, depth + 1, entry);
+    return copy;
+  }
+
+  copy->entries.push_back(entry);
+  if (copy->entries.size() > LeafSize && depth < MaxDepth) {
+    // the cell is split in 4 (recursively if all its places are in the same quarter)
+    std::vector<Entry> entries;
+    entries.swap(copy->entries);
+    copy->leaf = false;
+    for (auto& e : entries) {
+      auto& child = copy->children[quarter(e.key, depth)];
+      child = insert(child, depth + 1, e);
+    }
+  }
+  return copy;
+}
+
+
+// returns a copy of _node_ (cell of level _depth_) that also contains the entries [first, last),
+// which are sorted by geohash: the entries of each quarter of the cell are contiguous
+GeoIndex::NodePtr GeoIndex::insert(NodePtr const& node, unsigned depth, Entry const* first, Entry const* last) {
+  auto copy = node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+  copy->count += size_t(last - first);
+
+  std::vector<Entry> entries;
+  if (copy->leaf) {
+    copy->entries.insert(copy->entries.end(), first, last);
+    if (copy->entries.size() <= LeafSize || depth >= MaxDepth) return copy;
+    // the cell is split in 4, its places are inserted in the quarters with the new ones
+    entries.swap(copy->entries);
+    std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) {return a.key < b.key;});
+    copy->leaf = false;
+    first = entries.data();
+    last = entries.data() + entries.size();
+  }
+  for (unsigned q = 0; q < 4 && first != last; ++q) {
+    Entry const* end = std::partition_point(first, last, [&](Entry const& e) {return quarter(e.key, depth) == q;});
+    if (end == first) continue;
+    auto& child = copy->children[q];
+    child = insert(child, depth + 1, first, end);
+    first = end;
+  }
+  return copy;
+}
+
+
+// returns _node_ without the entry (_node_ itself if not found, nullptr if it is empty)
+GeoIndex::NodePtr GeoIndex::erase(NodePtr const& node, unsigned depth, uint64_t key,
+                                  std::string_view name) {
+  if (node->leaf) {
+    auto it = std::find_if(node->entries.begin(), node->entries.end(),
+                           [&](Entry const& e) {return e.key == key && e.place.name == name;});
+    if (it == node->entries.end()) return node;
+    if (node->count == 1) return nullptr;
+    auto copy = std::make_shared<Node>(*node);
+    copy->entries.erase(copy->entries.begin() + (it - node->entries.begin()));
+    --copy->count;
+    return copy;
+  }
+
+  unsigned q = quarter(key, depth);
+  if (!node->children[q]) return node;
+  NodePtr child = erase(node->children[q], depth + 1, key, name);
+  if (child == node->children[q]) return node;
+  if (node->count == 1) return nullptr;
+
+  auto copy = std::make_shared<Node>(*node);
+  copy->children[q] = child;
+  --copy->count;
+  // the cell becomes a leaf again when it is small enough
+  if (copy->count <= LeafSize / 2) {
+    auto leaf = std::make_shared<Node>();
+    leaf->count = copy->count;
+    gather(*copy, leaf->entries);
+    return leaf;
+  }
+  return copy;
+}
+
+
+void GeoIndex::gather(Node const& node, std::vector<Entry>& entries) {
+  if (node.leaf) entries.insert(entries.end(), node.entries.begin(), node.entries.end());
+  else for (auto& child : node.children) if (child) gather(*child, entries);
+}
+
+
+// adds the places of _node_ that are inside _box_, _cell_ is the area covered by _node_
+void GeoIndex::search(Node const& node, Box const& cell, Box const& box, size_t limit,
+                      std::vector<Place>& places) {
+  if (limit > 0 && places.size() >= limit) return;
+  if (node.leaf) {
+    for (auto& e : node.entries) {
+      Place const& p = e.place;
+      if (p.latitude >= box.minLatitude && p.latitude <= box.maxLatitude &&
+          p.longitude >= box.minLongitude && p.longitude <= box.maxLongitude) {
+        places.push_back(p);
+        if (limit > 0 && places.size() >= limit) return;
+      }
+    }
+    return;
+  }
+
+  double midLongitude = (cell.minLongitude + cell.maxLongitude) / 2;
+  double midLatitude = (cell.minLatitude + cell.maxLatitude) / 2;
+  for (unsigned q = 0; q < 4; ++q) {
+    if (!node.children[q]) continue;
+    Box quarter = cell;
+    if (q & 2) quarter.minLongitude = midLongitude; else quarter.maxLongitude = midLongitude;
+    if (q & 1) quarter.minLatitude = midLatitude; else quarter.maxLatitude = midLatitude;
+    // cells are closed on both sides so that rounding can't exclude a place on their border
+    if (quarter.maxLatitude < box.minLatitude || quarter.minLatitude > box.maxLatitude ||
+        quarter.maxLongitude < box.minLongitude || quarter.minLongitude > box.maxLongitude) continue;
+    search(*node.children[q], quarter, box, limit, places);
+  }
+}
+
+
+std::vector<GeoIndex::Place> GeoIndex::within(double minLatitude, double minLongitude,
+                                              double maxLatitude, double maxLongitude,
+                                              size_t limit) const {
+  std::vector<Place> places;
+  if (!root_) return places;
+  Box world{-90, -180, 90, 180};
+  if (minLongitude <= maxLongitude) {
+    search(*root_, world, Box{minLatitude, minLongitude, maxLatitude, maxLongitude}, limit, places);
+  }
+  else {
+    // crosses the 180th meridian: one box on each side
+    search(*root_, world, Box{minLatitude, minLongitude, maxLatitude, 180}, limit, places);
+    search(*root_, world, Box{minLatitude, -180, maxLatitude, maxLongitude}, limit, places);
+  }
+  return places;
+}
+
+
+// lower bound of the distance in km between the point and the places of _cell_
+double GeoIndex::minDistance(Box const& cell, double latitude, double longitude) {
+  double rad = Pi / 180;
+  // the cell is inside the band of its latitudes...
+  double bound = std::max({0.0, cell.minLatitude - latitude, latitude - cell.maxLatitude}) * rad;
+  if (longitude < cell.minLongitude || longitude > cell.maxLongitude) {
+    // ... and inside the lune of its longitudes, whose nearest border is a half meridian
+    auto gap = [&](double meridian) {return std::abs(std::remainder(longitude - meridian, 360.0));};
+    double dlon = std::min(gap(cell.minLongitude), gap(cell.maxLongitude)) * rad;
+    double toLune = dlon < Pi / 2
+      ? std::asin(std::min(1.0, std::cos(latitude * rad) * std::sin(dlon)))
+      : Pi / 2 - std::abs(latitude) * rad;      // the nearest point of the half meridian is a pole
+    bound = std::max(bound, toLune);
+  }
+  return bound * EarthRadius;
+}
+
+
+// best-first search: cells and places are taken from a queue ordered by their distance (a lower
+// bound for a cell), so a place taken from the queue is nearer than everything left in it
+std::vector<GeoIndex::Neighbor> GeoIndex::nearest(double latitude, double longitude,
+                                                  double radius, size_t k) const {
+  struct Candidate {
+    double distance;
+    Node const* node;                   // nullptr for a place
+    Box cell;
+    Place const* place;
+    bool operator>(Candidate const& c) const {return distance > c.distance;}
+  };
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+  std::vector<Neighbor> neighbors;
+  if (!root_) return neighbors;
+  queue.push(Candidate{0, root_.get(), Box{-90, -180, 90, 180}, nullptr});
+
+  while (!queue.empty() && neighbors.size() < k) {
+    Candidate c = queue.top();
+    queue.pop();
+    if (c.distance > radius) break;
+    if (!c.node) {
+      neighbors.push_back(Neighbor{*c.place, c.distance});
+      continue;
+    }
+    if (c.node->leaf) {
+      for (auto& e : c.node->entries) {
+        double d = distance(latitude, longitude, e.place.latitude, e.place.longitude);
+        if (d <= radius) queue.push(Candidate{d, nullptr, c.cell, &e.place});
+      }
+      continue;
+    }
+    double midLongitude = (c.cell.minLongitude + c.cell.maxLongitude) / 2;
+    double midLatitude = (c.cell.minLatitude + c.cell.maxLatitude) / 2;
+    for (unsigned q = 0; q < 4; ++q) {
+      if (!c.node->children[q]) continue;
+      Box quarter = c.cell;
+      if (q & 2) quarter.minLongitude = midLongitude; else quarter.maxLongitude = midLongitude;
+      if (q & 1) quarter.minLatitude = midLatitude; else quarter.maxLatitude = midLatitude;
+      double d = minDistance(quarter, latitude, longitude);
+      if (d <= radius) queue.push(Candidate{d, c.node->children[q].get(), quarter, nullptr});
+    }
+  }
+  return neighbors;
+}
+
+
+std::vector<GeoIndex::Neighbor> GeoIndex::near(double latitude, double longitude,
+                                               double radius, size_t k) const {
+  if (k > 0) return nearest(latitude, longitude, radius, k);
+
+  // box that contains the circle (all the longitudes near the poles)
+  double dlat = radius / EarthRadius * 180 / Pi;
+  double minLatitude = latitude - dlat, maxLatitude = latitude + dlat;
+  double minLongitude = -180, maxLongitude = 180;
+  if (minLatitude > -90 && maxLatitude < 90) {
+    // widest longitude difference on the circle
+    double s = std::sin(radius / EarthRadius) / std::cos(latitude * Pi / 180);
+    double dlon = s < 1 ? std::asin(s) * 180 / Pi : 180;
+    if (dlon < 180) {
+      minLongitude = longitude - dlon;
+      maxLongitude = longitude + dlon;
+      if (minLongitude < -180) minLongitude += 360;
+      if (maxLongitude > 180) maxLongitude -= 360;
+    }
+  }
+
+  std::vector<Neighbor> neighbors;
+  for (auto& p : within(std::max(minLatitude, -90.0), minLongitude,
+                        std::min(maxLatitude, 90.0), maxLongitude)) {
+    double d = distance(latitude, longitude, p.latitude, p.longitude);
+    if (d <= radius) neighbors.push_back(Neighbor{p, d});
+  }
+
+  std::sort(neighbors.begin(), neighbors.end(),
+            [](Neighbor const& a, Neighbor const& b) {return a.distance < b.distance;});
+  return neighbors;
+}
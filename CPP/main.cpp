@@ -12,10 +12,358 @@
 #include "Groupe.h"
 #include <memory>
 #include "MultimediaObject.h"
+#include "ccsocket.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 using namespace std;
 
-int main()
+// Memoire residente du processus en Mo (0 si /proc n'existe pas)
+static double residentMemory()
 {
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return double(resident) * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+// Cree les objets avec create, puis affiche le temps de creation, la memoire utilisee par le
+// catalogue et le temps de destruction du catalogue (et la memoire rendue au systeme)
+static void measure(const char* label, size_t n, const function<void(MediaManager&)>& create)
+{
+    double memory = residentMemory();
+    auto start = chrono::steady_clock::now();
+    auto manager = make_unique<MediaManager>();
+    create(*manager);
+    double created = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double used = residentMemory() - memory;
+    start = chrono::steady_clock::now();
+    manager.reset();
+    double destroyed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << label << " : " << n << " objets en " << created << " s (" << n / created << " objets/s), "
+         << used << " Mo, detruits en " << destroyed << " s (" << used - (residentMemory() - memory)
+         << " Mo rendus)" << endl;
+}
+
+// Mesure la creation de n objets (moitie photos, moitie videos) un par un puis par lots
+// (ou seulement d'une des deux facons si mode vaut "un" ou "lots", la memoire est alors
+// mesuree sans que la seconde reutilise la memoire rendue par la premiere).
+// Les resultats sont affiches sur cerr : les destructeurs des objets affichent sur cout.
+static void bench(size_t n, const string& mode)
+{
+    vector<MediaManager::PhotoSpec> photos;
+    vector<MediaManager::VideoSpec> videos;
+    for (size_t k = 0; k < n; ++k)
+    {
+        string name = "media" + to_string(k);
+        if (k % 2 == 0)
+            photos.push_back({name, name + ".jpg", double(k % 180) - 90, double(k % 360) - 180});
+        else
+            videos.push_back({name, name + ".mp4", int(k % 7200)});
+    }
+
+    if (mode != "lots")
+        measure("un par un", n, [&](MediaManager& manager)
+                {
+                    for (auto& p : photos) manager.createPhoto(p.name, p.filename, p.lat, p.lon);
+                    for (auto& v : videos) manager.createVideo(v.name, v.filename, v.duree);
+                });
+    if (mode != "un")
+        measure("par lots", n, [&](MediaManager& manager)
+                {
+                    manager.createPhotos(photos);
+                    manager.createVideos(videos);
+                });
+}
+
+// Mesure le debit de n createPhoto faites par threads threads sans journal, avec un journal
+// synchronise toutes les 100 ms, puis synchronise a chaque creation (les threads qui attendent
+// en meme temps partagent le meme fdatasync)
+static void benchLog(size_t n, unsigned threads)
+{
+    string path = (filesystem::temp_directory_path() / ("test_main_" + to_string(getpid()) + ".log")).string();
+    auto run = [&](const char* label, long syncInterval)
+    {
+        {
+            MediaManager manager;
+            if (syncInterval >= 0 && manager.openLog(path, path + ".snapshot", unsigned(syncInterval)) < 0)
+            {
+                cerr << "impossible d'ouvrir " << path << endl;
+                return;
+            }
+            auto start = chrono::steady_clock::now();
+            vector<thread> writers;
+            for (unsigned t = 0; t < threads; ++t)
+                writers.emplace_back([&, t]
+                                     {
+                                         for (size_t k = t; k < n; k += threads)
+                                             manager.createPhoto("photo" + to_string(k), "photo.jpg", 0, 0);
+                                     });
+            for (auto &w : writers)
+                w.join();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cerr << label << " : " << n << " creations en " << seconds << " s (" << n / seconds
+                 << " creations/s)" << endl;
+        }
+        remove(path.c_str());
+        remove((path + ".snapshot").c_str());
+    };
+    run("sans journal", -1);
+    run("journal synchronise toutes les 100 ms", 100);
+    run("journal synchronise a chaque creation", 0);
+}
+
+// Mesure le debit de chaque noyau de recherche des separateurs (cf. SocketBuffer::scan) sur des
+// lignes de 1 Ko a 1 Mo (chaque ligne est parcourue jusqu'a son separateur final, environ 1 Go
+// par mesure)
+static void benchScan()
+{
+    const pair<SocketBuffer::ScanKernel, const char*> kernels[] = {
+        {SocketBuffer::ScanScalar, "scalaire"}, {SocketBuffer::ScanSSE2, "SSE2"}, {SocketBuffer::ScanAVX2, "AVX2"}};
+    for (size_t size : {size_t(1) << 10, size_t(1) << 16, size_t(1) << 20})
+    {
+        string line(size, 'a');
+        line.back() = '\n';
+        size_t rounds = (size_t(1) << 30) / size;
+        for (auto &[kernel, name] : kernels)
+        {
+            if (!SocketBuffer::hasScanKernel(kernel))
+            {
+                cerr << name << " : non disponible" << endl;
+                continue;
+            }
+            size_t found = 0;
+            auto start = chrono::steady_clock::now();
+            for (size_t r = 0; r < rounds; ++r)
+                found += SocketBuffer::scan(kernel, line.data(), line.data() + line.size(), '\n', '\r') - line.data();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (found != rounds * (size - 1))
+                cerr << name << " : separateur mal trouve" << endl;
+            cerr << name << ", lignes de " << size / 1024 << " Ko : "
+                 << double(rounds * size) / seconds / 1e9 << " Go/s" << endl;
+        }
+    }
+}
+
+// Mesure le debit des recherches (findObject) de 1 a threads lecteurs, par puissances de 2, dans
+// un catalogue de n photos qu'un ecrivain modifie pendant ce temps (une creation suivie d'une
+// suppression toutes les millisecondes) : les lectures ne prenant aucun verrou, le debit doit
+// augmenter avec le nombre de lecteurs
+static void benchRead(size_t n, unsigned threads)
+{
+    if (n == 0 || threads == 0)
+        return;
+    MediaManager manager;
+    vector<MediaManager::PhotoSpec> photos;
+    for (size_t k = 0; k < n; ++k)
+        photos.push_back({"photo" + to_string(k), "photo.jpg", double(k % 180) - 90, double(k % 360) - 180});
+    manager.createPhotos(photos);
+
+    for (unsigned readers = 1;; readers = min(readers * 2, threads))
+    {
+        atomic<bool> done{false};
+        atomic<size_t> lookups{0}, missed{0}, writes{0};
+        thread writer([&]
+                      {
+                          for (size_t k = 0; !done; ++k)
+                          {
+                              string name = "extra" + to_string(k);
+                              manager.createPhoto(name, "extra.jpg", 0, 0);
+                              manager.removeObject(name);
+                              ++writes;
+                              this_thread::sleep_for(chrono::milliseconds(1));
+                          }
+                      });
+        vector<thread> workers;
+        for (unsigned t = 0; t < readers; ++t)
+            workers.emplace_back([&, t]
+                                 {
+                                     size_t count = 0, misses = 0, k = t;
+                                     while (!done)
+                                     {
+                                         for (int i = 0; i < 1000; ++i, ++count)
+                                         {
+                                             k = (k * 2654435761u + 1) % n;
+                                             if (!manager.findObject(photos[k].name))
+                                                 ++misses;
+                                         }
+                                     }
+                                     lookups += count;
+                                     missed += misses;
+                                 });
+        auto start = chrono::steady_clock::now();
+        this_thread::sleep_for(chrono::seconds(1));
+        done = true;
+        for (auto &w : workers)
+            w.join();
+        writer.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cerr << readers << " lecteurs : " << lookups / seconds << " recherches/s ("
+             << lookups / seconds / readers << " par lecteur), " << writes << " ecritures";
+        if (missed)
+            cerr << ", " << missed << " objets non trouves";
+        cerr << endl;
+        if (readers == threads)
+            break;
+    }
+}
+
+// Test de charge : threads threads font chacun ops operations au hasard (creations, suppressions et
+// recherches d'objets et de groupes). Chaque thread a ses propres noms, dont il connait l'etat et
+// qu'il verifie a chaque operation (et avec findPrefix), et tous se disputent quelques noms communs.
+// A la fin, listObjects doit lister les objets de chaque thread et les noms communs trouves.
+// Renvoie le nombre d'erreurs, qui sont affichees sur cerr.
+static size_t stress(unsigned threads, size_t ops)
+{
+    MediaManager manager;
+    atomic<size_t> errors{0};
+    auto fail = [&](const string &message)
+    {
+        if (errors++ < 20)
+            cerr << message << endl;
+    };
+    const size_t Names = 64, Shared = 16;
+    vector<set<string>> owned(threads);
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back([&, t]
+                             {
+                                 mt19937 random(t);
+                                 set<string> &mine = owned[t];
+                                 set<string> groups;
+                                 string prefix = "t" + to_string(t) + "_";
+                                 for (size_t k = 0; k < ops; ++k)
+                                 {
+                                     unsigned op = random() % 10;
+                                     string name = prefix + to_string(random() % Names);
+                                     string shared = "commun" + to_string(random() % Shared);
+                                     switch (op)
+                                     {
+                                     case 0:
+                                         manager.createPhoto(name, "photo.jpg", 48.8, 2.3);
+                                         mine.insert(name);
+                                         break;
+                                     case 1:
+                                         manager.createVideo(name, "video.mp4", int(k % 600));
+                                         mine.insert(name);
+                                         break;
+                                     case 2:
+                                         if (manager.removeObject(name) != (mine.erase(name) > 0))
+                                             fail("suppression de " + name + " incoherente");
+                                         break;
+                                     case 3:
+                                         if (k % 2)
+                                             manager.createPhoto(shared, "commun.jpg", 0, 0);
+                                         else
+                                             manager.removeObject(shared);
+                                         break;
+                                     case 4:
+                                     {
+                                         string groupe = "g" + name;
+                                         if (k % 2)
+                                         {
+                                             manager.createGroupe(groupe);
+                                             groups.insert(groupe);
+                                         }
+                                         else if (manager.removeGroupe(groupe) != (groups.erase(groupe) > 0))
+                                             fail("suppression du groupe " + groupe + " incoherente");
+                                         ostringstream out;
+                                         manager.displayGroupe(groupe, out);
+                                         if ((out.str().rfind("Groupe : ", 0) == 0) != (groups.count(groupe) > 0))
+                                             fail("groupe " + groupe + " incoherent");
+                                         break;
+                                     }
+                                     case 5:
+                                     {
+                                         auto found = manager.findPrefix(prefix);
+                                         if (!equal(found.begin(), found.end(), mine.begin(), mine.end()))
+                                             fail("findPrefix(" + prefix + ") incoherent");
+                                         break;
+                                     }
+                                     case 6:
+                                         if (auto obj = manager.findObject(shared); obj && obj->getNom() != shared)
+                                             fail("objet " + shared + " mal nomme");
+                                         break;
+                                     default:
+                                     {
+                                         auto obj = manager.findObject(name);
+                                         if (bool(obj) != (mine.count(name) > 0) || (obj && obj->getNom() != name))
+                                             fail("recherche de " + name + " incoherente");
+                                     }
+                                     }
+                                 }
+                             });
+    for (auto &w : workers)
+        w.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    set<string> expected;
+    for (auto &mine : owned)
+        expected.insert(mine.begin(), mine.end());
+    for (size_t k = 0; k < Shared; ++k)
+        if (manager.findObject("commun" + to_string(k)))
+            expected.insert("commun" + to_string(k));
+    ostringstream out;
+    manager.listObjects(out);
+    istringstream in(out.str());
+    set<string> listed;
+    for (string name; getline(in, name);)
+        if (!listed.insert(name).second)
+            fail("objet " + name + " liste deux fois");
+    if (listed != expected)
+        fail("listObjects incoherent : " + to_string(listed.size()) + " objets au lieu de " + to_string(expected.size()));
+
+    cerr << threads << " threads, " << threads * ops << " operations en " << seconds << " s, " << errors
+         << " erreurs" << endl;
+    return errors;
+}
+
+// test_main -bench [n [un|lots]] : compare la creation de n objets (1000000 par defaut) un par un
+// et par lots
+// test_main -bench-log [n [threads]] : debit des creations selon la synchronisation du journal
+// (20000 creations par 4 threads par defaut)
+// test_main -bench-scan : debit de la recherche des separateurs (scalaire, SSE2, AVX2)
+// test_main -stress [threads [ops]] : test de charge (8 threads de 20000 operations par defaut),
+// renvoie 1 en cas d'erreur
+// test_main -bench-read [n [threads]] : debit des recherches selon le nombre de lecteurs, pendant
+// qu'un ecrivain modifie le catalogue (100000 photos, jusqu'au nombre de coeurs par defaut)
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-bench") == 0)
+    {
+        bench(argc > 2 ? stoul(argv[2]) : 1000000, argc > 3 ? argv[3] : "");
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "-bench-scan") == 0)
+    {
+        benchScan();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "-stress") == 0)
+        return stress(argc > 2 ? stoul(argv[2]) : 8, argc > 3 ? stoul(argv[3]) : 20000) ? 1 : 0;
+    if (argc > 1 && strcmp(argv[1], "-bench-read") == 0)
+    {
+        unsigned cores = max(1u, thread::hardware_concurrency());
+        benchRead(argc > 2 ? stoul(argv[2]) : 100000, argc > 3 ? stoul(argv[3]) : cores);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "-bench-log") == 0)
+    {
+        benchLog(argc > 2 ? stoul(argv[2]) : 20000, argc > 3 ? stoul(argv[3]) : 4);
+        return 0;
+    }
+
     MediaManager manager;
 
     auto p1 = manager.createPhoto("Photo1", "montsouris.jpg", 48.8, 2.3);
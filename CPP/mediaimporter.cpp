@@ -0,0 +1,179 @@
+//
+//  mediaimporter: parallel import of a directory tree of media files into a MediaManager.
+//
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <iterator>
+#include "mediaimporter.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+
+MediaImporter::MediaImporter(MediaManager& manager, unsigned threadCount, size_t batchSize) :
+manager_(manager),
+batchSize_(std::max<size_t>(batchSize, 1)),
+pool_(threadCount) {
+}
+
+
+MediaImporter::~MediaImporter() {
+  stopping_ = true;
+  wait();
+}
+
+
+int MediaImporter::type(fs::path const& file) {
+  static const char* const photos[] = {".jpg", ".jpeg", ".png", ".gif", ".bmp", ".tif", ".tiff",
+                                       ".webp", ".heic", ".heif", ".dng", ".cr2", ".nef"};
+  static const char* const videos[] = {".mp4", ".m4v", ".mov", ".avi", ".wmv", ".webm", ".mpg",
+                                       ".mpeg", ".3gp", ".flv", ".ts"};
+  static const char* const films[] = {".mkv", ".m2ts", ".vob"};   // usually have chapters
+
+  std::string ext = file.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c){return char(std::tolower(c));});
+  auto in = [&ext](auto& list) {
+    return std::find(std::begin(list), std::end(list), ext) != std::end(list);
+  };
+  if (in(photos)) return CatalogFile::PhotoType;
+  if (in(videos)) return CatalogFile::VideoType;
+  if (in(films)) return CatalogFile::FilmType;
+  return 0;
+}
+
+
+bool MediaImporter::start(std::string const& root) {
+  std::error_code ec;
+  fs::path dir = fs::absolute(root, ec);
+  if (ec || !fs::is_directory(dir, ec)) return false;
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (running_) return false;
+    running_ = true;
+    pending_ = 1;
+    root_ = dir;
+    started_ = std::chrono::steady_clock::now();
+    for (auto* c : {&directories_, &files_, &photos_, &videos_, &films_, &added_, &probed_, &skipped_, &errors_}) *c = 0;
+  }
+  pool_.submit([this, dir]{scan(dir);});
+  return true;
+}
+
+
+void MediaImporter::wait() {
+  unique_lock<mutex> lock(mutex_);
+  done_.wait(lock, [this]{return !running_;});
+}
+
+
+MediaImporter::Progress MediaImporter::progress() const {
+  Progress p;
+  p.directories = directories_;
+  p.files = files_;
+  p.photos = photos_;
+  p.videos = videos_;
+  p.films = films_;
+  p.added = added_;
+  p.probed = probed_;
+  p.skipped = skipped_;
+  p.errors = errors_;
+  lock_guard<mutex> lock(mutex_);
+  p.running = running_;
+  auto end = running_ ? std::chrono::steady_clock::now() : finished_;
+  p.seconds = std::chrono::duration<double>(end - started_).count();
+  return p;
+}
+
+
+// reads a directory: its subdirectories are read by other tasks, its media files are added
+// to the current batch
+void MediaImporter::scan(fs::path const& dir) {
+  std::vector<Found> found;
+  std::error_code ec;
+  fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+  bool opened = !ec;
+  if (opened) ++directories_;
+  else ++errors_;
+
+  for (; !ec && !stopping_ && it != end; it.increment(ec)) {
+    const fs::directory_entry& entry = *it;
+    std::error_code e;
+    // symbolic links are not followed: links to directories may create cycles, and links may
+    // point outside the imported directory (whose files FETCH would then serve)
+    if (entry.is_symlink(e) || e) continue;
+    if (entry.is_directory(e)) {
+      {
+        lock_guard<mutex> lock(mutex_);
+        ++pending_;
+      }
+      pool_.submit([this, sub = entry.path()]{scan(sub);});
+      continue;
+    }
+    if (!entry.is_regular_file(e)) continue;
+    ++files_;
+    int t = type(entry.path());
+    if (t == 0) {
+      ++skipped_;
+      continue;
+    }
+    std::string name = entry.path().lexically_relative(root_).generic_string(), file = entry.path().string();
+    CatalogFile::Object o;
+    o.type = CatalogFile::Type(t);
+    o.name = name;
+    o.file = file;
+    auto metadata = prober_.get(file);
+    if (metadata && metadata->format != MediaProber::Unknown) {
+      ++probed_;
+      if (t == CatalogFile::PhotoType && metadata->located) {
+        o.latitude = metadata->latitude;
+        o.longitude = metadata->longitude;
+      }
+      else if (t != CatalogFile::PhotoType && metadata->format == MediaProber::Mp4) {
+        o.duree = int(std::lround(metadata->duration));
+        if (!metadata->chapters.empty()) {
+          o.type = CatalogFile::FilmType;
+          o.chapters = metadata->chapters.data();
+          o.chapterCount = uint32_t(metadata->chapters.size());
+        }
+      }
+    }
+    ++(o.type == CatalogFile::PhotoType ? photos_ : o.type == CatalogFile::VideoType ? videos_ : films_);
+    MultimediaPtr object = manager_.build(o);
+    found.push_back({std::move(name), std::move(object)});
+  }
+  if (opened && ec) ++errors_;   // reading failed (a directory that can't be opened is counted above)
+  add(found, false);
+
+  // the last directory adds the rest of the batch: the other tasks have added their objects
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (--pending_ > 0) return;
+  }
+  add(found, true);
+  {
+    lock_guard<mutex> lock(mutex_);
+    running_ = false;
+    finished_ = std::chrono::steady_clock::now();
+  }
+  done_.notify_all();
+}
+
+
+// moves _found_ to the current batch, adds the batch to the catalog if it is full (or if _all_)
+void MediaImporter::add(std::vector<Found>& found, bool all) {
+  std::vector<Found> batch;
+  {
+    lock_guard<mutex> lock(batchMutex_);
+    batch_.insert(batch_.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+    if (batch_.size() >= batchSize_ || (all && !batch_.empty())) batch.swap(batch_);
+  }
+  found.clear();
+  if (batch.empty()) return;
+
+  std::vector<MediaManager::NewObject> objects;
+  objects.reserve(batch.size());
+  for (auto& f : batch) objects.push_back({f.name, f.object});
+  manager_.commit(manager_.addObjects(objects));
+  added_ += batch.size();
+}
@@ -0,0 +1,396 @@
+//
+//  mediaprober: reads the metadata of media files (JPEG, MP4) through mmap, with a cache.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "mediaprober.h"
+#if defined(_WIN32) || defined(_WIN64)
+#define NOMINMAX
+#include <windows.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+static const size_t MaxChapters = 4096;
+
+// durations are read from the files: they are stored in ints (see Video), so they are bounded
+static double seconds(double s) {
+  return std::clamp(s, 0.0, double(std::numeric_limits<int>::max()));
+}
+
+// read-only mapping of a file: its pages are only read when they are accessed
+class Mapping {
+public:
+  explicit Mapping(std::string const& path) {
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && uint64_t(size.QuadPart) <= SIZE_MAX) {
+      HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mapping) {
+        data_ = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data_) size_ = size_t(size.QuadPart);
+        CloseHandle(mapping);
+      }
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        // only a few headers are read: no read-ahead of the data around them
+        madvise(data, size_t(st.st_size), MADV_RANDOM);
+        data_ = static_cast<const char*>(data);
+        size_ = size_t(st.st_size);
+      }
+    }
+    ::close(fd);
+#endif
+  }
+
+  ~Mapping() {
+    if (!data_) return;
+#if defined(_WIN32) || defined(_WIN64)
+    UnmapViewOfFile(data_);
+#else
+    munmap(const_cast<char*>(data_), size_);
+#endif
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  Mapping(Mapping const&) = delete;
+  Mapping& operator=(Mapping const&) = delete;
+  const char* data_{};
+  size_t size_{};
+};
+
+
+// modification time (in ns) and size of a regular file
+static bool stamp(std::string const& path, int64_t& mtime, uint64_t& size) {
+#if defined(_WIN32) || defined(_WIN64)
+  struct _stat64 st;
+  if (_stat64(path.c_str(), &st) != 0 || !(st.st_mode & _S_IFREG)) return false;
+  mtime = int64_t(st.st_mtime) * 1000000000;
+#else
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+#if defined(__APPLE__)
+  mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+  size = uint64_t(st.st_size);
+  return true;
+}
+
+
+// big-endian numbers (JPEG, MP4)
+static uint16_t be16(const uint8_t* p) { return uint16_t(p[0] << 8 | p[1]); }
+static uint32_t be32(const uint8_t* p) { return uint32_t(be16(p)) << 16 | be16(p + 2); }
+static uint64_t be64(const uint8_t* p) { return uint64_t(be32(p)) << 32 | be32(p + 4); }
+
+static constexpr uint32_t fourcc(const char (&s)[5]) {
+  return uint32_t(uint8_t(s[0])) << 24 | uint32_t(uint8_t(s[1])) << 16 | uint32_t(uint8_t(s[2])) << 8
+         | uint8_t(s[3]);
+}
+
+
+// TIFF structure of an EXIF segment: numbers have the byte order of the segment, offsets are
+// relative to its beginning, reads outside of the segment return 0
+struct Tiff {
+  const uint8_t* data;
+  size_t size;
+  bool little;
+
+  uint16_t u16(size_t offset) const {
+    if (offset > size || size - offset < 2) return 0;
+    const uint8_t* p = data + offset;
+    return little ? uint16_t(p[1] << 8 | p[0]) : be16(p);
+  }
+
+  uint32_t u32(size_t offset) const {
+    if (offset > size || size - offset < 4) return 0;
+    return little ? uint32_t(u16(offset + 2)) << 16 | u16(offset) : be32(data + offset);
+  }
+
+  // calls f(tag, entry) for each entry of the IFD at _offset_ (the value of an entry is at entry + 8)
+  template <typename F>
+  void forEachTag(size_t offset, F f) const {
+    uint16_t count = u16(offset);
+    for (size_t k = 0; k < count; ++k) {
+      size_t entry = offset + 2 + 12 * k;
+      if (entry > size || size - entry < 12) return;
+      f(u16(entry), entry);
+    }
+  }
+
+  // degrees, minutes and seconds (3 rationals) of a GPS coordinate, -1 if invalid
+  double degrees(size_t entry) const {
+    if (u16(entry + 2) != 5 || u32(entry + 4) != 3) return -1;
+    size_t offset = u32(entry + 8);
+    if (offset > size || size - offset < 24) return -1;
+    double value = 0, unit = 1;
+    for (int k = 0; k < 3; ++k, unit *= 60) {
+      uint32_t numerator = u32(offset + 8 * k), denominator = u32(offset + 8 * k + 4);
+      if (denominator == 0) return -1;
+      value += double(numerator) / denominator / unit;
+    }
+    return value;
+  }
+};
+
+
+// GPS coordinates of an EXIF segment (after "Exif\0\0")
+static void readExif(const uint8_t* data, size_t size, MediaProber::Metadata& m) {
+  if (size < 8 || data[0] != data[1] || (data[0] != 'I' && data[0] != 'M')) return;
+  Tiff tiff{data, size, data[0] == 'I'};
+  if (tiff.u16(2) != 42) return;
+
+  size_t gps = 0;
+  tiff.forEachTag(tiff.u32(4), [&](uint16_t tag, size_t entry) {
+    if (tag == 0x8825) gps = tiff.u32(entry + 8);
+  });
+  if (gps == 0) return;
+
+  char latitudeRef = 0, longitudeRef = 0;
+  double latitude = -1, longitude = -1;
+  tiff.forEachTag(gps, [&](uint16_t tag, size_t entry) {
+    switch (tag) {
+    case 1: latitudeRef = char(data[entry + 8]); break;     // 'N' or 'S' (inline ASCII)
+    case 2: latitude = tiff.degrees(entry); break;
+    case 3: longitudeRef = char(data[entry + 8]); break;    // 'E' or 'W'
+    case 4: longitude = tiff.degrees(entry); break;
+    }
+  });
+  if ((latitudeRef != 'N' && latitudeRef != 'S') || (longitudeRef != 'E' && longitudeRef != 'W')
+      || latitude < 0 || latitude > 90 || longitude < 0 || longitude > 180) return;
+  m.located = true;
+  m.latitude = latitudeRef == 'S' ? -latitude : latitude;
+  m.longitude = longitudeRef == 'W' ? -longitude : longitude;
+}
+
+
+// segments of a JPEG file up to the first scan (the image data follows)
+static bool probeJpeg(const uint8_t* data, size_t size, MediaProber::Metadata& m) {
+  size_t pos = 2;
+  while (pos < size && size - pos >= 4) {
+    if (data[pos] != 0xFF) break;                   // damaged
+    uint8_t marker = data[pos + 1];
+    if (marker == 0xFF) {                           // fill byte
+      ++pos;
+      continue;
+    }
+    pos += 2;
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) continue;   // no length
+    if (marker == 0xD9 || marker == 0xDA) break;    // end of image, start of scan
+    size_t length = be16(data + pos);
+    if (length < 2 || length > size - pos) break;
+    const uint8_t* segment = data + pos + 2;
+    size_t segmentSize = length - 2;
+
+    // start of frame (0xC4, 0xC8 and 0xCC are other segments): precision, height, width
+    bool frame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+    if (frame && segmentSize >= 5 && m.width == 0) {
+      m.height = be16(segment + 1);
+      m.width = be16(segment + 3);
+    }
+    else if (marker == 0xE1 && segmentSize >= 6 && memcmp(segment, "Exif\0\0", 6) == 0 && !m.located)
+      readExif(segment + 6, segmentSize - 6, m);
+    pos += length;
+  }
+  m.format = MediaProber::Jpeg;
+  return true;
+}
+
+
+// calls f(type, content, size) for each box of an MP4 container, stops at a truncated box
+template <typename F>
+static void forEachBox(const uint8_t* data, size_t size, F f) {
+  size_t pos = 0;
+  while (size - pos >= 8) {
+    uint64_t boxSize = be32(data + pos);
+    uint32_t type = be32(data + pos + 4);
+    size_t header = 8;
+    if (boxSize == 1) {                             // 64-bit size
+      if (size - pos < 16) return;
+      boxSize = be64(data + pos + 8);
+      header = 16;
+    }
+    else if (boxSize == 0) boxSize = size - pos;    // up to the end of the file
+    if (boxSize < header || boxSize > size - pos) return;
+    f(type, data + pos + header, size_t(boxSize - header));
+    pos += size_t(boxSize);
+  }
+}
+
+
+// track of an MP4 file, for the QuickTime chapters
+struct Track {
+  uint32_t id{}, chapters{};                        // track of its chapters (tref/chap)
+  uint32_t timescale{};
+  const uint8_t* stts{};                            // durations of the samples
+  size_t sttsSize{};
+};
+
+// boxes of a trak box, or of the boxes that it contains: the containers are only read in their
+// expected order (trak, mdia, minf, stbl, _level_ being the index of the current one), so that
+// nested boxes of a malformed file can't recurse more than 3 times
+static void readTrack(const uint8_t* data, size_t size, Track& t, unsigned level = 0) {
+  static constexpr uint32_t containers[] = {fourcc("mdia"), fourcc("minf"), fourcc("stbl")};
+  forEachBox(data, size, [&](uint32_t type, const uint8_t* c, size_t n) {
+    if (type == fourcc("tkhd") && n >= 24) t.id = be32(c + (c[0] == 1 ? 20 : 12));
+    else if (type == fourcc("tref")) {
+      forEachBox(c, n, [&](uint32_t type, const uint8_t* c, size_t n) {
+        if (type == fourcc("chap") && n >= 4) t.chapters = be32(c);
+      });
+    }
+    else if (type == fourcc("mdhd") && n >= 24) t.timescale = be32(c + (c[0] == 1 ? 20 : 12));
+    else if (type == fourcc("stts")) {
+      t.stts = c;
+      t.sttsSize = n;
+    }
+    else if (level < 3 && type == containers[level]) readTrack(c, n, t, level + 1);
+  });
+}
+
+// Nero chapters: start of each chapter in 100 ns
+static void readChpl(const uint8_t* data, size_t size, std::vector<double>& starts) {
+  if (size < 5) return;
+  size_t pos = data[0] == 1 ? 8 : 4;                // version, flags (and a reserved field)
+  if (pos >= size) return;
+  size_t count = data[pos++];
+  for (size_t k = 0; k < count && size - pos >= 9; ++k) {
+    starts.push_back(double(be64(data + pos)) / 1e7);
+    pos += 9 + data[pos + 8];                       // start, length of the title, title
+    if (pos > size) break;
+  }
+}
+
+// boxes of an MP4 file up to moov, which contains the headers (mdat, the data, is skipped)
+static bool probeMp4(const uint8_t* data, size_t size, MediaProber::Metadata& m) {
+  std::vector<Track> tracks;
+  std::vector<double> starts;
+  forEachBox(data, size, [&](uint32_t type, const uint8_t* c, size_t n) {
+    if (type != fourcc("moov")) return;
+    forEachBox(c, n, [&](uint32_t type, const uint8_t* c, size_t n) {
+      if (type == fourcc("mvhd") && n >= 20) {
+        bool v1 = c[0] == 1;
+        if (v1 && n < 32) return;
+        uint32_t timescale = be32(c + (v1 ? 20 : 12));
+        uint64_t duration = v1 ? be64(c + 24) : be32(c + 16);
+        if (timescale > 0 && duration != (v1 ? UINT64_MAX : UINT32_MAX)) m.duration = seconds(double(duration) / timescale);
+      }
+      else if (type == fourcc("udta")) {
+        forEachBox(c, n, [&](uint32_t type, const uint8_t* c, size_t n) {
+          if (type == fourcc("chpl")) readChpl(c, n, starts);
+        });
+      }
+      else if (type == fourcc("trak")) {
+        tracks.emplace_back();
+        readTrack(c, n, tracks.back());
+      }
+    });
+  });
+
+  if (!starts.empty()) {
+    // durations of the Nero chapters: up to the next one, the last one up to the end
+    for (size_t k = 0; k < starts.size() && k < MaxChapters; ++k) {
+      double end = k + 1 < starts.size() ? starts[k + 1] : std::max(m.duration, starts[k]);
+      m.chapters.push_back(int32_t(std::lround(seconds(end - starts[k]))));
+    }
+  }
+  else {
+    // QuickTime chapters: each sample of the chapter track is a chapter
+    for (auto& t : tracks) {
+      if (t.chapters == 0) continue;
+      for (auto& c : tracks) {
+        if (c.id != t.chapters || c.timescale == 0 || !c.stts || c.sttsSize < 8) continue;
+        uint32_t count = be32(c.stts + 4);
+        for (size_t k = 0; k < count && 8 + 8 * k + 8 <= c.sttsSize; ++k) {
+          uint32_t samples = be32(c.stts + 8 + 8 * k), delta = be32(c.stts + 12 + 8 * k);
+          for (uint32_t s = 0; s < samples && m.chapters.size() < MaxChapters; ++s)
+            m.chapters.push_back(int32_t(std::lround(seconds(double(delta) / c.timescale))));
+        }
+        break;
+      }
+      break;
+    }
+  }
+  m.format = MediaProber::Mp4;
+  return true;
+}
+
+
+bool MediaProber::probe(const char* data, size_t size, Metadata& metadata) {
+  metadata = Metadata();
+  auto* d = reinterpret_cast<const uint8_t*>(data);
+  if (size >= 4 && d[0] == 0xFF && d[1] == 0xD8 && d[2] == 0xFF) return probeJpeg(d, size, metadata);
+
+  // MP4 and QuickTime files begin with one of these boxes
+  if (size >= 8) {
+    uint32_t type = be32(d + 4);
+    for (uint32_t t : {fourcc("ftyp"), fourcc("moov"), fourcc("mdat"), fourcc("wide"), fourcc("free"),
+                       fourcc("skip")}) {
+      if (type == t) return probeMp4(d, size, metadata);
+    }
+  }
+  return false;
+}
+
+
+bool MediaProber::probe(std::string const& path, Metadata& metadata) {
+  Mapping file(path);
+  if (!file.data()) {
+    metadata = Metadata();
+    return false;
+  }
+  return probe(file.data(), file.size(), metadata);
+}
+
+
+// the file is probed without holding the lock: threads that ask for the same file at the same
+// time may both probe it
+std::shared_ptr<const MediaProber::Metadata> MediaProber::get(std::string const& path) {
+  int64_t mtime;
+  uint64_t size;
+  if (!stamp(path, mtime, size)) return nullptr;
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto it = cache_.find(path);
+    if (it != cache_.end() && it->second.mtime == mtime && it->second.size == size) return it->second.metadata;
+  }
+  auto metadata = std::make_shared<Metadata>();
+  probe(path, *metadata);       // not recognized: the format stays Unknown (which is cached too)
+  lock_guard<mutex> lock(mutex_);
+  cache_[path] = Entry{mtime, size, metadata};
+  return metadata;
+}
+
+
+size_t MediaProber::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return cache_.size();
+}
+
+
+void MediaProber::clear() {
+  lock_guard<mutex> lock(mutex_);
+  cache_.clear();
+}
@@ -0,0 +1,333 @@
+//
+//  mutationlog: append-only log of mutations with checksums and group commit.
+//
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "mutationlog.h"
+#if defined(_WIN32) || defined(_WIN64)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+static const char Magic[8] = {'I','N','F','2','2','4','M','L'};
+static const uint32_t Version = 1;
+static const uint64_t HeaderSize = 16;        // magic, version, unused
+static const uint64_t RecordHeaderSize = 16;  // length of the payload, checksum, sequence
+
+// file primitives (the log only needs a few of them)
+#if defined(_WIN32) || defined(_WIN64)
+static int openFile(std::string const& path, bool create) {
+  return _open(path.c_str(), _O_RDWR | _O_BINARY | _O_APPEND | (create ? _O_CREAT | _O_TRUNC : _O_CREAT),
+               _S_IREAD | _S_IWRITE);
+}
+static bool readAt(int fd, uint64_t offset, char* data, size_t size) {
+  if (_lseeki64(fd, int64_t(offset), SEEK_SET) < 0) return false;
+  for (size_t done = 0; done < size;) {
+    int n = _read(fd, data + done, unsigned(std::min<size_t>(size - done, 1 << 30)));
+    if (n <= 0) return false;
+    done += size_t(n);
+  }
+  return true;
+}
+static int64_t fileSize(int fd) { return _lseeki64(fd, 0, SEEK_END); }
+static bool truncateFile(int fd, uint64_t size) { return _chsize_s(fd, int64_t(size)) == 0; }
+static bool datasync(int fd) { return _commit(fd) == 0; }
+static void closeFile(int fd) { _close(fd); }
+static bool replaceFile(std::string const& from, std::string const& to) {
+  remove(to.c_str());     // rename() does not replace existing files
+  return rename(from.c_str(), to.c_str()) == 0;
+}
+static bool writeAll(int fd, const char* data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    int n = _write(fd, data + done, unsigned(std::min<size_t>(size - done, 1 << 30)));
+    if (n <= 0) return false;
+    done += size_t(n);
+  }
+  return true;
+}
+#else
+static int openFile(std::string const& path, bool create) {
+  return ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC | (create ? O_TRUNC : 0), 0644);
+}
+static bool readAt(int fd, uint64_t offset, char* data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = pread(fd, data + done, size - done, off_t(offset + done));
+    if (n <= 0) return false;
+    done += size_t(n);
+  }
+  return true;
+}
+static int64_t fileSize(int fd) { return lseek(fd, 0, SEEK_END); }
+static bool truncateFile(int fd, uint64_t size) { return ftruncate(fd, off_t(size)) == 0; }
+static bool datasync(int fd) {
+#if defined(__linux__)
+  return fdatasync(fd) == 0;
+#else
+  return fsync(fd) == 0;
+#endif
+}
+static void closeFile(int fd) { ::close(fd); }
+static bool replaceFile(std::string const& from, std::string const& to) {
+  if (rename(from.c_str(), to.c_str()) != 0) return false;
+  // the new name is only durable once the directory is synced
+  size_t slash = to.rfind('/');
+  int dir = ::open(slash == std::string::npos ? "." : to.substr(0, slash + 1).c_str(), O_RDONLY);
+  if (dir >= 0) {fsync(dir); ::close(dir);}
+  return true;
+}
+static bool writeAll(int fd, const char* data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = write(fd, data + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += size_t(n);
+  }
+  return true;
+}
+#endif
+
+
+// CRC-32 (IEEE 802.3)
+static uint32_t crc32(const char* data, size_t size, uint32_t crc = 0) {
+  static const auto table = [] {
+    std::array<uint32_t, 256> t{};
+    for (uint32_t k = 0; k < 256; ++k) {
+      uint32_t c = k;
+      for (int bit = 0; bit < 8; ++bit) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      t[k] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t k = 0; k < size; ++k) crc = table[(crc ^ uint8_t(data[k])) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static std::string header() {
+  char h[HeaderSize] = {};
+  memcpy(h, Magic, sizeof(Magic));
+  memcpy(h + 8, &Version, sizeof(Version));
+  return std::string(h, sizeof(h));
+}
+
+
+std::unique_ptr<MutationLog> MutationLog::open(std::string const& path, unsigned syncInterval, uint64_t first,
+                                               std::function<void(uint64_t, std::string_view)> const& replay) {
+  std::unique_ptr<MutationLog> log(new MutationLog);
+  log->path_ = path;
+  log->syncInterval_ = syncInterval;
+  log->fd_ = openFile(path, false);
+  if (log->fd_ < 0) return nullptr;
+
+  int64_t size = fileSize(log->fd_);
+  if (size < 0) return nullptr;
+  std::string data(size_t(size), '\0');
+  if (size > 0 && !readAt(log->fd_, 0, data.data(), data.size())) return nullptr;
+
+  uint64_t pos = HeaderSize, last = 0;
+  if (data.size() < HeaderSize) {
+    // new log, or the process died while the header was written
+    std::string h = header();
+    if (!truncateFile(log->fd_, 0) || !writeAll(log->fd_, h.data(), h.size()) || !datasync(log->fd_))
+      return nullptr;
+  }
+  else {
+    uint32_t version;
+    memcpy(&version, data.data() + 8, sizeof(version));
+    if (memcmp(data.data(), Magic, sizeof(Magic)) != 0 || version != Version) return nullptr;
+
+    // stops at the first record that is incomplete or whose checksum is wrong
+    while (pos + RecordHeaderSize <= data.size()) {
+      uint32_t length, checksum;
+      uint64_t sequence;
+      memcpy(&length, data.data() + pos, 4);
+      memcpy(&checksum, data.data() + pos + 4, 4);
+      memcpy(&sequence, data.data() + pos + 8, 8);
+      if (length > data.size() - pos - RecordHeaderSize
+          || crc32(data.data() + pos + 8, 8 + size_t(length)) != checksum) break;
+      if (sequence >= first) replay(sequence, std::string_view(data.data() + pos + RecordHeaderSize, length));
+      last = std::max(last, sequence);
+      pos += RecordHeaderSize + length;
+    }
+    // new records must not follow a damaged one
+    if (pos < data.size() && (!truncateFile(log->fd_, pos) || !datasync(log->fd_))) return nullptr;
+  }
+  log->written_ = pos;
+  log->next_ = std::max(last + 1, first);
+  log->durable_ = log->next_ - 1;
+  if (syncInterval > 0) log->flusher_ = std::thread([l = log.get()]{l->run();});
+  return log;
+}
+
+
+MutationLog::~MutationLog() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wakeup_.notify_all();
+  if (flusher_.joinable()) flusher_.join();
+  if (compactor_.joinable()) compactor_.join();
+  unique_lock<mutex> lock(mutex_);
+  flush(lock, next_ - 1);
+  closeFile(fd_);
+}
+
+
+uint64_t MutationLog::append(std::string_view payload) {
+  lock_guard<mutex> lock(mutex_);
+  uint64_t sequence = next_++;
+  char h[RecordHeaderSize];
+  uint32_t length = uint32_t(payload.size());
+  memcpy(h, &length, 4);
+  memcpy(h + 8, &sequence, 8);
+  uint32_t checksum = crc32(payload.data(), payload.size(), crc32(h + 8, 8));
+  memcpy(h + 4, &checksum, 4);
+  buffer_.append(h, sizeof(h));
+  buffer_.append(payload);
+
+  if (maxSize_ > 0 && !compacting_ && written_ + buffer_.size() > maxSize_) {
+    compacting_ = true;
+    wakeup_.notify_all();
+  }
+  return sequence;
+}
+
+
+// writes the buffered records and syncs them until _sequence_ is durable: a single thread
+// writes at a time, the records appended meanwhile are written by the next batch
+bool MutationLog::flush(std::unique_lock<std::mutex>& lock, uint64_t sequence) {
+  while (durable_ < sequence && !failed_) {
+    if (syncing_) {
+      synced_.wait(lock);
+      continue;
+    }
+    syncing_ = true;
+    std::string batch;
+    batch.swap(buffer_);
+    uint64_t last = next_ - 1;
+    int fd = fd_;
+    written_ += batch.size();   // the batch being written is counted (see checkpoint())
+    lock.unlock();
+    bool ok = writeAll(fd, batch.data(), batch.size()) && datasync(fd);
+    lock.lock();
+    syncing_ = false;
+    if (ok) durable_ = last;
+    else failed_ = true;
+    synced_.notify_all();
+  }
+  return !failed_;
+}
+
+
+bool MutationLog::commit(uint64_t sequence) {
+  unique_lock<mutex> lock(mutex_);
+  if (syncInterval_ > 0) return !failed_;
+  return flush(lock, sequence);
+}
+
+
+bool MutationLog::sync() {
+  unique_lock<mutex> lock(mutex_);
+  return flush(lock, next_ - 1);
+}
+
+
+uint64_t MutationLog::checkpoint(uint64_t& position) const {
+  lock_guard<mutex> lock(mutex_);
+  position = written_ + buffer_.size();
+  return next_ - 1;
+}
+
+
+uint64_t MutationLog::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return written_ + buffer_.size();
+}
+
+
+// the records that follow _position_ are copied to a new log that replaces the current one.
+// The bulk of the copy is done without the lock: records are appended and written to the
+// current log meanwhile, then only the records written since are copied with the lock held
+bool MutationLog::discard(uint64_t position) {
+  unique_lock<mutex> lock(mutex_);
+  if (discarding_ || !flush(lock, next_ - 1)) return false;
+  synced_.wait(lock, [this]{return !syncing_;});
+  if (position < HeaderSize || position > written_) return false;
+  discarding_ = true;
+  uint64_t copied = written_;
+  int current = fd_;        // only replaced by discard()
+  lock.unlock();
+
+  std::string tmp = path_ + ".tmp";
+  int fd = openFile(tmp, true);
+  std::string data = header();
+  data.resize(size_t(HeaderSize + copied - position));
+  bool ok = fd >= 0 && readAt(current, position, data.data() + HeaderSize, data.size() - HeaderSize)
+    && writeAll(fd, data.data(), data.size()) && datasync(fd);
+
+  lock.lock();
+  synced_.wait(lock, [this]{return !syncing_;});
+  discarding_ = false;
+  if (ok && written_ > copied) {
+    std::string rest(size_t(written_ - copied), '\0');
+    ok = readAt(fd_, copied, rest.data(), rest.size()) && writeAll(fd, rest.data(), rest.size()) && datasync(fd);
+  }
+  if (!ok) {
+    if (fd >= 0) closeFile(fd);
+    remove(tmp.c_str());
+    return false;
+  }
+  closeFile(fd);
+  closeFile(fd_);     // (an open file can't be replaced on Windows)
+  bool replaced = replaceFile(tmp, path_);
+  if (!replaced) remove(tmp.c_str());
+  fd_ = openFile(path_, false);
+  if (fd_ < 0) {
+    failed_ = true;
+    return false;
+  }
+  if (replaced) written_ = HeaderSize + written_ - position;
+  return replaced;
+}
+
+
+void MutationLog::setCompaction(uint64_t maxSize, std::function<void()> const& compact) {
+  lock_guard<mutex> lock(mutex_);
+  maxSize_ = maxSize;
+  compact_ = compact;
+  if (maxSize > 0 && !compactor_.joinable()) {
+    compactor_ = std::thread([this] {
+      unique_lock<mutex> lock(mutex_);
+      while (true) {
+        wakeup_.wait(lock, [this]{return compacting_ || stopping_;});
+        if (stopping_) return;
+        auto compact = compact_;
+        lock.unlock();
+        if (compact) compact();
+        lock.lock();
+        compacting_ = false;
+      }
+    });
+  }
+}
+
+
+// makes the records durable every _syncInterval_ ms
+void MutationLog::run() {
+  unique_lock<mutex> lock(mutex_);
+  while (!stopping_) {
+    wakeup_.wait_for(lock, std::chrono::milliseconds(syncInterval_));
+    if (!buffer_.empty()) flush(lock, next_ - 1);
+  }
+}
@@ -0,0 +1,60 @@
+//
+//  objectpool: pools of fixed-size blocks for the objects of a catalog.
+//
+
+#include <algorithm>
+#include "objectpool.h"
+using namespace std;
+
+
+ObjectPool::~ObjectPool() = default;
+
+
+void* ObjectPool::allocate(size_t size) {
+  // blocks are aligned like the chunks (new aligns them on max_align_t)
+  size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+  lock_guard<mutex> lock(mutex_);
+  if (!blockSize_) blockSize_ = size;
+  else if (size != blockSize_) return nullptr;
+  ++used_;
+
+  if (free_) {
+    void* p = free_;
+    free_ = *static_cast<void**>(p);
+    return p;
+  }
+  if (next_ == end_) {
+    size_t bytes = chunkBlocks_ * blockSize_;
+    chunks_.emplace_back(new std::byte[bytes]);
+    next_ = chunks_.back().get();
+    end_ = next_ + bytes;
+    capacity_ += bytes;
+    chunkBlocks_ = std::min(chunkBlocks_ * 2, MaxChunk);
+  }
+  void* p = next_;
+  next_ += blockSize_;
+  return p;
+}
+
+
+bool ObjectPool::deallocate(void* p, size_t size) {
+  size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+  lock_guard<mutex> lock(mutex_);
+  if (size != blockSize_) return false;
+  *static_cast<void**>(p) = free_;
+  free_ = p;
+  --used_;
+  return true;
+}
+
+
+size_t ObjectPool::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return used_;
+}
+
+
+size_t ObjectPool::capacity() const {
+  lock_guard<mutex> lock(mutex_);
+  return capacity_;
+}
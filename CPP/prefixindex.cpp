@@ -0,0 +1,243 @@
+//
+//  prefixindex: persistent compressed trie of names for prefix searches.
+//
+
+#include <algorithm>
+#include "prefixindex.h"
+using namespace std;
+
+// order of the edges: bytes are compared as unsigned, like std::string does, so that names
+// with bytes >= 0x80 (UTF-8 accents) sort after ASCII
+static bool before(char a, char b) {
+  return static_cast<unsigned char>(a) < static_cast<unsigned char>(b);
+}
+
+
+struct PrefixIndex::Node {
+  std::string label;                    // characters of the edge that leads to this node
+  bool terminal{};                      // true if the path to this node is a name
+  std::vector<NodePtr> children;        // sorted by the first character of their label
+
+  // child whose label starts with _c_, or children.end()
+  std::vector<NodePtr>::const_iterator child(char c) const {
+    auto it = std::lower_bound(children.begin(), children.end(), c,
+                               [](NodePtr const& n, char c) {return before(n->label[0], c);});
+    return (it != children.end() && (*it)->label[0] == c) ? it : children.end();
+  }
+};
+
+
+// length of the common prefix of _a_ and _b_
+static size_t commonLength(std::string_view a, std::string_view b) {
+  size_t n = std::min(a.size(), b.size()), k = 0;
+  while (k < n && a[k] == b[k]) ++k;
+  return k;
+}
+
+
+PrefixIndex::PrefixIndex() : root_(std::make_shared<Node>()) {}
+
+
+PrefixIndex PrefixIndex::insert(std::string_view name) const {
+  bool added = false;
+  NodePtr root = insert(root_, name, added);
+  return PrefixIndex(root, size_ + (added ? 1 : 0));
+}
+
+
+PrefixIndex PrefixIndex::insert(std::vector<std::string_view> names) const {
+  if (names.empty()) return *this;
+  std::sort(names.begin(), names.end());
+  size_t added = 0;
+  auto root = std::make_shared<Node>(*root_);
+  insert(*root, names.data(), names.data() + names.size(), added);
+  return PrefixIndex(root, size_ + added);
+}
+
+
+PrefixIndex PrefixIndex::erase(std::string_view name) const {
+  bool removed = false;
+  NodePtr root = erase(root_, name, true, removed);
+  return PrefixIndex(root, size_ - (removed ? 1 : 0));
+}
+
+
+// returns _node_ with _rest_ inserted below it (_node_ itself if _rest_ was already there)
+PrefixIndex::NodePtr PrefixIndex::insert(NodePtr const& node, std::string_view rest, bool& added) {
+  if (rest.empty()) {
+    if (node->terminal) return node;
+    auto copy = std::make_shared<Node>(*node);
+    copy->terminal = true;
+    added = true;
+    return copy;
+  }
+
+  auto copy = std::make_shared<Node>(*node);
+  auto it = node->child(rest[0]);
+  auto& children = copy->children;
+
+  if (it == node->children.end()) {
+    auto leaf = std::make_shared<Node>();
+    leaf->label = std::string(rest);
+    leaf->terminal = true;
+    auto pos = std::lower_bound(children.begin(), children.end(), rest[0],
+                                [](NodePtr const& n, char c) {return before(n->label[0], c);});
+    children.insert(pos, leaf);
+    added = true;
+    return copy;
+  }
+
+  NodePtr const& child = *it;
+  auto& slot = children[it - node->children.begin()];
+  size_t common = commonLength(child->label, rest);
+
+  if (common == child->label.size()) {
+    NodePtr newChild = insert(child, rest.substr(common), added);
+    if (newChild == child) return node;
+    slot = newChild;
+    return copy;
+  }
+
+  // the label of the child is split: a new node holds their common part
+  auto middle = std::make_shared<Node>();
+  middle->label = child->label.substr(0, common);
+  auto lower = std::make_shared<Node>(*child);
+  lower->label = child->label.substr(common);
+  middle->children.push_back(lower);
+  if (common == rest.size()) {
+    middle->terminal = true;
+  }
+  else {
+    auto leaf = std::make_shared<Node>();
+    leaf->label = std::string(rest.substr(common));
+    leaf->terminal = true;
+    if (before(leaf->label[0], lower->label[0])) middle->children.insert(middle->children.begin(), leaf);
+    else middle->children.push_back(leaf);
+  }
+  slot = middle;
+  added = true;
+  return copy;
+}
+
+
+// inserts the sorted names [first, last) below _node_, which is a new node (not shared yet):
+// the names that start with the same character go below the same child, which is copied once
+void PrefixIndex::insert(Node& node, std::string_view* first, std::string_view* last, size_t& added) {
+  for (; first != last && first->empty(); ++first) {
+    if (!node.terminal) ++added;
+    node.terminal = true;
+  }
+  while (first != last) {
+    char c = (*first)[0];
+    std::string_view* end = std::find_if(first, last, [c](std::string_view n) {return n[0] != c;});
+    auto it = node.child(c);
+    size_t slot = size_t(it - node.children.begin());
+    std::shared_ptr<Node> copy;
+    size_t common;
+
+    if (it == node.children.end()) {
+      // new child, whose label is the common prefix of the names (the first and the last one)
+      common = commonLength(*first, *(end - 1));
+      copy = std::make_shared<Node>();
+      copy->label = std::string(first->substr(0, common));
+      auto pos = std::lower_bound(node.children.begin(), node.children.end(), c,
+                                  [](NodePtr const& n, char c) {return before(n->label[0], c);});
+      slot = size_t(pos - node.children.begin());
+      node.children.insert(pos, copy);
+    }
+    else {
+      NodePtr child = *it;
+      common = child->label.size();
+      for (auto* name = first; name != end; ++name) common = std::min(common, commonLength(child->label, *name));
+      if (common == child->label.size()) copy = std::make_shared<Node>(*child);
+      else {
+        // the label of the child is split: a new node holds the part common to all the names
+        copy = std::make_shared<Node>();
+        copy->label = child->label.substr(0, common);
+        auto lower = std::make_shared<Node>(*child);
+        lower->label = child->label.substr(common);
+        copy->children.push_back(lower);
+      }
+    }
+    for (auto* name = first; name != end; ++name) name->remove_prefix(common);
+    insert(*copy, first, end, added);
+    node.children[slot] = copy;
+    first = end;
+  }
+}
+
+
+// returns _node_ without _rest_ (nullptr if _node_ is removed too, _node_ itself if _rest_
+// was not found), nodes that are left with a single child and no name are merged with it
+PrefixIndex::NodePtr PrefixIndex::erase(NodePtr const& node, std::string_view rest,
+                                        bool root, bool& removed) {
+  std::shared_ptr<Node> copy;
+
+  if (rest.empty()) {
+    if (!node->terminal) return node;
+    removed = true;
+    if (node->children.empty() && !root) return nullptr;
+    copy = std::make_shared<Node>(*node);
+    copy->terminal = false;
+  }
+  else {
+    auto it = node->child(rest[0]);
+    if (it == node->children.end()) return node;
+    NodePtr const& child = *it;
+    if (rest.substr(0, child->label.size()) != child->label) return node;
+
+    NodePtr newChild = erase(child, rest.substr(child->label.size()), false, removed);
+    if (!removed) return node;
+    copy = std::make_shared<Node>(*node);
+    auto pos = copy->children.begin() + (it - node->children.begin());
+    if (newChild) *pos = newChild;
+    else copy->children.erase(pos);
+  }
+
+  if (!root && !copy->terminal && copy->children.size() == 1) {
+    auto merged = std::make_shared<Node>(*copy->children[0]);
+    merged->label = copy->label + merged->label;
+    return merged;
+  }
+  return copy;
+}
+
+
+std::vector<std::string> PrefixIndex::find(std::string_view prefix, size_t limit) const {
+  std::vector<std::string> names;
+  Node const* node = root_.get();
+  std::string name;
+
+  while (!prefix.empty()) {
+    auto it = node->child(prefix[0]);
+    if (it == node->children.end()) return names;
+    Node const& child = **it;
+    size_t common = commonLength(child.label, prefix);
+    // the prefix ends in the label of the child: all the names below it match
+    if (common == prefix.size()) {
+      name += child.label;
+      collect(child, name, limit, names);
+      return names;
+    }
+    if (common < child.label.size()) return names;
+    name += child.label;
+    prefix.remove_prefix(common);
+    node = &child;
+  }
+  collect(*node, name, limit, names);
+  return names;
+}
+
+
+// adds the names of _node_ and its descendants, _name_ is the path to _node_
+void PrefixIndex::collect(Node const& node, std::string& name, size_t limit,
+                          std::vector<std::string>& names) {
+  if (limit > 0 && names.size() >= limit) return;
+  if (node.terminal) names.push_back(name);
+  for (auto& child : node.children) {
+    if (limit > 0 && names.size() >= limit) return;
+    name += child->label;
+    collect(*child, name, limit, names);
+    name.resize(name.size() - child->label.size());
+  }
+}
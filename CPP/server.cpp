@@ -4,31 +4,157 @@
 //  Eric Lecolinet - Telecom ParisTech - 2016.
 //
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <filesystem>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <sstream>
-#include <algorithm>
+#include <thread>
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <csignal>
+#endif
 #include "tcpserver.h"
 #include "MediaManager.h"
+#include "mediaimporter.h"
 
 const int PORT = 3331;
 
+// Chemin de _dir_ (relatif a _root_ s'il n'est pas absolu) s'il est dans _root_, chemin vide
+// sinon : les chemins sont normalises et les liens symboliques resolus, ".." ou un lien ne
+// permettent pas de sortir de _root_
+static std::string importPath(std::string const& root, std::string const& dir)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path base = fs::weakly_canonical(root, ec);
+    if (ec) return {};
+    fs::path path = fs::weakly_canonical(base / dir, ec);
+    if (ec) return {};
+    auto r = path.begin();
+    for (auto b = base.begin(); b != base.end(); ++b, ++r)
+    {
+        if (b->empty()) continue; // separateur final de base
+        if (r == path.end() || *r != *b) return {};
+    }
+    return path.string();
+}
+
+// Retire et renvoie le premier mot de _s_ (comme >> sur un stream, mais sans copie)
+static std::string_view nextWord(std::string_view& s)
+{
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string_view::npos) begin = s.size();
+    size_t end = std::min(s.find_first_of(" \t\r\n", begin), s.size());
+    std::string_view word = s.substr(begin, end - begin);
+    s.remove_prefix(end);
+    return word;
+}
+
+// Convertit _word_ en nombre, renvoie false si ce n'est pas un nombre
+template <typename T>
+static bool toNumber(std::string_view word, T& value)
+{
+    auto result = std::from_chars(word.data(), word.data() + word.size(), value);
+    return !word.empty() && result.ec == std::errc() && result.ptr == word.data() + word.size();
+}
+
 
 int main(int argc, char* argv[])
 {
     
     auto myManager = std::make_shared<MediaManager>();
-    myManager->createPhoto("Photo1", "montsouris.jpg", 48.8, 2.3);
-    myManager->createVideo("Video1", "video.mp4", 120);
+
+    // Options:
+    // -events : sert les clients avec des boucles d'evenements (epoll) au lieu d'un thread par client
+    // -workers n : execute les requetes dans un pool de n threads
+    // -queue n : nombre maximum de requetes en attente d'un thread du pool
+    // -shards n : n sockets d'ecoute (SO_REUSEPORT), chacun sur son propre coeur
+    // -local path : ecoute aussi sur un socket Unix (clients sur la meme machine)
+    // -maxcnx n : nombre maximum de connexions (les suivantes recoivent BUSY)
+    // -inflight n : nombre maximum de requetes traitees en meme temps (les suivantes recoivent BUSY)
+    // -idle ms, -rtimeout ms, -wtimeout ms : ferme les connexions inactives, ou trop lentes
+    //   a envoyer leurs requetes ou a lire les reponses
+    // -snapshot path : charge le catalogue depuis ce fichier au demarrage et l'y sauve a l'arret
+    //   (et sur la commande SAVE)
+    // -log path : ajoute les modifications du catalogue a ce journal, qui est rejoue au demarrage
+    //   et compacte dans le fichier de -snapshot (path.snapshot par defaut)
+    // -sync ms : intervalle de synchronisation du journal sur le disque (0 : a chaque modification)
+    // -import dir : autorise la commande IMPORT pour les repertoires de dir (elle est refusee
+    //   sinon, car FETCH renvoie ensuite les fichiers importes a n'importe quel client)
+    TCPServer::Mode mode = TCPServer::ThreadPerClient;
+    unsigned workers = 0;
+    size_t maxQueued = 0;
+    unsigned shards = 1;
+    std::string localPath;
+    size_t maxConnections = 0, maxInFlight = 0;
+    int idleTimeout = 0, readTimeout = 0, writeTimeout = 0;
+    std::string snapshotPath, logPath;
+    unsigned syncInterval = 100;
+    std::string importRoot;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-events") mode = TCPServer::EventDriven;
+        else if (arg == "-workers" && i + 1 < argc) workers = std::stoul(argv[++i]);
+        else if (arg == "-queue" && i + 1 < argc) maxQueued = std::stoul(argv[++i]);
+        else if (arg == "-shards" && i + 1 < argc) shards = std::stoul(argv[++i]);
+        else if (arg == "-local" && i + 1 < argc) localPath = argv[++i];
+        else if (arg == "-maxcnx" && i + 1 < argc) maxConnections = std::stoul(argv[++i]);
+        else if (arg == "-inflight" && i + 1 < argc) maxInFlight = std::stoul(argv[++i]);
+        else if (arg == "-idle" && i + 1 < argc) idleTimeout = std::stoi(argv[++i]);
+        else if (arg == "-rtimeout" && i + 1 < argc) readTimeout = std::stoi(argv[++i]);
+        else if (arg == "-wtimeout" && i + 1 < argc) writeTimeout = std::stoi(argv[++i]);
+        else if (arg == "-snapshot" && i + 1 < argc) snapshotPath = argv[++i];
+        else if (arg == "-log" && i + 1 < argc) logPath = argv[++i];
+        else if (arg == "-sync" && i + 1 < argc) syncInterval = std::stoul(argv[++i]);
+        else if (arg == "-import" && i + 1 < argc) importRoot = argv[++i];
+    }
+    if (!logPath.empty() && snapshotPath.empty()) snapshotPath = logPath + ".snapshot";
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    // les signaux d'arret sont bloques dans tous les threads (y compris ceux du journal)
+    // et recus par le thread stopper
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+#endif
+
+    // le fichier est projete en memoire : les objets ne sont construits qu'a leur premier acces
+    bool restored = !snapshotPath.empty() && myManager->load(snapshotPath);
+    if (restored) std::cout << "Catalog loaded from " << snapshotPath << std::endl;
+    if (!logPath.empty()) {
+        long replayed = myManager->openLog(logPath, snapshotPath, syncInterval);
+        if (replayed < 0) {
+            std::cerr << "Could not open the mutation log " << logPath << std::endl;
+            return 1;
+        }
+        std::cout << replayed << " mutations replayed from " << logPath << std::endl;
+        restored = restored || replayed > 0;
+    }
+    if (!restored) {
+        auto p1 = myManager->createPhoto("Photo1", "montsouris.jpg", 48.8, 2.3);
+        auto v1 = myManager->createVideo("Video1", "video.mp4", 120);
+        auto g1 = myManager->createGroupe("Medias");
+        g1->push_back(p1);
+        g1->push_back(v1);
+    }
+
+    // IMPORT dir : importe en arriere-plan les fichiers multimedia d'un repertoire de importRoot
+    // (cf. PROGRESS), dont les metadonnees sont gardees en cache pour PROBE
+    MediaImporter importer(*myManager);
 
     auto* server = new TCPServer([&](std::string const& request, std::string& response) {
         
         std::cout << "Requête reçue: " << request << std::endl;
 
-        std::stringstream ss(request);
-        std::string command, name;
-        ss >> command >> name; // Découpe "SEARCH nom" ou "PLAY nom"
+        // Découpe "SEARCH nom" ou "PLAY nom" (les mots sont des vues sur la requete)
+        std::string_view words(request);
+        std::string_view command = nextWord(words), name = nextWord(words);
 
         std::stringstream resStream;
 
@@ -38,6 +164,147 @@ int main(int argc, char* argv[])
             response = resStream.str();
             
         } 
+        else if (command == "GROUP") {
+            // reponse sur plusieurs lignes : les '\n' ne sont conserves qu'en mode binaire
+            myManager->displayGroupe(name, resStream);
+            response = resStream.str();
+        }
+        else if (command == "LIST") {
+            // noms de tous les objets, sur plusieurs lignes comme GROUP
+            myManager->listObjects(resStream);
+            response = resStream.str();
+        }
+        else if (command == "PREFIX") {
+            // PREFIX abc [limit] : noms des objets commencant par abc, un par ligne
+            size_t max = 0;
+            toNumber(nextWord(words), max);
+            for (auto& found : myManager->findPrefix(name, max)) resStream << found << '\n';
+            response = resStream.str();
+        }
+        else if (command == "NEAR") {
+            // NEAR lat lon rayon_km [k] : photos a moins de rayon_km, les plus proches d'abord
+            double lat = 0, lon = 0, radius = 0;
+            size_t k = 0;
+            // from_chars accepte "nan" et "inf", qui n'ont pas de position
+            if (toNumber(name, lat) && toNumber(nextWord(words), lon) && toNumber(nextWord(words), radius)
+                && std::isfinite(lat) && std::isfinite(lon) && std::isfinite(radius)) {
+                toNumber(nextWord(words), k);
+                myManager->findNear(lat, lon, radius, k, [&](const GeoIndex::Neighbor& n) {
+                    resStream << n.place.name << ' ' << n.distance << '\n';
+                });
+                response = resStream.str();
+            }
+            else response = "Usage: NEAR lat lon radius_km [k]";
+        }
+        else if (command == "BBOX") {
+            // BBOX latMin lonMin latMax lonMax [limit] : photos dans le rectangle
+            double box[4] = {};
+            size_t limit = 0;
+            bool ok = toNumber(name, box[0]);
+            for (int k = 1; k < 4 && ok; ++k) ok = toNumber(nextWord(words), box[k]);
+            for (int k = 0; k < 4 && ok; ++k) ok = std::isfinite(box[k]);
+            if (ok) {
+                toNumber(nextWord(words), limit);
+                myManager->findWithin(box[0], box[1], box[2], box[3], limit, [&](const GeoIndex::Place& p) {
+                    resStream << p.name << ' ' << p.latitude << ' ' << p.longitude << '\n';
+                });
+                response = resStream.str();
+            }
+            else response = "Usage: BBOX lat_min lon_min lat_max lon_max [limit]";
+        }
+        else if (command == "DURATION") {
+            // DURATION min max [limit] : videos et films dont la duree est entre min et max
+            int min = 0, max = 0;
+            size_t limit = 0, count = 0;
+            if (toNumber(name, min) && toNumber(nextWord(words), max)) {
+                toNumber(nextWord(words), limit);
+                myManager->forEachDuree(min, max, [&](std::string_view found, int duree) {
+                    resStream << found << ' ' << duree << '\n';
+                    return limit == 0 || ++count < limit;
+                });
+                response = resStream.str();
+            }
+            else response = "Usage: DURATION min max [limit]";
+        }
+        else if (command == "LONGEST") {
+            // LONGEST k : les k videos ou films les plus longs
+            size_t k = 0, count = 0;
+            if (toNumber(name, k) && k > 0) {
+                myManager->forEachLongest([&](std::string_view found, int duree) {
+                    resStream << found << ' ' << duree << '\n';
+                    return ++count < k;
+                });
+                response = resStream.str();
+            }
+            else response = "Usage: LONGEST k";
+        }
+        else if (command == "FIND") {
+            // FIND mot... : objets dont le nom ou le fichier contient tous les mots
+            std::string_view query(name.data(), request.data() + request.size() - name.data());
+            myManager->findText(query, [&](std::string_view found) {
+                resStream << found << '\n';
+                return true;
+            });
+            response = resStream.str();
+        }
+        else if (command == "STATS") {
+            // taille de l'index de texte et memoire utilisee par posting
+            auto s = myManager->textStats();
+            resStream << "terms " << s.terms << " documents " << s.documents << " removed " << s.removed
+                      << " postings " << s.postings << " bytes " << s.bytes
+                      << " bytes/posting " << (s.postings ? double(s.bytes) / s.postings : 0.0);
+            response = resStream.str();
+        }
+        else if (command == "IMPORT") {
+            // IMPORT repertoire : le chemin est la fin de la requete (il peut contenir des espaces)
+            std::string dir(name.data(), request.data() + request.size() - name.data());
+            dir.erase(dir.find_last_not_of(" \t\r\n") + 1);
+            std::string path = importRoot.empty() || dir.empty() ? std::string() : importPath(importRoot, dir);
+            if (importRoot.empty()) response = "IMPORT is disabled (see the -import option of the server)";
+            else if (dir.empty()) response = "Usage: IMPORT directory";
+            else if (path.empty()) response = "Could not import " + dir + " (not in the import directory)";
+            else if (importer.start(path)) response = "Importing " + path;
+            else response = "Could not import " + dir + " (not a directory or import in progress)";
+        }
+        else if (command == "PROGRESS") {
+            // compteurs de l'import en cours (ou du dernier)
+            auto p = importer.progress();
+            resStream << (p.running ? "running" : "idle") << " directories " << p.directories
+                      << " files " << p.files << " photos " << p.photos << " videos " << p.videos
+                      << " films " << p.films << " added " << p.added << " probed " << p.probed
+                      << " skipped " << p.skipped
+                      << " errors " << p.errors << " seconds " << p.seconds;
+            response = resStream.str();
+        }
+        else if (command == "PROBE") {
+            // PROBE nom : lit les metadonnees du fichier de l'objet (en cache tant que le fichier
+            // ne change pas) et met a jour ses coordonnees, sa duree ou ses chapitres
+            auto obj = myManager->findObject(name);
+            auto m = obj ? importer.prober().get(obj->getNomFichier()) : nullptr;
+            if (!obj) response = "Unknown object: " + std::string(name);
+            else if (!m || m->format == MediaProber::Unknown) response = "Could not probe " + obj->getNomFichier();
+            else {
+                if (auto photo = std::dynamic_pointer_cast<Photo>(obj); photo && m->located) {
+                    photo->setLatitude(m->latitude);
+                    photo->setLongitude(m->longitude);
+                }
+                else if (auto video = std::dynamic_pointer_cast<Video>(obj); video && m->format == MediaProber::Mp4) {
+                    video->setDuree(std::round(m->duration));
+                    if (auto film = std::dynamic_pointer_cast<Film>(obj))
+                        film->setChapitres(m->chapters.data(), int(m->chapters.size()));
+                }
+                if (m->format == MediaProber::Jpeg) resStream << "jpeg " << m->width << "x" << m->height;
+                else resStream << "mp4 duration " << m->duration << " chapters " << m->chapters.size();
+                if (m->located) resStream << " latitude " << m->latitude << " longitude " << m->longitude;
+                response = resStream.str();
+            }
+        }
+        else if (command == "SAVE") {
+            // sauve le catalogue dans le fichier donne par -snapshot
+            if (snapshotPath.empty()) response = "No snapshot file (-snapshot path)";
+            else if (!logPath.empty()) response = myManager->compact() ? "Saved" : "Could not save " + snapshotPath;
+            else response = myManager->save(snapshotPath) ? "Saved" : "Could not save " + snapshotPath;
+        }
         else if (command == "PLAY") {
         myManager->playObject(name, resStream);
         response = resStream.str();
@@ -47,22 +314,56 @@ int main(int argc, char* argv[])
         return false; // Retourner false ferme la connexion/le serveur
         }
         else {
-            response = "Unknown command: " + command;
+            response = "Unknown command: " + std::string(command);
         }
 
-        // IMPORTANT : Nettoyer les '\n' et '\r' car ils cassent le protocole
-        std::replace(response.begin(), response.end(), '\n', ' ');
-        std::replace(response.begin(), response.end(), '\r', ' ');
-
+        // NB: en mode ligne, TCPServer remplace les '\n' et '\r' des reponses par des espaces
+        // (ils cassent le protocole). En mode binaire (FRAMING BINARY) les reponses sont envoyees telles quelles.
         return true; // Garder la connexion ouverte
+    }, mode);
+
+    // FETCH nom [offset longueur] : envoie le contenu du fichier de l'objet
+    server->setFileResolver([&](std::string const& name, std::string& path) {
+        auto obj = myManager->findObject(name);
+        if (!obj) return false;
+        path = obj->getNomFichier();
+        return true;
+    });
+
+    server->setWorkerCount(workers);
+    server->setMaxQueuedRequests(maxQueued);
+    server->setLocalPath(localPath);
+    server->setMaxConnections(maxConnections);
+    server->setMaxInFlight(maxInFlight);
+    server->setIdleTimeout(idleTimeout);
+    server->setReadTimeout(readTimeout);
+    server->setWriteTimeout(writeTimeout);
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    // Ctrl-C ou kill : le serveur termine les requetes en cours (5 secondes au plus)
+    std::thread stopper([&] {
+        int sig = 0;
+        sigwait(&signals, &sig);
+        std::cout << "Stopping Server" << std::endl;
+        if (!server->stop(5000)) std::cerr << "Some requests were interrupted" << std::endl;
     });
+#endif
 
     std::cout << "Starting Server on port " << PORT << std::endl;
-    int status = server->run(PORT);
+    int status = server->run(PORT, shards);
     if (status < 0) {
         std::cerr << "Could not start Server on port " << PORT << std::endl;
+#if !defined(_WIN32) && !defined(_WIN64)
+        stopper.detach();
+#endif
         return 1;
     }
 
+#if !defined(_WIN32) && !defined(_WIN64)
+    stopper.join();   // attend la fin des connexions
+#endif
+    delete server;
+    if (!snapshotPath.empty() && !(logPath.empty() ? myManager->save(snapshotPath) : myManager->compact()))
+        std::cerr << "Could not save the catalog to " << snapshotPath << std::endl;
     return 0;
 }
@@ -4,13 +4,121 @@
 //  http://www.telecom-paristech.fr/~elc
 //
 
+#include <algorithm>
 #include <csignal>
+#include <cstring>
 #include <iostream>
+#include <future>
+#include <sstream>
+#include <mutex>
 #include <thread>
 #include "tcpserver.h"
+#include "workerpool.h"
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
 using namespace std;
 
-/// Connection with a given client. Each SocketCnx uses a different thread.
+const char* const TCPServer::BinaryFramingRequest = "FRAMING BINARY";
+const char* const TCPServer::BusyResponse = "BUSY";
+
+// reads a request according to the framing used by the connection
+static SOCKSIZE readRequest(SocketBuffer* sockbuf, bool binary, std::string& request, bool block) {
+  if (!binary) return block ? sockbuf->readLine(request) : sockbuf->tryReadLine(request);
+  int opcode;
+  return block ? sockbuf->readFrame(request, opcode) : sockbuf->tryReadFrame(request, opcode);
+}
+
+// pins the calling thread (and the threads it will create) to core _cpu_ if _cpu_ >= 0.
+static void pinThread(int cpu) {
+#if defined(__linux__)
+  if (cpu < 0) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);  // ignored if not allowed
+#else
+  (void)cpu;
+#endif
+}
+
+// true if the request switches a connection that uses lines to binary framing
+static bool isBinaryFramingRequest(bool binary, std::string const& request) {
+  return !binary && request == TCPServer::BinaryFramingRequest;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Range of a file sent by the FETCH command.
+struct FileTransfer {
+  FileTransfer() = default;
+  FileTransfer(FileTransfer const&) = delete;
+  FileTransfer& operator=(FileTransfer const&) = delete;
+  ~FileTransfer() { close(); }
+
+  bool active() const { return fd_ >= 0; }
+
+  void close() {
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (fd_ >= 0) ::close(fd_);
+#endif
+    fd_ = -1;
+  }
+
+  int fd_{-1};
+  long long offset_{};    // next byte to send
+  size_t remaining_{};    // number of bytes to send
+};
+
+
+static bool isFetchRequest(TCPServer const& server, std::string const& request) {
+  return server.fileResolver() && request.compare(0, 6, "FETCH ") == 0;
+}
+
+
+// sends the file range of _transfer_ without copying it in user space (with sendfile() on Linux).
+// On a non-blocking socket, returns true when the socket would block, the transfer then
+// remains active. Returns false if an error occurred.
+static bool sendFile(Socket* sock, FileTransfer& transfer) {
+#if defined(_WIN32) || defined(_WIN64)
+  transfer.close();
+  return false;
+#else
+  while (transfer.remaining_ > 0) {
+#if defined(__linux__)
+    off_t offset = transfer.offset_;
+    SOCKSIZE sent = ::sendfile(sock->descriptor(), transfer.fd_, &offset, transfer.remaining_);
+#else
+    char buf[64 * 1024];
+    SOCKSIZE sent = ::pread(transfer.fd_, buf, std::min(sizeof(buf), transfer.remaining_),
+                            off_t(transfer.offset_));
+    if (sent > 0) sent = sock->send(buf, sent);
+#endif
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent < 0 && Socket::wouldBlock()) return true;
+    if (sent <= 0) {    // error or truncated file
+      transfer.close();
+      return false;
+    }
+    transfer.offset_ += sent;
+    transfer.remaining_ -= sent;
+  }
+  transfer.close();
+  return true;
+#endif
+}
+
+/// Connection with a given client. Each SocketCnx uses a different thread, which is joined
+/// by the server once the connection is closed (see TCPServer::reapConnections()).
 class SocketCnx {
 public:
   SocketCnx(TCPServer&, Socket*);
@@ -21,20 +129,28 @@ public:
   TCPServer& server_;
   Socket* sock_;
   SocketBuffer* sockbuf_;
+  bool binary_{};     // binary framing instead of lines
   std::thread thread_;
+  TCPServer::ConnectionTimer timer_;    // closes the connection when a timeout expires
 };
 
 
 SocketCnx::SocketCnx(TCPServer& server, Socket* socket) :
 server_(server),
 sock_(socket),
-sockbuf_(new SocketBuffer(sock_)),
-thread_( std::thread([this]{processRequests();}) ) {
-  thread_.detach();
+sockbuf_(new SocketBuffer(sock_)) {
+  server_.initDeadline(timer_, sock_);
+  // the thread cannot release this connection before thread_ is set
+  lock_guard<mutex> lock(server_.cnxMutex_);
+  server_.connections_.insert(this);
+  // accepted while the server was stopping, after stop() woke up the connections
+  if (server_.stopping_) sock_->shutdownInput();
+  thread_ = std::thread([this]{processRequests();});
 }
 
 
 SocketCnx::~SocketCnx() {
+  server_.cancelDeadline(timer_);
   sock_->close();
   delete sockbuf_;
   delete sock_;
@@ -42,13 +158,21 @@ SocketCnx::~SocketCnx() {
 
 
 // infinite loop that processes incoming requests on a TCPServer::Cnx connection.
+// Requests are pipelined: all the requests that were already received are processed in order
+// then their responses are sent together by a single gathered write.
 void SocketCnx::processRequests() {
+  std::vector<std::string> requests, responses;
+  FileTransfer transfer;
+
   while (true) {
-    std::string request, response;
+    requests.clear();
+    responses.clear();
+    std::string request;
+    server_.setDeadline(timer_, TCPServer::IdleDeadline);
 
     // read the incoming request sent by the client
     // SocketBuffer::readLine() lit jusqu'au premier délimiteur (qui est supprimé)
-    auto received = sockbuf_->readLine(request);
+    auto received = readRequest(sockbuf_, binary_, request, true);
 
     if (received < 0) {
       server_.error("Read error");
@@ -56,64 +180,980 @@ void SocketCnx::processRequests() {
     }
 
     if (received == 0) {
-      server_.error("Connection closed by client");
+      if (!server_.stopping_) server_.error("Connection closed by client");
       break;
     }
 
-    // processes the request
-    if (!server_.callback_) {
-      response = "OK";
+    // then the following requests if they are already in the buffer (no system call, no blocking).
+    // Reading stops at a framing request as the next requests will be frames, and at a
+    // FETCH request as the file must be sent before the next responses
+    bool upgrade = isBinaryFramingRequest(binary_, request);
+    bool fetch = isFetchRequest(server_, request);
+    if (!upgrade) requests.push_back(std::move(request));
+
+    while (!upgrade && !fetch && requests.size() < TCPServer::MaxBatch
+           && (binary_ ? sockbuf_->hasFrame() : sockbuf_->hasLine())) {
+      readRequest(sockbuf_, binary_, request, true);
+      upgrade = isBinaryFramingRequest(binary_, request);
+      fetch = isFetchRequest(server_, request);
+      if (!upgrade) requests.push_back(std::move(request));
     }
-    // closes the connection with this client if the callback returns false
-    else if (!server_.callback_(request, response)) {
+
+    // processes the requests, by a worker of the pool if there is one.
+    // submit() blocks this thread while the pool is full, so that this client is pushed back
+    server_.setDeadline(timer_, TCPServer::NoDeadline);
+    bool keep = true;
+    if (auto* pool = server_.pool_) {
+      auto done = std::make_shared<std::promise<bool>>();
+      auto result = done->get_future();
+      pool->submit([&, done]{
+        done->set_value(server_.processRequests(requests, responses, !binary_, &transfer));
+      });
+      keep = result.get();
+    }
+    else keep = server_.processRequests(requests, responses, !binary_, &transfer);
+
+    if (upgrade && keep) responses.push_back("OK");
+    server_.setDeadline(timer_, TCPServer::WriteDeadline);
+
+    // a response is always sent to the client (otherwise it might block)
+    // writeLines() sends each response followed by a \n delimiter
+    if (!responses.empty()) {
+      auto sent = binary_ ? sockbuf_->writeFrames(responses, TCPServer::ResponseFrame)
+      : sockbuf_->writeLines(responses);
+
+      if (sent < 0) {
+        server_.error("Write error");
+        break;
+      }
+
+      if (sent == 0) {
+        server_.error("Connection closed by client");
+        break;
+      }
+    }
+
+    // the content of the file follows its response (as a frame in binary mode)
+    if (transfer.active()) {
+      if (binary_) {
+        char header[SocketBuffer::FrameHeaderSize];
+        SocketBuffer::encodeFrameHeader(header, transfer.remaining_, TCPServer::FileFrame);
+        if (sockbuf_->write(header, sizeof(header)) <= 0) {
+          server_.error("Write error");
+          break;
+        }
+      }
+      if (!sendFile(sock_, transfer)) {
+        server_.error("Write error");
+        break;
+      }
+    }
+
+    // closes the connection with this client if the callback returned false
+    if (!keep) {
       server_.error("Closing connection with client");
       break;
     }
 
-    // a response is always sent to the client (otherwise it might block)
-    // writeLine() response folled by a \n delimiter
-    auto sent = sockbuf_->writeLine(response);
+    // the server is stopping: the current requests have been processed
+    if (server_.stopping_) break;
+
+    if (upgrade) binary_ = true;
+  }
+
+  // the socket is closed now, other resources are freed once the thread has been joined
+  server_.cancelDeadline(timer_);
+  server_.release(this);
+  sock_->close();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+#if defined(__linux__)
+
+/// Connection with a given client in TCPServer::EventDriven mode.
+/// An EventCnx is only accessed by the thread of the EventLoop it belongs to.
+struct EventCnx {
+  EventCnx(Socket* socket) : sock_(socket), sockbuf_(new SocketBuffer(sock_)) {}
+
+  ~EventCnx() {
+    sock_->close();
+    delete sockbuf_;
+    delete sock_;
+  }
+
+  // state of the current request
+  // - Idle: no request, the next one can be read
+  // - Queued: waiting for room in the worker pool
+  // - Running: being processed by a worker, which is the only one to access requests_,
+  //   responses_ and keep_ until the EventLoop is notified
+  enum State { Idle, Queued, Running };
+
+  Socket* sock_;
+  SocketBuffer* sockbuf_;
+  std::string output_;    // responses that have not been (entirely) sent yet
+  size_t outpos_{};       // first byte of output_ that has not been sent
+  bool stalled_{};        // stopped reading requests until output_ is sent
+  bool binary_{};         // binary framing instead of lines
+  bool upgrade_{};        // switches to binary framing once the current requests are processed
+  bool closed_{};         // closed while Running, deleted when the request completes
+  State state_{Idle};
+  std::vector<std::string> requests_, responses_;   // pipelined requests and their responses
+  bool keep_{true};
+  FileTransfer transfer_;   // sent once output_ has been sent
+  TCPServer::ConnectionTimer timer_;  // closes the connection when a timeout expires
+};
+
+
+/// Serves many connections from a single thread using non-blocking sockets and
+/// edge-triggered epoll. Each SocketBuffer is used as a state machine that keeps
+/// partially received requests until they are complete.
+class EventLoop {
+public:
+  /// Starts the thread of the loop, which runs on core _cpu_ if _cpu_ >= 0.
+  EventLoop(TCPServer&, int cpu = -1);
+
+  /// Adds a new connection to this loop (called by the thread that accepts connections).
+  bool add(Socket*);
+
+  /// Drains the connections of this loop (see TCPServer::stop()) then joins its thread.
+  void stop();
+
+  ~EventLoop();
+
+private:
+  void run();
+  bool drain();
+  void destroy(EventCnx*);
+  void updateDeadline(EventCnx*);
+  void onEvent(EventCnx*, uint32_t events);
+  bool processRequests(EventCnx*);
+  bool execute(EventCnx*);
+  bool respond(EventCnx*);
+  void complete(EventCnx*);
+  void onCompleted();
+  bool flush(EventCnx*);
+  void close(EventCnx*);
+
+  // stop reading requests when more than this number of bytes are waiting to be sent
+  static const size_t MaxPendingOutput = 1 << 20;
+
+  TCPServer& server_;
+  int epfd_{-1};
+  int wakefd_{-1};                    // eventfd signaled by workers when a request completes
+  std::mutex mutex_;
+  std::vector<EventCnx*> completed_;  // requests completed by workers (protected by mutex_)
+  std::unordered_set<EventCnx*> connections_;   // all connections (protected by mutex_)
+  bool stopped_{};                    // the thread has terminated (protected by mutex_)
+  std::vector<EventCnx*> backlog_;    // Queued connections
+  std::thread thread_;
+};
+
+
+EventLoop::EventLoop(TCPServer& server, int cpu) :
+server_(server),
+epfd_(::epoll_create1(EPOLL_CLOEXEC)),
+wakefd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+  struct epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;    // distinguishes wakefd_ from connections
+  if (epfd_ >= 0 && wakefd_ >= 0) ::epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+  thread_ = std::thread([this, cpu]{pinThread(cpu); run();});
+}
+
+
+EventLoop::~EventLoop() {
+  stop();
+  if (wakefd_ >= 0) ::close(wakefd_);
+  if (epfd_ >= 0) ::close(epfd_);
+}
+
+
+void EventLoop::stop() {
+  uint64_t one = 1;
+  if (::write(wakefd_, &one, sizeof(one)) < 0) {}
+  if (thread_.joinable()) thread_.join();
+}
+
+
+bool EventLoop::add(Socket* socket) {
+  auto* cnx = new EventCnx(socket);
+  struct epoll_event ev{};
+  // edge-triggered: events are only reported when the state of the socket changes,
+  // hence sockets must be read (and written) until they would block
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = cnx;
+
+  // connections_ is updated first as events may be reported as soon as the socket is watched
+  bool stopped;
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopped = stopped_;
+    connections_.insert(cnx);
+  }
+  server_.initDeadline(cnx->timer_, socket);
+  server_.setDeadline(cnx->timer_, TCPServer::IdleDeadline);
+
+  if (stopped || epfd_ < 0 || socket->setBlocking(false) < 0
+      || ::epoll_ctl(epfd_, EPOLL_CTL_ADD, socket->descriptor(), &ev) < 0) {
+    destroy(cnx);
+    return false;
+  }
+  // cnx now belongs to the thread of this loop
+  return true;
+}
+
+
+void EventLoop::destroy(EventCnx* cnx) {
+  server_.cancelDeadline(cnx->timer_);
+  {
+    lock_guard<mutex> lock(mutex_);
+    connections_.erase(cnx);
+  }
+  delete cnx;
+  --server_.connectionCount_;
+}
+
+
+void EventLoop::run() {
+  const int MaxEvents = 256;
+  struct epoll_event events[MaxEvents];
+
+  while (true) {
+    // while draining, the loop must wake up when the deadline expires
+    int timeout = -1;
+    if (server_.stopping_) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>
+      (server_.deadline_ - std::chrono::steady_clock::now()).count();
+      if (left > 0) timeout = int(std::min<long long>(left + 1, 60000));
+    }
+
+    int count = ::epoll_wait(epfd_, events, MaxEvents, timeout);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      server_.error("epoll_wait failed");
+      return;
+    }
+    bool wakeup = false;
+    for (int k = 0; k < count; ++k) {
+      if (events[k].data.ptr) onEvent(static_cast<EventCnx*>(events[k].data.ptr), events[k].events);
+      else wakeup = true;
+    }
+    // completions are handled last because they may delete connections that
+    // are referenced by the events above
+    if (wakeup) onCompleted();
+
+    if (server_.stopping_ && drain()) return;
+  }
+}
+
+
+// closes the connections that have no request in progress (all of them once the deadline
+// has expired). Returns true when all the connections are closed and no worker uses them.
+bool EventLoop::drain() {
+  bool expired = std::chrono::steady_clock::now() >= server_.deadline_;
+  std::vector<EventCnx*> closing;
+  {
+    lock_guard<mutex> lock(mutex_);
+    for (auto* cnx : connections_) {
+      if (cnx->closed_) continue;   // deleted when its worker completes
+      bool busy = cnx->state_ != EventCnx::Idle || cnx->outpos_ < cnx->output_.size()
+      || cnx->transfer_.active();
+      if (!busy || expired) closing.push_back(cnx);
+    }
+  }
+  for (auto* cnx : closing) close(cnx);
+
+  // no connection can be added once the loop has stopped
+  lock_guard<mutex> lock(mutex_);
+  stopped_ = connections_.empty();
+  return stopped_;
+}
 
+
+void EventLoop::onEvent(EventCnx* cnx, uint32_t events) {
+  if (events & EPOLLERR) {
+    server_.error("Read error");
+    close(cnx);
+    return;
+  }
+
+  if (events & EPOLLOUT) {
+    bool transferring = cnx->state_ == EventCnx::Idle && cnx->transfer_.active();
+    if (!flush(cnx)) {
+      close(cnx);
+      return;
+    }
+    // the client has read enough data: resume reading its requests
+    if (cnx->stalled_ && cnx->output_.size() - cnx->outpos_ <= MaxPendingOutput) {
+      cnx->stalled_ = false;
+      events |= EPOLLIN;
+    }
+    // a file was sent: the next requests may already have been received
+    if (transferring && !cnx->transfer_.active()) events |= EPOLLIN;
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+    if (!processRequests(cnx)) {
+      close(cnx);
+      return;
+    }
+  }
+  updateDeadline(cnx);
+}
+
+
+// the deadline of a connection depends on what it is waiting for
+void EventLoop::updateDeadline(EventCnx* cnx) {
+  TCPServer::Deadline deadline = TCPServer::IdleDeadline;
+  if (cnx->state_ != EventCnx::Idle) deadline = TCPServer::NoDeadline;   // being processed
+  else if (cnx->outpos_ < cnx->output_.size() || cnx->transfer_.active()) {
+    deadline = TCPServer::WriteDeadline;
+  }
+  else if (cnx->sockbuf_->hasPendingInput()) deadline = TCPServer::ReadDeadline;
+  server_.setDeadline(cnx->timer_, deadline);
+}
+
+
+// processes all the requests that can be read without blocking.
+// returns false if the connection must be closed.
+bool EventLoop::processRequests(EventCnx* cnx) {
+  // no new requests are read while the server is stopping
+  if (server_.stopping_) return flush(cnx);
+
+  while (!cnx->stalled_ && cnx->state_ == EventCnx::Idle) {
+    // the file requested by FETCH must be sent before processing the next requests
+    if (cnx->transfer_.active()) {
+      if (!flush(cnx)) return false;
+      if (cnx->transfer_.active()) return true;   // EPOLLOUT will tell when to go on
+    }
+
+    // reads all the requests that can be read without blocking, they will be processed
+    // in order and their responses sent together
+    SOCKSIZE received = 0;
+    std::string request;
+    bool fetch = false;
+    // reading stops at a framing request as the next requests will be frames
+    // and at a FETCH request (see above)
+    while (!cnx->upgrade_ && !fetch && cnx->requests_.size() < TCPServer::MaxBatch
+           && (received = readRequest(cnx->sockbuf_, cnx->binary_, request, false)) > 0) {
+      if (isBinaryFramingRequest(cnx->binary_, request)) cnx->upgrade_ = true;
+      else {
+        fetch = isFetchRequest(server_, request);
+        cnx->requests_.push_back(std::move(request));
+      }
+    }
+
+    if (cnx->requests_.empty() && !cnx->upgrade_) {
+      if (received == Socket::WouldBlock) break;
+
+      if (received < 0) {
+        server_.error("Read error");
+        return false;
+      }
+
+      if (received == 0) {
+        server_.error("Connection closed by client");
+        flush(cnx);   // the client may still read the previous responses
+        return false;
+      }
+    }
+
+    if (!execute(cnx)) return false;
+    // EPOLLIN will tell if more requests arrive
+    if (received == Socket::WouldBlock) break;
+  }
+  return flush(cnx);
+}
+
+
+// processes the requests of cnx, by the worker pool if there is one.
+// returns false if the connection must be closed.
+bool EventLoop::execute(EventCnx* cnx) {
+  auto* pool = server_.pool_;
+  if (!pool) {
+    cnx->keep_ = server_.processRequests(cnx->requests_, cnx->responses_, !cnx->binary_,
+                                         &cnx->transfer_);
+    return respond(cnx);
+  }
+
+  bool submitted = pool->trySubmit([this, cnx]{
+    cnx->keep_ = server_.processRequests(cnx->requests_, cnx->responses_, !cnx->binary_,
+                                         &cnx->transfer_);
+    complete(cnx);
+  });
+
+  if (submitted) cnx->state_ = EventCnx::Running;
+  else {
+    // the pool is full: no more requests are read from this client (which will be
+    // blocked by TCP flow control) until a request completes and frees room in the pool
+    cnx->state_ = EventCnx::Queued;
+    backlog_.push_back(cnx);
+  }
+  return true;
+}
+
+
+// queues the responses of the requests of cnx.
+// returns false if the connection must be closed.
+bool EventLoop::respond(EventCnx* cnx) {
+  cnx->state_ = EventCnx::Idle;
+
+  // a response is always sent to the client (otherwise it might block)
+  for (auto& response : cnx->responses_) {
+    if (cnx->binary_) {
+      char header[SocketBuffer::FrameHeaderSize];
+      SocketBuffer::encodeFrameHeader(header, response.size(), TCPServer::ResponseFrame);
+      cnx->output_.append(header, sizeof(header));
+      cnx->output_ += response;
+    }
+    else {
+      cnx->output_ += response;
+      cnx->output_ += '\n';
+    }
+  }
+  cnx->requests_.clear();
+  cnx->responses_.clear();
+
+  // the content of the file follows its response (as a frame in binary mode), see flush()
+  if (cnx->transfer_.active() && cnx->binary_) {
+    char header[SocketBuffer::FrameHeaderSize];
+    SocketBuffer::encodeFrameHeader(header, cnx->transfer_.remaining_, TCPServer::FileFrame);
+    cnx->output_.append(header, sizeof(header));
+  }
+
+  // closes the connection with this client if the callback returned false
+  if (!cnx->keep_) {
+    server_.error("Closing connection with client");
+    flush(cnx);
+    return false;
+  }
+
+  if (cnx->upgrade_) {
+    cnx->output_ += "OK\n";
+    cnx->binary_ = true;
+    cnx->upgrade_ = false;
+  }
+
+  if (cnx->output_.size() - cnx->outpos_ > MaxPendingOutput) {
+    if (!flush(cnx)) return false;
+    // the client does not read its responses: stop reading its requests
+    if (cnx->output_.size() - cnx->outpos_ > MaxPendingOutput) cnx->stalled_ = true;
+  }
+  return true;
+}
+
+
+// called by a worker when the request of cnx has been processed.
+void EventLoop::complete(EventCnx* cnx) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    completed_.push_back(cnx);
+  }
+  uint64_t one = 1;
+  if (::write(wakefd_, &one, sizeof(one)) < 0) {}   // fails only if the counter overflows
+}
+
+
+// sends the responses of the requests completed by workers, then resumes the connections
+// that were waiting for room in the pool.
+void EventLoop::onCompleted() {
+  uint64_t count;
+  if (::read(wakefd_, &count, sizeof(count)) < 0) {}
+
+  std::vector<EventCnx*> completed;
+  {
+    lock_guard<mutex> lock(mutex_);
+    completed.swap(completed_);
+  }
+
+  for (auto* cnx : completed) {
+    if (cnx->closed_) destroy(cnx);
+    // requests that arrived meanwhile have not been read yet
+    else if (!respond(cnx) || !processRequests(cnx)) close(cnx);
+    else updateDeadline(cnx);
+  }
+
+  std::vector<EventCnx*> backlog;
+  backlog.swap(backlog_);
+  for (auto* cnx : backlog) {
+    if (!execute(cnx) || (cnx->state_ == EventCnx::Idle && !processRequests(cnx))) close(cnx);
+    else updateDeadline(cnx);
+  }
+}
+
+
+// sends pending responses until the socket would block.
+// returns false if the connection must be closed.
+bool EventLoop::flush(EventCnx* cnx) {
+  while (cnx->outpos_ < cnx->output_.size()) {
+    auto sent = cnx->sock_->send(cnx->output_.data() + cnx->outpos_,
+                                 cnx->output_.size() - cnx->outpos_);
+    if (sent < 0 && Socket::wouldBlock()) return true;   // EPOLLOUT will tell when to go on
     if (sent < 0) {
       server_.error("Write error");
-      break;
+      return false;
     }
-
     if (sent == 0) {
       server_.error("Connection closed by client");
-      break;
+      return false;
     }
+    cnx->outpos_ += sent;
   }
+  cnx->output_.clear();
+  cnx->outpos_ = 0;
+
+  // then the file requested by FETCH, if any (once its response has been queued:
+  // a worker may be opening it)
+  if (cnx->state_ == EventCnx::Idle && cnx->transfer_.active()
+      && !sendFile(cnx->sock_, cnx->transfer_)) {
+    server_.error("Write error");
+    return false;
+  }
+  return true;
+}
 
-  // free resources and kills thread
-  delete this;
+
+void EventLoop::close(EventCnx* cnx) {
+  ::epoll_ctl(epfd_, EPOLL_CTL_DEL, cnx->sock_->descriptor(), nullptr);
+
+  if (cnx->state_ == EventCnx::Running) {
+    cnx->closed_ = true;    // a worker still uses it
+    return;
+  }
+  if (cnx->state_ == EventCnx::Queued) {
+    backlog_.erase(std::remove(backlog_.begin(), backlog_.end(), cnx), backlog_.end());
+  }
+  destroy(cnx);
 }
 
+#endif
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-TCPServer::TCPServer(Callback const& callback) :
-callback_(callback) {
+TCPServer::TCPServer(Callback const& callback, Mode mode, unsigned loopCount) :
+callback_(callback),
+mode_(mode),
+loopCount_(loopCount) {
   // signal(SIGPIPE, SIG_IGN);  // ignore nasty SIGPIPEs
+#if !defined(__linux__)
+  mode_ = ThreadPerClient;    // epoll is only available on Linux
+#endif
+  if (loopCount_ == 0) loopCount_ = std::max(1u, std::thread::hardware_concurrency());
 }
 
-TCPServer::~TCPServer() {}
+TCPServer::~TCPServer() {
+  if (!stopRequested_) stop(0);
+  for (auto* s : shardSockets_) delete s;
+#if defined(__linux__)
+  for (auto* l : loops_) delete l;
+#endif
+  delete timers_;
+  delete pool_;
+}
+
+
+void TCPServer::setMaxConnections(size_t count) {
+  maxConnections_ = count;
+}
+
+
+void TCPServer::setMaxInFlight(size_t count) {
+  maxInFlight_ = count;
+}
+
+
+void TCPServer::setIdleTimeout(int timeout) {
+  idleTimeout_ = timeout;
+}
+
+
+void TCPServer::setReadTimeout(int timeout) {
+  readTimeout_ = timeout;
+}
+
+
+void TCPServer::setWriteTimeout(int timeout) {
+  writeTimeout_ = timeout;
+}
+
+
+static int64_t milliseconds() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+
+int TCPServer::timeoutOf(Deadline deadline) const {
+  if (deadline == IdleDeadline) return idleTimeout_;
+  if (deadline == ReadDeadline) return readTimeout_;
+  if (deadline == WriteDeadline) return writeTimeout_;
+  return 0;
+}
+
+
+// the timer of a connection shuts its socket down, which wakes up its thread or its event loop.
+// The deadline may have been postponed or removed since the timer was scheduled: the timer is
+// then rescheduled (or not) according to the current deadline
+void TCPServer::initDeadline(ConnectionTimer& cnxTimer, Socket* socket) {
+  if (!timers_) return;
+  cnxTimer.timer.setCallback([this, &cnxTimer, socket] {
+    int64_t now = milliseconds(), expires = cnxTimer.expires;
+    while (true) {
+      uint64_t deadline = cnxTimer.deadline;
+      int timeout = timeoutOf(Deadline(deadline & 3));
+      int64_t passes = int64_t(deadline >> 2) + timeout;
+      int64_t next = timeout > 0 && passes > now ? passes : 0;
+      // fails if setDeadline() has just scheduled the timer for an earlier deadline.
+      // setDeadline() sets the deadline before reading expires: if the deadline has not changed
+      // when expires is set, it will see the new value
+      if (!cnxTimer.expires.compare_exchange_strong(expires, next)) continue;
+      if (cnxTimer.deadline != deadline) {
+        expires = next;
+        continue;
+      }
+      if (next > 0) return std::chrono::milliseconds(next - now);
+      if (timeout > 0) {
+        error("Connection timed out");
+#if !defined(_WIN32) && !defined(_WIN64)
+        // the responses that a slow client did not read are discarded (the connection is reset)
+        if (Deadline(deadline & 3) == WriteDeadline) socket->setSoLinger(true, 0);
+#endif
+        socket->shutdownInput();
+        socket->shutdownOutput();
+      }
+      return std::chrono::milliseconds(0);
+    }
+  });
+}
+
+
+// sets the deadline of a connection, unless it is already the same read or write deadline
+// (these count from the start of the operation, idle deadlines from the last activity).
+// This is called for every request: the wheel is only locked if the timer is not pending or
+// would expire after the new deadline, otherwise the timer will find the new deadline
+void TCPServer::setDeadline(ConnectionTimer& cnxTimer, Deadline deadline) {
+  if (!timers_) return;
+  if (deadline == Deadline(cnxTimer.deadline & 3) && deadline != IdleDeadline) return;
+  int64_t now = milliseconds();
+  cnxTimer.deadline = uint64_t(now) << 2 | deadline;
+
+  int timeout = timeoutOf(deadline);
+  if (timeout <= 0) return;
+  int64_t passes = now + timeout, expires = cnxTimer.expires;
+  while (expires == 0 || expires > passes) {
+    if (cnxTimer.expires.compare_exchange_weak(expires, passes)) {
+      timers_->schedule(cnxTimer.timer, std::chrono::milliseconds(timeout));
+      break;
+    }
+  }
+}
+
+
+// when this function returns, the timer of the connection is not running and won't be called
+void TCPServer::cancelDeadline(ConnectionTimer& cnxTimer) {
+  if (!timers_) return;
+  cnxTimer.deadline = NoDeadline;
+  timers_->cancel(cnxTimer.timer);
+  cnxTimer.expires = 0;
+}
+
+
+void TCPServer::setWorkerCount(unsigned count) {
+  workerCount_ = count;
+}
+
+
+void TCPServer::setMaxQueuedRequests(size_t count) {
+  maxQueued_ = count;
+}
+
+
+bool TCPServer::processRequest(std::string const& request, std::string& response) {
+  if (!callback_) {
+    response = "OK";
+    return true;
+  }
+  return callback_(request, response);
+}
 
-int TCPServer::run(int port) {
+
+// processes pipelined requests in order, stops at the first one whose callback returns false
+// (this one has no response). In line mode, each response must remain a single line.
+// A FETCH request can only be the last one, its file is then opened in _transfer_.
+bool TCPServer::processRequests(std::vector<std::string> const& requests,
+                                std::vector<std::string>& responses, bool lines,
+                                FileTransfer* transfer) {
+  for (auto& request : requests) {
+    responses.emplace_back();
+
+    // too many requests are being processed: this one is rejected right away
+    if (maxInFlight_ > 0 && inFlight_.fetch_add(1) >= maxInFlight_) {
+      --inFlight_;
+      responses.back() = BusyResponse;
+      continue;
+    }
+    bool keep = true;
+    if (transfer && isFetchRequest(*this, request)) {
+      openFile(request, responses.back(), *transfer);
+    }
+    else keep = processRequest(request, responses.back());
+    if (maxInFlight_ > 0) --inFlight_;
+
+    if (!keep) {
+      responses.pop_back();
+      return false;
+    }
+    if (lines) {
+      auto& r = responses.back();
+      std::replace_if(r.begin(), r.end(), [](char c){return c == '\n' || c == '\r';}, ' ');
+    }
+  }
+  return true;
+}
+
+int TCPServer::run(int port, unsigned shards) {
+#if !defined(SO_REUSEPORT) || defined(_WIN32) || defined(_WIN64)
+  shards = 1;
+#endif
+  shards = std::max(1u, shards);
+
+  // all the sockets are bound before accepting connections so that errors are reported here.
+  // SO_REUSEADDR: the server can be restarted while the connections it closed (see stop())
+  // are in the TIME_WAIT state
+#if !defined(_WIN32) && !defined(_WIN64)
+  servsock_.setReuseAddress(true);
+#endif
+  if (shards > 1 && servsock_.setReusePort(true) < 0) shards = 1;
   int status = servsock_.bind(port);  // lier le ServerSocket a ce port
 
+  for (unsigned k = 1; status >= 0 && k < shards; ++k) {
+    auto* servsock = new ServerSocket();
+    shardSockets_.push_back(servsock);
+    servsock->setReuseAddress(true);
+    if (servsock->setReusePort(true) < 0) status = Socket::Failed;
+    else status = servsock->bind(port);
+  }
+
   if (status < 0) {
     error("Can't bind on port: " + to_string(port));
     return status;   // returns negative value, see Socket::bind()
   }
 
-  while (true) {
-    if (auto* socket = servsock_.accept()) {
+  if (!localPath_.empty() && (status = localsock_.bind(localPath_)) < 0) {
+    error("Can't bind on path: " + localPath_);
+    return status;
+  }
+
+  if (workerCount_ > 0 && !pool_) pool_ = new WorkerPool(workerCount_, maxQueued_);
+  if ((idleTimeout_ > 0 || readTimeout_ > 0 || writeTimeout_ > 0) && !timers_) {
+    timers_ = new TimerWheel(std::chrono::milliseconds(TimerTick));
+  }
+
+  // each shard runs on its own core with its own event loops
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  size_t loopsPerShard = std::max(1u, loopCount_ / shards);
+  auto shardCore = [&](unsigned shard) {return shards > 1 ? int(shard % cores) : -1;};
+
+#if defined(__linux__)
+  if (mode_ == EventDriven && loops_.empty()) {
+    for (unsigned k = 0; k < shards * loopsPerShard; ++k) {
+      loops_.push_back(new EventLoop(*this, shardCore(unsigned(k / loopsPerShard))));
+    }
+  }
+#endif
+
+  // Local connections are distributed between all the loops
+  std::vector<std::thread> acceptors;
+  if (!localPath_.empty()) {
+    acceptors.emplace_back([this]{acceptConnections(localsock_, 0, loops_.size());});
+  }
+  if (shards == 1) {
+    acceptConnections(servsock_, 0, loops_.size());
+  }
+  else {
+    // shard 0 also has its own thread: the affinity of the thread that called run() is kept
+    for (unsigned k = 0; k < shards; ++k) {
+      acceptors.emplace_back([this, k, shardCore, loopsPerShard] {
+        pinThread(shardCore(k));
+        acceptConnections(k == 0 ? servsock_ : *shardSockets_[k - 1], k * loopsPerShard, loopsPerShard);
+      });
+    }
+  }
+
+  for (auto& t : acceptors) t.join();
+  return 0;  // means OK (stopped by stop())
+}
+
+
+// the server stops accepting connections, then waits for the current requests
+bool TCPServer::stop(int timeout) {
+  if (stopRequested_.exchange(true)) return false;   // already stopped (or stopping)
+  // only the first call sets the deadline, which is read by the loops once stopping_ is set
+  deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  stopping_ = true;
+
+  // accept() returns nullptr and run() returns
+  servsock_.shutdown();
+  localsock_.shutdown();
+  for (auto* s : shardSockets_) s->shutdown();
+
+  bool drained = true;
+#if defined(__linux__)
+  for (auto* loop : loops_) loop->stop();
+  drained = std::chrono::steady_clock::now() < deadline_;
+#endif
+
+  {
+    unique_lock<mutex> lock(cnxMutex_);
+    // idle connections are woken up (reading returns 0), the others stop
+    // once their current requests have been processed
+    for (auto* cnx : connections_) cnx->sock_->shutdownInput();
+
+    if (!cnxReleased_.wait_until(lock, deadline_, [this]{return connections_.empty();})) {
+      // responses can't be sent anymore, then the threads terminate once their callbacks return
+      drained = false;
+      for (auto* cnx : connections_) cnx->sock_->shutdownOutput();
+      cnxReleased_.wait(lock, [this]{return connections_.empty();});
+    }
+  }
+  reapConnections();
+  return drained;
+}
+
+
+// called by the thread of a connection when it terminates.
+void TCPServer::release(SocketCnx* cnx) {
+  {
+    lock_guard<mutex> lock(cnxMutex_);
+    connections_.erase(cnx);
+    finished_.push_back(cnx);
+  }
+  cnxReleased_.notify_all();
+}
+
+
+// joins the threads of the connections that have terminated and frees their resources.
+void TCPServer::reapConnections() {
+  std::vector<SocketCnx*> finished;
+  {
+    lock_guard<mutex> lock(cnxMutex_);
+    finished.swap(finished_);
+  }
+  for (auto* cnx : finished) {
+    cnx->thread_.join();
+    delete cnx;
+    --connectionCount_;
+  }
+}
+
+
+// admission control: returns false if the connection must be rejected.
+bool TCPServer::admit(Socket* socket) {
+  if (stopping_) return false;
+  if (maxConnections_ > 0 && connectionCount_ >= maxConnections_) {
+    // this client is told to retry later (without waiting if it does not read)
+    std::string busy = std::string(BusyResponse) + "\n";
+#if defined(MSG_DONTWAIT)
+    socket->send(busy.data(), busy.size(), MSG_DONTWAIT);
+#else
+    socket->send(busy.data(), busy.size());
+#endif
+    return false;
+  }
+  ++connectionCount_;
+  return true;
+}
+
+
+// accepts connections on _servsock_, in EventDriven mode they are distributed between
+// the _loopCount_ loops that start at _firstLoop_.
+void TCPServer::acceptConnections(ServerSocket& servsock, size_t firstLoop, size_t loopCount) {
+  size_t nextLoop = 0;
+
+  while (!stopping_) {
+    auto* socket = servsock.accept();
+    reapConnections();
+
+    if (!socket) {
+      if (!stopping_) error("input connection failed");
+    }
+    else if (!admit(socket)) {
+      delete socket;
+    }
+#if defined(__linux__)
+    else if (mode_ == EventDriven) {
+      // les connexions sont reparties entre les boucles d'evenements
+      // (the socket is deleted by add() if it fails)
+      auto* loop = loops_[firstLoop + nextLoop++ % loopCount];
+      if (!loop->add(socket)) error("Could not watch connection");
+    }
+#endif
+    else {
       // lance la lecture des messages de ce socket dans un thread
       new SocketCnx(*this, socket);
     }
-    else error("input connection failed");
   }
-  return 0;  // means OK
+}
+
+
+void TCPServer::setLocalPath(std::string const& path) {
+  localPath_ = path;
+}
+
+
+void TCPServer::setFileResolver(FileResolver const& resolver) {
+  fileResolver_ = resolver;
+#if !defined(_WIN32) && !defined(_WIN64)
+  // unlike send(), sendfile() can't disable SIGPIPE when a client goes away during a transfer
+  if (resolver) ::signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+
+// FETCH name [offset length]: opens the range of the file that must be sent
+void TCPServer::openFile(std::string const& request, std::string& response, FileTransfer& transfer) {
+  std::stringstream ss(request);
+  std::string command, name, path;
+  long long offset = 0, length = 0;
+  ss >> command >> name;
+  if (!(ss >> offset)) offset = 0;
+  if (!(ss >> length)) length = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+  response = "ERROR FETCH is not supported";
+#else
+  if (name.empty() || !fileResolver_(name, path)) {
+    response = "ERROR Unknown object: " + name;
+    return;
+  }
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) < 0) {
+    if (fd >= 0) ::close(fd);
+    response = "ERROR Cannot open: " + path;
+    return;
+  }
+
+  long long size = st.st_size;
+  if (offset < 0 || offset > size || length < 0) {
+    ::close(fd);
+    response = "ERROR Invalid range";
+    return;
+  }
+  // a null length means: up to the end of the file; the length of a FileFrame has 32 bits
+  if (length == 0 || length > size - offset) length = size - offset;
+  if (length > 0xFFFFFFFFLL) length = 0xFFFFFFFFLL;
+
+  transfer.close();
+  transfer.fd_ = fd;
+  transfer.offset_ = offset;
+  transfer.remaining_ = size_t(length);
+  if (length == 0) transfer.close();   // nothing to send but the (binary) header
+
+  response = "OK " + std::to_string(offset) + " " + std::to_string(length) + " " + std::to_string(size);
+#endif
 }
 
 
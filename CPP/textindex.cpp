@@ -0,0 +1,462 @@
+//
+//  textindex: inverted index of the words of names and file paths.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <tuple>
+#include "textindex.h"
+using namespace std;
+
+struct TextIndex::Document {
+  std::string_view name;
+  std::atomic<uint64_t> removedAt{0};   // version that removed the document (0 if none)
+};
+
+
+// documents by id, stored in segments of increasing size that are never moved,
+// so that readers don't need a lock while writers add documents
+struct TextIndex::Documents {
+  static constexpr unsigned Segments = 32;
+  static constexpr uint32_t FirstSegment = 1024;
+
+  std::atomic<Document*> segments[Segments]{};
+  uint32_t count{};                     // used by writers only
+
+  ~Documents() {
+    for (auto& s : segments) delete[] s.load();
+  }
+
+  // segment k contains FirstSegment << k documents
+  static void locate(uint32_t id, unsigned& segment, uint32_t& offset) {
+    uint64_t n = uint64_t(id) / FirstSegment + 1;
+    segment = unsigned(std::bit_width(n)) - 1;
+    offset = uint32_t(id - FirstSegment * ((uint64_t(1) << segment) - 1));
+  }
+
+  Document& operator[](uint32_t id) const {
+    unsigned s; uint32_t offset;
+    locate(id, s, offset);
+    return segments[s].load(std::memory_order_acquire)[offset];
+  }
+
+  uint32_t append(std::string_view name) {
+    unsigned s; uint32_t offset;
+    locate(count, s, offset);
+    if (!segments[s].load()) segments[s].store(new Document[FirstSegment << s], std::memory_order_release);
+    segments[s].load()[offset].name = name;
+    return count++;
+  }
+};
+
+
+// ids of a posting list: the first one, then varint deltas
+struct TextIndex::Block {
+  static constexpr uint32_t MaxIds = 128;
+  static constexpr size_t MaxBytes = 512;
+
+  uint32_t first{}, last{};
+  uint32_t count{};                     // final once _next_ is set
+  size_t size{}, capacity{};            // in bytes
+  std::unique_ptr<uint8_t[]> bytes;
+  std::atomic<Block*> next{nullptr};
+};
+
+
+// ids of the documents that contain a term, only appended to
+struct TextIndex::Postings {
+  Block* head{};
+  Block* tail{};
+  std::atomic<size_t> bytes{0};
+
+  ~Postings() {
+    for (Block* b = head; b; ) {
+      Block* next = b->next.load();
+      delete b;
+      b = next;
+    }
+  }
+
+  void append(uint32_t id) {
+    uint8_t varint[5];
+    size_t length = 0;
+    if (tail && tail->count < Block::MaxIds) {
+      for (uint32_t delta = id - tail->last; ; delta >>= 7) {
+        varint[length++] = uint8_t(delta & 0x7f) | (delta >= 0x80 ? 0x80 : 0);
+        if (delta < 0x80) break;
+      }
+    }
+    if (length > 0 && tail->size + length <= tail->capacity) {
+      std::copy(varint, varint + length, tail->bytes.get() + tail->size);
+      tail->size += length;
+      tail->last = id;
+      ++tail->count;
+      return;
+    }
+
+    // new block, bigger than the previous one so that short lists stay small
+    Block* b = new Block;
+    b->first = b->last = id;
+    b->count = 1;
+    b->capacity = tail ? std::min(tail->capacity * 2, Block::MaxBytes) : 8;
+    b->bytes.reset(new uint8_t[b->capacity]);
+    bytes += sizeof(Block) + b->capacity;
+    if (tail) tail->next.store(b, std::memory_order_release);
+    else head = b;
+    tail = b;
+  }
+};
+
+
+struct TextIndex::Term {
+  std::string text;
+  uint64_t hash{};
+  std::shared_ptr<Postings> postings;
+  uint32_t count{};                     // ids of _postings_ that belong to the version
+};
+
+
+// node of the hash trie: a leaf holds the terms that have the same hash,
+// other nodes have a child for each 5 bits of the hashes that are present (bitmap)
+struct TextIndex::Node {
+  uint32_t bitmap{};
+  std::vector<NodePtr> children;
+  std::vector<Term> terms;
+  bool leaf() const { return !terms.empty(); }
+};
+
+
+// reads the ids of a posting list that belong to a version
+class TextIndex::Cursor {
+public:
+  explicit Cursor(Term const& term) : block_(term.postings->head), remaining_(term.count) {}
+
+  uint32_t value() const { return value_; }
+  uint32_t size() const { return remaining_; }
+
+  // goes to the next id
+  bool next() {
+    if (remaining_ == 0) return false;
+    // the count of a block can only be read once the next block exists
+    Block* n = block_->next.load(std::memory_order_acquire);
+    if (n && index_ == block_->count) {
+      block_ = n;
+      index_ = 0;
+      pos_ = 0;
+    }
+    if (index_ == 0) value_ = block_->first;
+    else {
+      uint32_t delta = 0;
+      for (unsigned shift = 0; ; shift += 7) {
+        uint8_t byte = block_->bytes[pos_++];
+        delta |= uint32_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+      }
+      value_ += delta;
+    }
+    ++index_;
+    --remaining_;
+    return true;
+  }
+
+  // goes to the first id >= target (stays on the current one if it is not smaller)
+  bool seek(uint32_t target) {
+    if (index_ > 0 && value_ >= target) return true;
+    // the blocks that end before _target_ are skipped without being decoded
+    for (Block* n; (n = block_->next.load(std::memory_order_acquire)) && n->first <= target; ) {
+      uint32_t skipped = block_->count - index_;
+      if (skipped >= remaining_) return false;
+      remaining_ -= skipped;
+      block_ = n;
+      index_ = 0;
+      pos_ = 0;
+    }
+    while (next()) if (value_ >= target) return true;
+    return false;
+  }
+
+private:
+  Block const* block_;
+  uint32_t remaining_;                  // ids of the version that were not read yet
+  uint32_t index_{};                    // ids read in the current block
+  size_t pos_{};
+  uint32_t value_{};
+};
+
+
+TextIndex::TextIndex() : documents_(std::make_shared<Documents>()) {}
+
+
+std::vector<std::string> TextIndex::tokenize(std::string_view text) {
+  std::vector<std::string> terms;
+  std::string term;
+  for (size_t k = 0; k <= text.size(); ++k) {
+    unsigned char c = k < text.size() ? text[k] : ' ';
+    // bytes of multibyte (UTF-8) characters are kept in the terms
+    if (std::isalnum(c) || c >= 0x80) term += char(std::tolower(c));
+    else if (!term.empty()) {
+      terms.push_back(std::move(term));
+      term.clear();
+    }
+  }
+  std::sort(terms.begin(), terms.end());
+  terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+  return terms;
+}
+
+
+TextIndex::Term const* TextIndex::lookup(Node const* node, std::string_view text, uint64_t hash) {
+  for (unsigned shift = 0; node; shift += 5) {
+    if (node->leaf()) {
+      for (auto& t : node->terms) if (t.hash == hash && t.text == text) return &t;
+      return nullptr;
+    }
+    uint32_t bit = uint32_t(1) << ((hash >> shift) & 31);
+    if (!(node->bitmap & bit)) return nullptr;
+    node = node->children[std::popcount(node->bitmap & (bit - 1))].get();
+  }
+  return nullptr;
+}
+
+
+// returns a copy of _node_ (at depth shift / 5) where _term_ is added or replaced
+TextIndex::NodePtr TextIndex::assign(NodePtr const& node, unsigned shift, Term const& term) {
+  if (!node) {
+    auto leaf = std::make_shared<Node>();
+    leaf->terms.push_back(term);
+    return leaf;
+  }
+
+  if (node->leaf()) {
+    if (node->terms[0].hash == term.hash) {
+      auto copy = std::make_shared<Node>(*node);
+      auto it = std::find_if(copy->terms.begin(), copy->terms.end(),
+                             [&](Term const& t) {return t.text == term.text;});
+      if (it != copy->terms.end()) *it = term;
+      else copy->terms.push_back(term);
+      return copy;
+    }
+    // the hashes differ: the leaf is moved one level down
+    auto inner = std::make_shared<Node>();
+    inner->bitmap = uint32_t(1) << ((node->terms[0].hash >> shift) & 31);
+    inner->children.push_back(node);
+    return assign(inner, shift, term);
+  }
+
+  uint32_t bit = uint32_t(1) << ((term.hash >> shift) & 31);
+  size_t pos = std::popcount(node->bitmap & (bit - 1));
+  auto copy = std::make_shared<Node>(*node);
+  if (node->bitmap & bit) {
+    copy->children[pos] = assign(node->children[pos], shift + 5, term);
+  }
+  else {
+    copy->bitmap |= bit;
+    copy->children.insert(copy->children.begin() + pos, assign(nullptr, shift + 5, term));
+  }
+  return copy;
+}
+
+
+// same as assign() for the terms [first, last), which are sorted by the 5-bit chunks of their
+// hashes, lowest chunk first (the terms that go below the same child are contiguous at every
+// level): each node is copied once
+TextIndex::NodePtr TextIndex::assign(NodePtr const& node, unsigned shift, Term const* first, Term const* last) {
+  // a single term, or terms that have the same hash (they go to the same leaf)
+  if (first->hash == (last - 1)->hash) {
+    NodePtr result = node;
+    for (; first != last; ++first) result = assign(result, shift, *first);
+    return result;
+  }
+
+  std::shared_ptr<Node> copy;
+  if (!node) copy = std::make_shared<Node>();
+  else if (node->leaf()) {
+    // the leaf is moved one level down
+    copy = std::make_shared<Node>();
+    copy->bitmap = uint32_t(1) << ((node->terms[0].hash >> shift) & 31);
+    copy->children.push_back(node);
+  }
+  else copy = std::make_shared<Node>(*node);
+
+  while (first != last) {
+    uint64_t chunk = (first->hash >> shift) & 31;
+    Term const* end = std::find_if(first, last, [&](Term const& t) {return ((t.hash >> shift) & 31) != chunk;});
+    uint32_t bit = uint32_t(1) << chunk;
+    size_t pos = std::popcount(copy->bitmap & (bit - 1));
+    if (copy->bitmap & bit) copy->children[pos] = assign(copy->children[pos], shift + 5, first, end);
+    else {
+      copy->bitmap |= bit;
+      copy->children.insert(copy->children.begin() + pos, assign(nullptr, shift + 5, first, end));
+    }
+    first = end;
+  }
+  return copy;
+}
+
+
+void TextIndex::visit(Node const& node, std::function<void(Term const&)> const& f) {
+  for (auto& t : node.terms) f(t);
+  for (auto& child : node.children) visit(*child, f);
+}
+
+
+bool TextIndex::visible(uint32_t id) const {
+  uint64_t removedAt = (*documents_)[id].removedAt.load();
+  return removedAt == 0 || removedAt > version_;
+}
+
+
+TextIndex TextIndex::add(std::string_view name, std::string_view text, uint32_t& id) const {
+  TextIndex next(*this);
+  ++next.version_;
+  id = documents_->append(name);
+  ++next.documentCount_;
+
+  for (auto& word : tokenize(text)) {
+    uint64_t hash = std::hash<std::string>()(word);
+    Term const* found = lookup(next.terms_.get(), word, hash);
+    Term term;
+    if (found) term = *found;
+    else {
+      term = Term{word, hash, std::make_shared<Postings>(), 0};
+      ++next.termCount_;
+    }
+    // the ids that follow _count_ belong to no version (the list is only appended by the latest)
+    term.postings->append(id);
+    ++term.count;
+    ++next.postings_;
+    next.terms_ = assign(next.terms_, 0, term);
+  }
+  return next;
+}
+
+
+TextIndex TextIndex::add(std::span<const std::string_view> names, std::span<const std::string> texts,
+                         uint32_t& first) const {
+  TextIndex next(*this);
+  ++next.version_;
+  first = documents_->count;
+
+  // occurrences of the terms, sorted by the 5-bit chunks of their hashes, lowest chunk first
+  // (the order of assign()), then by term and id
+  struct Occurrence {
+    uint64_t key, hash;
+    std::string word;
+    uint32_t id;
+  };
+  std::vector<Occurrence> occurrences;
+  for (size_t k = 0; k < names.size(); ++k) {
+    uint32_t id = documents_->append(names[k]);
+    ++next.documentCount_;
+    for (auto& word : tokenize(texts[k])) {
+      uint64_t hash = std::hash<std::string>()(word), key = 0;
+      for (unsigned shift = 0; shift < 60; shift += 5) key = (key << 5) | ((hash >> shift) & 31);
+      occurrences.push_back({(key << 4) | (hash >> 60), hash, std::move(word), id});
+    }
+  }
+  if (occurrences.empty()) return next;
+  std::sort(occurrences.begin(), occurrences.end(), [](Occurrence const& a, Occurrence const& b) {
+    return std::tie(a.key, a.word, a.id) < std::tie(b.key, b.word, b.id);
+  });
+
+  // each term is looked up once, then the trie is updated once
+  std::vector<Term> updated;
+  for (auto o = occurrences.begin(); o != occurrences.end(); ) {
+    auto end = std::find_if(o, occurrences.end(), [&](Occurrence const& x) {return x.word != o->word;});
+    if (Term const* found = lookup(next.terms_.get(), o->word, o->hash)) updated.push_back(*found);
+    else {
+      updated.push_back(Term{std::move(o->word), o->hash, std::make_shared<Postings>(), 0});
+      ++next.termCount_;
+    }
+    Term& term = updated.back();
+    term.count += uint32_t(end - o);
+    next.postings_ += size_t(end - o);
+    for (; o != end; ++o) term.postings->append(o->id);
+  }
+  next.terms_ = assign(next.terms_, 0, updated.data(), updated.data() + updated.size());
+  return next;
+}
+
+
+TextIndex TextIndex::remove(uint32_t id) const {
+  TextIndex next(*this);
+  ++next.version_;
+  // versions up to this one still contain the document
+  (*documents_)[id].removedAt.store(next.version_);
+  ++next.removed_;
+  if (next.removed_ > Documents::FirstSegment && next.removed_ * 2 > next.documentCount_) next.compact();
+  return next;
+}
+
+
+// rebuilds the posting lists without the removed documents
+void TextIndex::compact() {
+  NodePtr terms;
+  size_t termCount = 0, postings = 0;
+  visit(*terms_, [&](Term const& t) {
+    Term live{t.text, t.hash, std::make_shared<Postings>(), 0};
+    Cursor c(t);
+    while (c.next()) {
+      if (visible(c.value())) {
+        live.postings->append(c.value());
+        ++live.count;
+      }
+    }
+    if (live.count == 0) return;
+    ++termCount;
+    postings += live.count;
+    terms = assign(terms, 0, live);
+  });
+  terms_ = terms;
+  termCount_ = termCount;
+  postings_ = postings;
+  documentCount_ -= uint32_t(removed_);
+  removed_ = 0;
+}
+
+
+void TextIndex::find(std::string_view query, std::function<bool(std::string_view)> const& f) const {
+  std::vector<Cursor> cursors;
+  for (auto& word : tokenize(query)) {
+    Term const* t = lookup(terms_.get(), word, std::hash<std::string>()(word));
+    if (!t) return;
+    cursors.emplace_back(*t);
+  }
+  if (cursors.empty()) return;
+
+  // the shortest list drives the intersection, the other ones are searched with seek()
+  std::sort(cursors.begin(), cursors.end(),
+            [](Cursor const& a, Cursor const& b) {return a.size() < b.size();});
+  if (!cursors[0].next()) return;
+
+  for (size_t k = 1; k <= cursors.size(); ) {
+    uint32_t candidate = cursors[0].value();
+    if (k < cursors.size()) {
+      if (!cursors[k].seek(candidate)) return;
+      if (cursors[k].value() == candidate) {
+        ++k;
+        continue;
+      }
+      if (!cursors[0].seek(cursors[k].value())) return;
+      k = 1;
+      continue;
+    }
+    // all the lists contain _candidate_
+    if (visible(candidate) && !f((*documents_)[candidate].name)) return;
+    if (!cursors[0].next()) return;
+    k = 1;
+  }
+}
+
+
+TextIndex::Stats TextIndex::stats() const {
+  Stats s;
+  s.terms = termCount_;
+  s.documents = documentCount_;
+  s.removed = removed_;
+  s.postings = postings_;
+  if (terms_) visit(*terms_, [&](Term const& t) {s.bytes += t.postings->bytes.load();});
+  return s;
+}
@@ -0,0 +1,135 @@
+//
+//  timerwheel: hierarchical timer wheel driven by a single thread.
+//
+
+#include <algorithm>
+#include "timerwheel.h"
+using namespace std;
+
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick) :
+tick_(std::max(tick, std::chrono::milliseconds(1))),
+start_(Clock::now()) {
+  thread_ = std::thread([this]{run();});
+}
+
+
+TimerWheel::~TimerWheel() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stopped_.notify_all();
+  thread_.join();
+}
+
+
+uint64_t TimerWheel::ticks(Clock::time_point t) const {
+  return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(t - start_) / tick_);
+}
+
+
+size_t TimerWheel::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return size_;
+}
+
+
+// number of ticks of _delay_, rounded up so that a timer does not expire early (at least 1)
+uint64_t TimerWheel::delay(std::chrono::milliseconds delay) const {
+  long long ms = std::max<long long>(delay.count(), 0);
+  return std::max<uint64_t>(uint64_t((ms + tick_.count() - 1) / tick_.count()), 1);
+}
+
+
+void TimerWheel::schedule(Timer& timer, std::chrono::milliseconds delay) {
+  uint64_t delta = this->delay(delay);
+  lock_guard<mutex> lock(mutex_);
+  if (timer.slot_) remove(timer);
+  timer.expires_ = ticks(Clock::now()) + delta;
+  add(timer);
+}
+
+
+void TimerWheel::cancel(Timer& timer) {
+  lock_guard<mutex> lock(mutex_);
+  if (timer.slot_) remove(timer);
+}
+
+
+// puts the timer in the slot of the first wheel whose range contains its expiration
+void TimerWheel::add(Timer& timer) {
+  uint64_t expires = std::max(timer.expires_, current_);
+  uint64_t delta = expires - current_;
+  unsigned level = 0;
+  while (level < Levels - 1 && delta >= (uint64_t(1) << (SlotBits * (level + 1)))) ++level;
+
+  // timers beyond the range of the last wheel are moved down when their slot comes
+  uint64_t max = (uint64_t(1) << (SlotBits * Levels)) - 1;
+  if (delta > max) expires = current_ + max;
+
+  Timer** slot = &wheels_[level][(expires >> (SlotBits * level)) & (Slots - 1)];
+  timer.prev_ = nullptr;
+  timer.next_ = *slot;
+  if (*slot) (*slot)->prev_ = &timer;
+  *slot = &timer;
+  timer.slot_ = slot;
+  ++size_;
+}
+
+
+void TimerWheel::remove(Timer& timer) {
+  if (timer.prev_) timer.prev_->next_ = timer.next_;
+  else *timer.slot_ = timer.next_;
+  if (timer.next_) timer.next_->prev_ = timer.prev_;
+  timer.prev_ = timer.next_ = nullptr;
+  timer.slot_ = nullptr;
+  --size_;
+}
+
+
+// moves the timers of a slot of a higher wheel to the lower wheels
+unsigned TimerWheel::cascade(unsigned level, unsigned index) {
+  Timer* timer = wheels_[level][index];
+  wheels_[level][index] = nullptr;
+  while (timer) {
+    Timer* next = timer->next_;
+    timer->slot_ = nullptr;
+    --size_;
+    add(*timer);
+    timer = next;
+  }
+  return index;
+}
+
+
+// processes the ticks up to _now_, calls the callbacks of the expired timers
+void TimerWheel::advance(uint64_t now) {
+  while (current_ <= now) {
+    unsigned index = current_ & (Slots - 1);
+    // the first wheel has turned: the next slot of the second wheel is spread over it, etc.
+    for (unsigned level = 1; index == 0 && level < Levels; ++level) {
+      index = cascade(level, (current_ >> (SlotBits * level)) & (Slots - 1));
+    }
+    index = current_ & (Slots - 1);
+
+    while (Timer* timer = wheels_[0][index]) {
+      remove(*timer);
+      auto again = timer->callback_ ? timer->callback_() : std::chrono::milliseconds(0);
+      if (again.count() > 0) {
+        timer->expires_ = std::max(ticks(Clock::now()), current_) + delay(again);
+        add(*timer);
+      }
+    }
+    ++current_;
+  }
+}
+
+
+void TimerWheel::run() {
+  unique_lock<mutex> lock(mutex_);
+  while (!stopping_) {
+    advance(ticks(Clock::now()));
+    stopped_.wait_until(lock, start_ + tick_ * (current_));
+  }
+}
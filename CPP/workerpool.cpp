@@ -0,0 +1,128 @@
+//
+//  workerpool: fixed-size thread pool with work stealing.
+//
+
+#include <algorithm>
+#include "workerpool.h"
+using namespace std;
+
+// index of the worker running on the current thread and its pool
+static thread_local WorkerPool* currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+
+
+WorkerPool::WorkerPool(unsigned workerCount, size_t maxQueued) :
+maxQueued_(maxQueued) {
+  workerCount = std::max(1u, workerCount);
+  for (unsigned k = 0; k < workerCount; ++k) workers_.emplace_back(new Worker);
+  // threads are started once all the deques exist as they steal from each other
+  for (size_t k = 0; k < workers_.size(); ++k) {
+    workers_[k]->thread = std::thread([this, k]{run(k);});
+  }
+}
+
+
+WorkerPool::~WorkerPool() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  workAvailable_.notify_all();
+  for (auto& w : workers_) w->thread.join();
+}
+
+
+// reserves a place for a new task, fails if the queues are full
+bool WorkerPool::reserve() {
+  if (queued_.fetch_add(1) >= long(maxQueued_) && maxQueued_ > 0) {
+    queued_.fetch_sub(1);
+    return false;
+  }
+  return true;
+}
+
+
+void WorkerPool::push(Task&& task) {
+  // a worker pushes on its own deque, other threads distribute tasks in turn
+  bool spawned = currentPool == this;
+  size_t index = spawned ? currentWorker : next_++ % workers_.size();
+  {
+    Worker& w = *workers_[index];
+    lock_guard<mutex> lock(w.mutex);
+    (spawned ? w.spawned : w.submitted).push_back(std::move(task));
+  }
+  // locking mutex_ ensures that a worker that is about to sleep won't miss the notification
+  { lock_guard<mutex> lock(mutex_); }
+  workAvailable_.notify_one();
+}
+
+
+bool WorkerPool::trySubmit(Task task) {
+  if (!reserve()) return false;
+  push(std::move(task));
+  return true;
+}
+
+
+void WorkerPool::submit(Task task) {
+  while (!reserve()) {
+    unique_lock<mutex> lock(mutex_);
+    ++blocked_;
+    spaceAvailable_.wait(lock, [this]{return queued_.load() < long(maxQueued_);});
+    --blocked_;
+  }
+  push(std::move(task));
+}
+
+
+// takes the most recent task spawned by worker _index_, otherwise its oldest submitted task,
+// otherwise steals the oldest task of another worker (submitted tasks first)
+bool WorkerPool::pop(size_t index, Task& task) {
+  auto take = [&task](std::deque<Task>& tasks, bool newest) {
+    if (tasks.empty()) return false;
+    task = std::move(newest ? tasks.back() : tasks.front());
+    if (newest) tasks.pop_back();
+    else tasks.pop_front();
+    return true;
+  };
+  {
+    Worker& own = *workers_[index];
+    lock_guard<mutex> lock(own.mutex);
+    if (take(own.spawned, true) || take(own.submitted, false)) return true;
+  }
+  for (size_t k = 1; k < workers_.size(); ++k) {
+    Worker& victim = *workers_[(index + k) % workers_.size()];
+    lock_guard<mutex> lock(victim.mutex);
+    if (take(victim.submitted, false) || take(victim.spawned, false)) return true;
+  }
+  return false;
+}
+
+
+void WorkerPool::run(size_t index) {
+  currentPool = this;
+  currentWorker = index;
+
+  while (true) {
+    Task task;
+    if (pop(index, task)) {
+      queued_.fetch_sub(1);
+      if (blocked_ > 0) {
+        { lock_guard<mutex> lock(mutex_); }
+        spaceAvailable_.notify_one();
+      }
+      task();
+      continue;
+    }
+
+    unique_lock<mutex> lock(mutex_);
+    if (queued_.load() > 0) {
+      // a task was reserved but is not pushed yet
+      lock.unlock();
+      std::this_thread::yield();
+      continue;
+    }
+    if (stopping_) return;
+    workAvailable_.wait(lock, [this]{return queued_.load() > 0 || stopping_;});
+  }
+}
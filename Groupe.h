@@ -20,7 +20,7 @@ protected:
     friend class MediaManager;
 
     // Accesseur pour le nom
-    std::string getNom() const { return nom; }
+    const std::string &getNom() const { return nom; }
 
     // Méthode d'affichage
     void affiche(std::ostream &os) const
@@ -1,41 +1,243 @@
 #ifndef MEDIAMANAGER_H
 #define MEDIAMANAGER_H
 
-#include <map>
+#include <array>
+#include <atomic>
+#include <functional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 #include <memory>
 #include <iostream>
+#include <mutex>
+#include <span>
 
 #include "MultimediaObject.h"
 #include "Photo.h"
 #include "Video.h"
 #include "Film.h"
 #include "Groupe.h"
+#include "epoch.h"
+#include "hashindex.h"
+#include "prefixindex.h"
+#include "geoindex.h"
+#include "durationindex.h"
+#include "textindex.h"
+#include "catalogfile.h"
+#include "mutationlog.h"
+#include "objectpool.h"
 
+// MediaManager peut etre utilise par plusieurs threads a la fois (cf. server.cpp).
+// Le catalogue est publie sous forme de versions immuables : les lectures (recherche,
+// affichage, lecture, liste) ne prennent aucun verrou et voient le catalogue tel qu'il etait
+// a un instant donne, meme si des objets sont crees ou supprimes en meme temps.
+// Une ecriture construit la version suivante, qui partage avec la precedente les maps des
+// stripes non modifiees et, dans la stripe du nom, tous les noeuds sauf ceux du chemin menant
+// au nom (O(log n) noeuds copies), puis la publie en remplacant le pointeur courant
+// (compare_exchange). Les anciennes versions sont detruites quand plus aucun lecteur ne les
+// utilise (EpochDomain).
+// Les ecritures sur des noms de stripes differentes ne se genent pas.
+// Chaque stripe est une table de hachage persistante (HashIndex, un arbre de hachage dont les
+// feuilles sont de petites tables a adressage ouvert) dont les cles sont les noms internes de
+// la stripe : les noeuds copies ne copient pas les noms, et les recherches se font avec des
+// std::string_view, sans allocation. Un nom est libere (apres la derniere version qui
+// l'utilise) quand plus aucun objet ni groupe ne le porte.
+// Les noms des objets sont aussi ranges dans un arbre de prefixes (PrefixIndex) qui fait
+// partie de chaque version : la recherche par prefixe ne depend pas de la taille du catalogue.
+// De meme, les photos sont rangees selon leurs coordonnees dans un GeoIndex, mis a jour quand
+// elles sont creees, supprimees ou deplacees (setLatitude, setLongitude), et les videos et
+// les films selon leur duree dans un DurationIndex (mis a jour par setDuree).
+// Enfin, les mots des noms et des fichiers des objets sont ranges dans un index inverse
+// (TextIndex) pour la recherche par mots (FIND).
+// Le catalogue peut etre sauve dans un fichier (save) puis recharge (load) : le fichier est
+// projete en memoire (CatalogFile) et rien n'est lu au chargement. Les objets sont cherches
+// dans la table des noms du fichier, et construits au premier acces ; les stripes ne
+// contiennent que les objets crees, remplaces ou supprimes depuis. Les index secondaires
+// (prefixes, coordonnees, durees, mots) ne sont construits qu'a la premiere recherche qui
+// en a besoin.
+// Les modifications peuvent aussi etre ajoutees a un journal (MutationLog, cf. openLog) qui
+// est rejoue au demarrage suivant, et qui est regulierement remplace par un fichier complet.
+// Les photos, les videos et les films sont alloues (avec leur bloc de controle) dans des
+// pools separes (ObjectPool) : les objets d'un meme type sont contigus, et la memoire des
+// pools est liberee d'un coup quand le catalogue et les objets sont detruits.
+// NB: les objets et les groupes eux-memes ne sont pas proteges une fois retournes.
 class MediaManager
 {
 private:
-    std::map<std::string, MultimediaPtr> objects;
-    std::map<std::string, GroupePtr> groups;
+    static const size_t StripeCount = 16;
+
+    // objet du catalogue, ou enregistrement du fichier charge par load() (index + 1) ;
+    // dans les stripes, un Item vide marque un objet du fichier qui a ete supprime
+    struct Item
+    {
+        MultimediaPtr object;
+        uint32_t record = 0;
+    };
+
+    using ObjectMap = HashIndex<Item>;
+    using GroupeMap = HashIndex<GroupePtr>;
+
+    // version du catalogue, jamais modifiee une fois publiee
+    struct Catalog
+    {
+        std::array<std::shared_ptr<const ObjectMap>, StripeCount> objects;
+        std::array<std::shared_ptr<const GroupeMap>, StripeCount> groups;
+        PrefixIndex names; // noms des objets
+        GeoIndex places;   // coordonnees des photos
+        DurationIndex durations; // durees des videos et des films
+        TextIndex texts;         // mots des noms et des fichiers des objets
+        std::shared_ptr<const CatalogFile> file; // fichier des enregistrements des Items
+        bool indexed = true; // faux tant que les index ne contiennent pas les objets du fichier
+    };
+
+    // verrou des ecrivains d'une stripe, aligne sur une ligne de cache,
+    // noms des objets et des groupes de la stripe et id des objets dans l'index de texte
+    // (proteges par le verrou)
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex;
+        NamePool names;
+        std::unordered_map<std::string_view, uint32_t> texts;
+    };
+
+    std::atomic<const Catalog *> catalog;
+    mutable std::array<Stripe, StripeCount> stripes;
+    mutable EpochDomain epochs;
+    std::mutex textMutex; // les mises a jour de l'index de texte sont faites une a une
+    // fichiers charges, gardes tant que le MediaManager existe car les noms y pointent
+    std::vector<std::shared_ptr<const CatalogFile>> files;
+    uint64_t sequence = 0; // derniere modification du dernier fichier charge (cf. MutationLog)
+    // journal des modifications et fichier dans lequel il est compacte
+    std::unique_ptr<MutationLog> log;
+    std::string logSnapshot;
+    std::mutex compactMutex; // une compaction a la fois
+    // pools des objets, qui vivent tant qu'un de leurs objets existe (cf. PoolAllocator)
+    std::shared_ptr<ObjectPool> photoPool = std::make_shared<ObjectPool>();
+    std::shared_ptr<ObjectPool> videoPool = std::make_shared<ObjectPool>();
+    std::shared_ptr<ObjectPool> filmPool = std::make_shared<ObjectPool>();
+
+    static size_t stripe(size_t hash) { return hash % StripeCount; }
+    void publish(const std::function<void(Catalog &)> &update);
+    // objet a ajouter au catalogue (cf. addObjects)
+    struct NewObject
+    {
+        std::string_view name;
+        MultimediaPtr object;
+    };
+
+    uint64_t addObject(const std::string &name, MultimediaPtr obj);
+    uint64_t addObjects(std::span<const NewObject> added);
+    GroupePtr findGroupe(std::string_view name) const;
+    static bool lookup(const Catalog &c, std::string_view name, size_t h, Item &item);
+    template <typename F>
+    static void forEachItem(const Catalog &c, F f);
+    void requireIndexes() const;
+    void buildIndexes();
+    MultimediaPtr resolve(const Catalog &c, const Item &item) const;
+    static const MultimediaObject *peek(const Catalog &c, const Item &item);
+    std::string_view indexedName(const Catalog &c, const Item &item, std::string_view name) const;
+    template <typename T, typename... Args>
+    static std::shared_ptr<T> make(const std::shared_ptr<ObjectPool> &pool, Args &&...args);
+    MultimediaPtr build(const CatalogFile::Object &o) const;
+    static bool describe(const MultimediaObject &obj, std::string_view name, CatalogFile::Object &o);
+    static void attach(MultimediaObject *obj, MediaManager *manager);
+    static void unindex(Catalog &c, std::string_view key, const MultimediaObject *obj);
+    void movePhoto(Photo &photo, double lat, double lon);
+    void changeDuree(Video &video, int duree);
+    void commit(uint64_t seq);
+    void replay(std::string_view mutation);
+    bool snapshot(const std::string &path, MutationLog *log, uint64_t *position) const;
+    bool compact(MutationLog &log);
+    friend class Photo;
+    friend class Video;
+    friend class MediaImporter;
+
+    MediaManager(const MediaManager &) = delete;
+    MediaManager &operator=(const MediaManager &) = delete;
 
 public:
-    MediaManager() = default;
+    MediaManager();
+    ~MediaManager();
 
-    // Creation methods
+    // Creation methods (createPhoto rend nullptr si latitude ou longitude n'est pas finie)
     std::shared_ptr<Photo> createPhoto(const std::string &name, const std::string &filename, double lat, double lon);
     std::shared_ptr<Video> createVideo(const std::string &name, const std::string &filename, int duree);
     std::shared_ptr<Film> createFilm(const std::string &name, const std::string &filename, int duree);
     GroupePtr createGroupe(const std::string &name);
 
+    // Creation par lots : les objets sont crees comme par createPhoto, createVideo et createFilm,
+    // mais chaque stripe et chaque index n'est mis a jour qu'une fois par lot, et le lot est publie
+    // dans une seule version du catalogue (si plusieurs objets ont le meme nom, le dernier remplace
+    // les autres ; les photos dont les coordonnees ne sont pas finies ne sont pas creees)
+    struct PhotoSpec
+    {
+        std::string name, filename;
+        double lat = 0, lon = 0;
+    };
+    struct VideoSpec
+    {
+        std::string name, filename;
+        int duree = 0;
+    };
+    struct FilmSpec
+    {
+        std::string name, filename;
+        int duree = 0;
+        std::vector<int> chapitres;
+    };
+    std::vector<std::shared_ptr<Photo>> createPhotos(std::span<const PhotoSpec> specs);
+    std::vector<std::shared_ptr<Video>> createVideos(std::span<const VideoSpec> specs);
+    std::vector<std::shared_ptr<Film>> createFilms(std::span<const FilmSpec> specs);
+
     // Lookup / display
-    void displayObject(const std::string &name, std::ostream &out = std::cout) const;
-    void displayGroupe(const std::string &name, std::ostream &out = std::cout) const;
+    MultimediaPtr findObject(std::string_view name) const;
+    void displayObject(std::string_view name, std::ostream &out = std::cout) const;
+    void displayGroupe(std::string_view name, std::ostream &out = std::cout) const;
+    void listObjects(std::ostream &out = std::cout) const; // noms de tous les objets (meme version)
+    // noms des objets commencant par prefix, dans l'ordre alphabetique (au plus limit si limit > 0)
+    std::vector<std::string> findPrefix(std::string_view prefix, size_t limit = 0) const;
+    // photos a moins de radius km, les plus proches d'abord (les k plus proches si k > 0)
+    // et photos dans un rectangle (au plus limit si limit > 0) : f est appelee pour chacune
+    // (les noms ne sont valides que pendant l'appel, ils sont liberes avec leur objet)
+    void findNear(double lat, double lon, double radius, size_t k,
+                  const std::function<void(const GeoIndex::Neighbor &)> &f) const;
+    void findWithin(double minLat, double minLon, double maxLat, double maxLon, size_t limit,
+                    const std::function<void(const GeoIndex::Place &)> &f) const;
+    // videos et films dont la duree est entre min et max (par duree croissante), ou du plus long
+    // au plus court : f(nom, duree) est appelee pour chacun jusqu'a ce qu'elle renvoie false
+    void forEachDuree(int min, int max, const std::function<bool(std::string_view, int)> &f) const;
+    void forEachLongest(const std::function<bool(std::string_view, int)> &f) const;
+    // objets dont le nom ou le fichier contient tous les mots de query (par ordre de creation),
+    // f(nom) est appelee pour chacun jusqu'a ce qu'elle renvoie false
+    void findText(std::string_view query, const std::function<bool(std::string_view)> &f) const;
+    TextIndex::Stats textStats() const;
 
     // Play
-    void playObject(const std::string &name, std::ostream &out = std::cout) const;    
+    void playObject(std::string_view name, std::ostream &out = std::cout) const;
     // Remove
-    bool removeObject(const std::string &name);
-    bool removeGroupe(const std::string &name);
+    bool removeObject(std::string_view name);
+    bool removeGroupe(std::string_view name);
+
+    // Sauve le catalogue (objets, chapitres des films et groupes) dans un fichier
+    // et remplace le catalogue par celui d'un fichier (false en cas d'erreur)
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+
+    // Journal des modifications : les creations, les suppressions et les changements de
+    // coordonnees et de duree y sont ajoutes (mais pas les changements des groupes et des
+    // chapitres, qui ne sont sauves que par save() et compact()). openLog() rejoue d'abord
+    // les modifications qui ne sont pas dans le dernier fichier charge par load(), elle doit
+    // etre appelee avant que d'autres threads utilisent le MediaManager (load() n'est plus
+    // possible ensuite).
+    // Le journal est synchronise sur le disque toutes les syncInterval ms (les modifications
+    // des dernieres ms peuvent etre perdues), ou avant le retour de chaque modification si
+    // syncInterval vaut 0. Quand il depasse compactSize octets, le catalogue est sauve dans
+    // snapshotPath et le journal est vide (compact).
+    // Renvoie le nombre de modifications rejouees, ou -1 en cas d'erreur.
+    long openLog(const std::string &path, const std::string &snapshotPath, unsigned syncInterval = 100,
+                 uint64_t compactSize = 64 << 20);
+    bool compact();
 };
 
 #endif // MEDIAMANAGER_H
@@ -22,8 +22,8 @@ public:
     MultimediaObject(const std::string &nom, const std::string &nomFichier);
 
     // Getter
-    std::string getNom() const;
-    std::string getNomFichier() const;
+    const std::string &getNom() const;
+    const std::string &getNomFichier() const;
 
     // Setter
     void setNom(const std::string nom);
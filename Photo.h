@@ -9,6 +9,7 @@ class Photo : public MultimediaObject
 private:
     double latitude;
     double longitude;
+    MediaManager *manager = nullptr; // catalogue qui indexe la photo (mis a jour par les setters)
 
 public:
     // Constructeurs
@@ -18,7 +19,7 @@ public:
     // Getters
     double getLatitude() const;
     double getLongitude() const;
-    // Setters
+    // Setters (une photo du catalogue garde sa position si la nouvelle n'est pas finie)
     void setLatitude(double latitude);
     void setLongitude(double longitude);
     // Destructeur
@@ -9,6 +9,7 @@ class Video : public MultimediaObject
 {
 private:
     int Duree;
+    MediaManager *manager = nullptr; // catalogue qui indexe la video (mis a jour par setDuree)
 
 public:
     // Constructeurs
@@ -0,0 +1,279 @@
+//
+//  asyncclient: asynchronous TCP/IP clients based on C++20 coroutines.
+//
+//  - AsyncTask: lazy coroutine returning a value of type T
+//  - AsyncReactor: single-threaded event loop (epoll, Linux only) running AsyncTasks
+//  - AsyncClient: connection to a TCPServer (line protocol) with awaitable requests
+//
+
+#ifndef __asyncclient__
+#define __asyncclient__
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "ccsocket.h"
+
+template <typename T> class AsyncTask;
+
+namespace asyncdetail {
+
+  // part of the promise of AsyncTask that does not depend on T
+  struct PromiseBase {
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      // resumes the coroutine that awaits the task (symmetric transfer)
+      template <typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+        auto next = h.promise().continuation;
+        return next ? next : std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+  };
+
+  template <typename T>
+  struct Promise : PromiseBase {
+    AsyncTask<T> get_return_object();
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T result() {
+      if (error) std::rethrow_exception(error);
+      return std::move(*value);
+    }
+    std::optional<T> value;
+  };
+
+  template <>
+  struct Promise<void> : PromiseBase {
+    AsyncTask<void> get_return_object();
+    void return_void() {}
+    void result() {
+      if (error) std::rethrow_exception(error);
+    }
+  };
+}
+
+
+/** Lazy coroutine that produces a value of type T.
+ * The coroutine starts when the task is awaited (co_await) by another coroutine, or when it is
+ * given to AsyncReactor::spawn() or AsyncReactor::wait(). Exceptions are propagated to the awaiter.
+ */
+template <typename T = void>
+class AsyncTask {
+public:
+  using promise_type = asyncdetail::Promise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  AsyncTask(AsyncTask&& t) noexcept : handle_(std::exchange(t.handle_, nullptr)) {}
+
+  AsyncTask& operator=(AsyncTask&& t) noexcept {
+    if (this != &t) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(t.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  ~AsyncTask() { if (handle_) handle_.destroy(); }
+
+  bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    handle_.promise().continuation = awaiter;
+    return handle_;
+  }
+
+  T await_resume() { return handle_.promise().result(); }
+
+private:
+  friend struct asyncdetail::Promise<T>;
+  explicit AsyncTask(Handle h) : handle_(h) {}
+  AsyncTask(AsyncTask const&) = delete;
+  AsyncTask& operator=(AsyncTask const&) = delete;
+  Handle handle_;
+};
+
+namespace asyncdetail {
+  template <typename T>
+  AsyncTask<T> Promise<T>::get_return_object() {
+    return AsyncTask<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+  }
+
+  inline AsyncTask<void> Promise<void>::get_return_object() {
+    return AsyncTask<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+  }
+}
+
+
+/// Object notified by an AsyncReactor when its descriptor is ready.
+class AsyncHandler {
+public:
+  virtual ~AsyncHandler() = default;
+  virtual void onEvent(uint32_t events) = 0;
+};
+
+
+/** Single-threaded event loop that runs AsyncTasks.
+ * Tasks are suspended while they wait for the network and resumed by the reactor when their
+ * sockets are ready, so that a single thread can drive many connections and requests.
+ * @note only available on Linux (the reactor uses epoll).
+ */
+class AsyncReactor {
+public:
+  AsyncReactor();
+  ~AsyncReactor();
+
+  /// Starts a task that runs concurrently with the other tasks of this reactor.
+  /// The task only progresses while run() or wait() is executing.
+  void spawn(AsyncTask<void> task);
+
+  /// Runs the reactor until all spawned tasks have completed.
+  void run();
+
+  /// Runs the reactor until _task_ has completed, then returns its value.
+  /// The other spawned tasks also progress meanwhile.
+  template <typename T>
+  T wait(AsyncTask<T> task) {
+    std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+    std::exception_ptr error;
+    spawn(waitFor(std::move(task), result, error));
+    while (!result && !error) poll();
+    if (error) std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<T>) return std::move(*result);
+  }
+
+  /// Watches _fd_ (edge-triggered): _handler_ is notified of its events.
+  /// @return 0 on success or a negative value on error, see Socket::Errors
+  int add(int fd, uint32_t events, AsyncHandler* handler);
+
+  /// Stops watching _fd_, _handler_ won't be notified anymore.
+  void remove(int fd, AsyncHandler* handler);
+
+private:
+  template <typename T, typename R>
+  static AsyncTask<void> waitFor(AsyncTask<T> task, R& result, std::exception_ptr& error) {
+    try {
+      if constexpr (std::is_void_v<T>) {co_await task; result.emplace(true);}
+      else result.emplace(co_await task);
+    }
+    catch (...) {error = std::current_exception();}
+  }
+
+  void poll();
+  AsyncReactor(AsyncReactor const&) = delete;
+  AsyncReactor& operator=(AsyncReactor const&) = delete;
+
+  int epfd_{-1};
+  size_t tasks_{};                      // number of spawned tasks that have not completed
+  std::vector<AsyncHandler*> removed_;  // handlers removed while dispatching events
+  friend struct AsyncDetached;
+};
+
+
+/** Asynchronous connection with a TCPServer (line protocol).
+ * All the methods are coroutines that must be awaited from an AsyncTask running on the
+ * AsyncReactor of the client. Several tasks can send requests concurrently on the same client:
+ * requests are sent as soon as possible (they are pipelined) and the responses, which arrive
+ * in the same order, are given to the corresponding tasks.
+ *
+ * @code
+ *   AsyncTask<void> poll(AsyncClient& client, std::string host) {
+ *     if (co_await client.connect(host, 3331) < 0) co_return;
+ *     std::vector<std::string> requests{"SEARCH Photo1", "SEARCH Video1"}, responses;
+ *     co_await client.requestMany(requests, responses);
+ *     for (auto& r : responses) std::cout << host << ": " << r << std::endl;
+ *   }
+ *
+ *   int main() {
+ *     AsyncReactor reactor;
+ *     AsyncClient a(reactor), b(reactor);
+ *     reactor.spawn(poll(a, "box1"));
+ *     reactor.spawn(poll(b, "box2"));
+ *     reactor.run();
+ *   }
+ * @endcode
+ */
+class AsyncClient : public AsyncHandler {
+public:
+  AsyncClient(AsyncReactor&);
+
+  /// Closes the connection, pending requests fail with Socket::InvalidSocket.
+  ~AsyncClient();
+
+  /// Connects the client to a TCPServer.
+  /// @return 0 on success or a negative value on error, see Socket::Errors
+  AsyncTask<int> connect(std::string host, int port);
+
+  /// Sends a request and waits for its response, which is stored in _response_.
+  /// @return see SocketBuffer::readLine()
+  AsyncTask<SOCKSIZE> request(std::string request, std::string& response);
+
+  /// Sends several requests at once (one system call) and waits for all their responses,
+  /// which are stored in _responses_ in the same order.
+  /// @return the number of bytes that were received or a value <= 0, see SocketBuffer::readLine()
+  AsyncTask<SOCKSIZE> requestMany(std::vector<std::string> requests,
+                                  std::vector<std::string>& responses);
+
+  /// Returns true if the client is connected.
+  bool isConnected() const { return connected_; }
+
+  /// Closes the connection.
+  void close();
+
+private:
+  // a task waiting for _expected_ responses
+  struct Waiter {
+    std::vector<std::string>* responses{};
+    size_t expected{};
+    SOCKSIZE status{};
+    bool done{};
+    std::coroutine_handle<> handle;
+  };
+
+  struct ResponseAwaiter {
+    Waiter& waiter;
+    bool await_ready() { return waiter.done; }
+    void await_suspend(std::coroutine_handle<> h) { waiter.handle = h; }
+    SOCKSIZE await_resume() { return waiter.status; }
+  };
+
+  struct WritableAwaiter {
+    AsyncClient& client;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) { client.connecting_ = h; }
+    void await_resume() {}
+  };
+
+  void onEvent(uint32_t events) override;
+  bool flush();
+  void receive();
+  void fail(SOCKSIZE status);
+  bool deliver(std::string&& response, SOCKSIZE received, std::vector<std::coroutine_handle<>>& ready);
+
+  AsyncClient(AsyncClient const&) = delete;
+  AsyncClient& operator=(AsyncClient const&) = delete;
+
+  AsyncReactor& reactor_;
+  Socket sock_;
+  SocketBuffer sockbuf_;
+  bool connected_{}, watched_{};
+  std::string output_;                  // requests that have not been (entirely) sent yet
+  size_t outpos_{};
+  std::deque<Waiter*> waiters_;         // in the order of the requests
+  std::deque<std::string> unclaimed_;   // responses received before being awaited
+  std::coroutine_handle<> connecting_;
+};
+
+#endif
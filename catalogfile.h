@@ -0,0 +1,146 @@
+//
+//  catalogfile: binary snapshot of a catalog of multimedia objects, read through mmap.
+//
+
+#ifndef __catalogfile__
+#define __catalogfile__
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "MultimediaObject.h"
+
+/// Binary snapshot of a catalog: objects (photos, videos, films with their chapters) and groups.
+///
+/// The file is made of a header followed by arrays of fixed-size records, a hash table of the
+/// names of the objects and a table of strings, so it is used as is once mapped in memory
+/// (mmap): opening it costs nothing but the validation of the header, and the pages of the
+/// file are only read when they are used. Records are checked when they are read, and objects
+/// are built from their records the first time they are needed (see object()).
+/// Numbers are stored with the byte order of the host: files are not portable between
+/// architectures with different byte orders (the header detects it).
+class CatalogFile {
+public:
+  static const uint32_t FormatVersion = 2;
+
+  enum Type : uint8_t { PhotoType = 1, VideoType = 2, FilmType = 3 };
+
+  /// Object as stored in a file.
+  struct Object {
+    Type type{PhotoType};
+    bool detached{};                    // only in groups, not in the catalog
+    std::string_view name, file;
+    double latitude{}, longitude{};     // photos
+    int duree{};                        // videos and films
+    const int32_t* chapters{};          // films
+    uint32_t chapterCount{};
+  };
+
+  /// Group as stored in a file: its members are indexes of objects.
+  struct Group {
+    std::string_view name;
+    const uint32_t* members{};
+    uint32_t memberCount{};
+  };
+
+  /// Builds a snapshot in memory, then writes it.
+  class Writer {
+  public:
+    /// Adds an object (its strings and chapters are copied), returns its index.
+    uint32_t addObject(Object const& object);
+
+    /// Adds a group of objects (indexes returned by addObject()).
+    void addGroup(std::string_view name, std::vector<uint32_t> const& members);
+
+    /// Sets the sequence of the last mutation that the snapshot contains (see MutationLog).
+    void setSequence(uint64_t sequence) { sequence_ = sequence; }
+
+    /// Writes the snapshot in a temporary file that replaces _path_ once complete.
+    /// @return false on error.
+    bool write(std::string const& path) const;
+
+  private:
+    uint32_t addString(std::string_view s);
+    std::vector<char> strings_, objects_, groups_;
+    std::vector<uint32_t> members_;
+    std::vector<int32_t> chapters_;
+    uint32_t objectCount_{}, groupCount_{};
+    uint64_t sequence_{};
+  };
+
+  /// Maps the snapshot in memory.
+  /// @return nullptr if the file can't be read or is not a valid snapshot.
+  static std::shared_ptr<CatalogFile> open(std::string const& path);
+
+  ~CatalogFile();
+
+  uint32_t objectCount() const { return objectCount_; }
+  uint32_t groupCount() const { return groupCount_; }
+
+  /// Returns the sequence of the last mutation that the snapshot contains.
+  uint64_t sequence() const { return sequence_; }
+
+  /// Reads the record of object _index_.
+  /// @return false if it does not exist or refers to data outside the file.
+  bool objectAt(uint32_t index, Object& object) const;
+
+  /// Reads the record of group _index_.
+  /// @return false if it does not exist or refers to data (or objects) outside the file.
+  bool groupAt(uint32_t index, Group& group) const;
+
+  /// Finds the object named _name_ that is in the catalog (not detached): if several records
+  /// have this name, the first one.
+  /// @return false if there is none.
+  bool find(std::string_view name, uint32_t& index) const;
+
+  /// Returns object _index_, which is built by _build_ the first time (only once, even if
+  /// several threads ask for it at the same time).
+  MultimediaPtr object(uint32_t index, std::function<MultimediaPtr()> const& build) const;
+
+  /// Returns object _index_ if it was already built, nullptr otherwise.
+  /// If the object is being built by another thread, waits until it is built.
+  MultimediaPtr built(uint32_t index) const;
+
+  /// Calls _f(object)_ for each object that was built.
+  void forEachBuilt(std::function<void(MultimediaObject*)> const& f) const;
+
+private:
+  struct Header;
+  struct ObjectRecord;
+  struct GroupRecord;
+
+  struct Slot {
+    std::atomic<bool> ready{false};
+    MultimediaPtr object;
+  };
+  static const uint32_t ChunkSize = 1024;   // slots are allocated by chunks, when first used
+
+
+  CatalogFile() = default;
+  CatalogFile(CatalogFile const&) = delete;
+  CatalogFile& operator=(CatalogFile const&) = delete;
+  bool validate(size_t size);
+  bool valid(ObjectRecord const& r) const;
+  std::string_view string(uint32_t offset, uint32_t length) const;
+  Slot* slot(uint32_t index, bool create) const;
+
+  const char* data_{};
+  size_t size_{};
+  std::unique_ptr<char[]> buffer_;      // content of the file if it can't be mapped
+  const ObjectRecord* objects_{};
+  const GroupRecord* groups_{};
+  const uint32_t* members_{};
+  const int32_t* chapters_{};
+  const uint32_t* names_{};             // open addressing, index + 1 of the objects (0: empty)
+  const char* strings_{};
+  uint32_t objectCount_{}, groupCount_{}, memberCount_{}, chapterCount_{};
+  uint64_t nameCount_{}, stringsSize_{}, sequence_{};
+  std::unique_ptr<std::atomic<Slot*>[]> chunks_;   // objects that were built
+  mutable std::mutex mutexes_[16];      // taken while an object is built
+};
+
+#endif
@@ -2,8 +2,8 @@
 //  ccsocket: C++ Classes for TCP/IP and UDP Datagram INET Sockets.
 //  (c) Eric Lecolinet 2016/2020 - https://www.telecom-paris.fr/~elc
 //
-//  - Socket: TCP/IP or UDP/Datagram IPv4 socket
-//  - ServerSocket: TCP/IP Socket Server
+//  - Socket: TCP/IP or UDP/Datagram IPv4 socket, or Unix domain socket
+//  - ServerSocket: TCP/IP (or Unix domain) Socket Server
 //  - SocketBuffer: preserves record boundaries when exchanging data
 //   between TCP/IP sockets.
 //
@@ -12,6 +12,7 @@
 #define ccuty_ccsocket 1
 
 #include <string>
+#include <vector>
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <winsock2.h>
@@ -37,7 +38,8 @@
 #endif
 
 /** TCP/IP or UDP/Datagram IPv4 socket.
- * AF_INET connections following the IPv4 Internet protocol are supported.
+ * AF_INET connections following the IPv4 Internet protocol are supported, as well as
+ * AF_UNIX (Local) sockets for clients and servers running on the same host (Unix/Linux only).
  * @note
  * - ServerSocket should be used on the server side.
  * - SIGPIPE signals are ignored when using Linux, BSD or MACOSX.
@@ -49,7 +51,15 @@ public:
   /// - Socket::Failed (-1): could not connect, could not bind, etc.
   /// - Socket::InvalidSocket (-2): invalid socket or wrong socket type
   /// - Socket::UnknownHost (-3): could not reach host
-  enum Errors { Failed = -1, InvalidSocket = -2, UnknownHost = -3 };
+  /// - Socket::WouldBlock (-4): the operation would block on a non-blocking socket
+  enum Errors { Failed = -1, InvalidSocket = -2, UnknownHost = -3, WouldBlock = -4 };
+
+  /// Socket families.
+  /// - Socket::Inet: AF_INET sockets using the IPv4 Internet protocol
+  /// - Socket::Local: AF_UNIX sockets identified by a path in the file system
+  ///   (available only on Unix/Linux), which avoid the TCP/IP stack between
+  ///   processes running on the same host.
+  enum Family { Inet, Local };
 
   /// initialisation and cleanup of sockets on Widows.
   /// @note startup is automaticcaly called when a Socket or a ServerSocket is created
@@ -64,6 +74,9 @@ public:
   /// - SOCK_DGRAM for UDP/datagram sockets (available only or Unix/Linux)
   Socket(int type = SOCK_STREAM);
 
+  /// Creates a new Socket of the given family (see Socket(int type)).
+  Socket(Family family, int type = SOCK_STREAM);
+
   /// Creates a Socket from an existing socket file descriptor.
   Socket(int type, SOCKET sockfd);
 
@@ -76,6 +89,10 @@ public:
   /// @return 0 on success or a negative value on error which is one of Socket::Errors
   int connect(const std::string& host, int port);
 
+  /// Connects a Local socket to the ServerSocket bound to _path_.
+  /// @return 0 on success or a negative value on error which is one of Socket::Errors
+  int connect(const std::string& path);
+
   /// Assigns the socket to localhost.
   /// @return 0 on success or a negative value on error, see Socket::Errors
   int bind(int port);
@@ -85,6 +102,10 @@ public:
   /// @return 0 on success or a negative value on error, see Socket::Errors
   int bind(const std::string& host, int port);
 
+  /// Assigns a Local socket to _path_.
+  /// @return 0 on success or a negative value on error, see Socket::Errors
+  int bind(const std::string& path);
+
   /// Closes the socket.
   int close();
 
@@ -94,6 +115,15 @@ public:
   /// Returns the descriptor of the socket.
   SOCKET descriptor() { return sockfd_; }
 
+  /// Enables/disables blocking mode (sockets are blocking by default).
+  /// In non-blocking mode, receive() and send() return -1 instead of blocking the caller
+  /// and wouldBlock() then returns true.
+  /// @return 0 on success or a negative value on error, see Socket::Errors
+  int setBlocking(bool);
+
+  /// Returns true if the last receive() or send() failed because it would have blocked.
+  static bool wouldBlock();
+
   /// Disables further receive operations.
   void shutdownInput();
 
@@ -177,6 +207,8 @@ private:
   int setLocalAddress(SOCKADDR_IN& addr, int port);
   // Initializes a remote INET4 address, returns 0 on success, -1 otherwise.
   int setAddress(SOCKADDR_IN& addr, const std::string& host, int port);
+  // Connects or binds a Local socket to path.
+  int localAddress(const std::string& path, bool connect);
 
   SOCKET sockfd_{};
   Socket(const Socket&) = delete;
@@ -187,12 +219,13 @@ private:
 
 
 /// TCP/IP IPv4 server socket.
-/// Waits for requests to come in over the network.
+/// Waits for requests to come in over the network (or from the same host for Local sockets).
 /// TCP/IP sockets do not preserve record boundaries but SocketBuffer solves this problem.
 class ServerSocket {
 public:
-  /// Creates a listening socket that waits for connection requests by TCP/IP clients.
-  ServerSocket();
+  /// Creates a listening socket that waits for connection requests by TCP/IP clients
+  /// (or by Local clients on the same host if _family_ is Socket::Local).
+  ServerSocket(Socket::Family family = Socket::Inet);
 
   ~ServerSocket();
 
@@ -205,9 +238,18 @@ public:
   /// @return 0 on success or a negative value on error, see  Socket::Errors
   int bind(int port, int backlog = 50);
 
+  /// Assigns a Local server socket to _path_.
+  /// A file that already exists at _path_ is removed first, and the file is removed when
+  /// the socket is closed.
+  /// @return 0 on success or a negative value on error, see  Socket::Errors
+  int bind(const std::string& path, int backlog = 50);
+
   /// Closes the socket.
   int close();
 
+  /// Stops accepting connections: threads blocked in accept() return nullptr.
+  void shutdown();
+
   /// Returns true if the socket was closed.
   bool isClosed() const { return sockfd_ == INVALID_SOCKET; }
 
@@ -222,6 +264,12 @@ public:
   /// Enables/disables the SO_REUSEADDR socket option.
   int setReuseAddress(bool);
 
+  /// Enables/disables the SO_REUSEPORT socket option (must be called before bind()).
+  /// Several sockets with this option can then be bound to the same port, the kernel
+  /// distributes incoming connections between them.
+  /// @return 0 on success or a negative value on error (e.g. if the system does not support it).
+  int setReusePort(bool);
+
   /// Enables/disables SO_TIMEOUT with the specified timeout (in milliseconds).
   int  setSoTimeout(int timeout);
 
@@ -233,6 +281,7 @@ public:
 private:
   Socket* createSocket(SOCKET);
   SOCKET sockfd_{};  // listening socket.
+  std::string path_; // path of a Local socket.
   ServerSocket(const ServerSocket&) = delete;
   ServerSocket& operator=(const ServerSocket&) = delete;
   ServerSocket& operator=(ServerSocket&&) = delete;
@@ -299,15 +348,55 @@ public:
    */
   SOCKSIZE readLine(std::string& message);
 
+  /** Read a message from a non-blocking socket.
+   * Same as readLine() except that this method never blocks: if the message is not complete,
+   * the data received so far is kept by the SocketBuffer and Socket::WouldBlock is returned.
+   * tryReadLine() should then be called again when the socket becomes readable.
+   * @return see readLine() or Socket::WouldBlock.
+   */
+  SOCKSIZE tryReadLine(std::string& message);
+
   /** Send a message to a connected socket.
    * writeLine() sends a message that will be received by a single call of readLine() on the other side,
+   * The message and the separator are sent together, without being copied nor allocating memory.
    *
-   * @return see readLine()
+   * If autoFlush() is false, short messages are copied into the output buffer of the SocketBuffer,
+   * which is only sent when it is full or when flush() is called.
+   *
+   * @return the length of the message (including the separator) or see readLine()
    * @note if _message_ contains one or several occurences of the separator, readLine() will be
    * called as many times on the other side.
    */
   SOCKSIZE writeLine(const std::string& message);
 
+  /// Sends the messages that are waiting in the output buffer.
+  /// @return the number of bytes that were sent (0 if the buffer was empty) or see readLine()
+  /// @note pending messages are not sent when the SocketBuffer is destroyed.
+  SOCKSIZE flush();
+
+  /// Returns/changes the flushing mode of writeLine().
+  /// If true (the default), messages are sent immediately by writeLine(). Otherwise
+  /// flush() must be called to make sure they are sent.
+  /// @{
+  void setAutoFlush(bool state);
+  bool autoFlush() const { return autoFlush_; }
+  /// @}
+
+  /** Send several messages to a connected socket.
+   * Same as calling writeLine() for each message, but all the messages are sent by a single
+   * gathered write (when supported by the system) instead of one system call per message.
+   * @return the total number of bytes that were sent or a negative value, see readLine()
+   */
+  SOCKSIZE writeLines(const std::vector<std::string>& messages);
+
+  /// Returns true if a complete message has already been received.
+  /// readLine() then returns this message without blocking nor calling the system.
+  bool hasLine() const;
+
+  /// Returns true if some data has been received but not read yet (e.g. the beginning of
+  /// a message that tryReadLine() or tryReadFrame() could not complete).
+  bool hasPendingInput() const;
+
   /// Reads exactly _len_ bytes from the socket, blocks otherwise.
   /// @return see readLine()
   SOCKSIZE read(char* buffer, size_t len);
@@ -337,6 +426,59 @@ public:
   int writeSeparator() const { return outsep_; }
   // @}
 
+  /// Binary framing.
+  /// A frame is made of a header of FrameHeaderSize bytes, which contains the length of the
+  /// payload (4 bytes, big endian) and an opcode (1 byte), followed by the payload.
+  /// Contrary to lines, payloads can contain any byte (including separators) and need not
+  /// be scanned nor escaped. Lines and frames can be exchanged on the same connection
+  /// (e.g. for negotiating the framing mode), provided both sides agree on the order.
+  /// @{
+  static const size_t FrameHeaderSize = 5;
+
+  /// Maximum length of a payload accepted by readFrame() (64 MB by default).
+  void setMaxFrameSize(size_t size) { maxFrameSize_ = size; }
+  size_t maxFrameSize() const { return maxFrameSize_; }
+
+  /// Reads a frame, blocks until it is fully received.
+  /// The payload is stored in _payload_ and the opcode in _opcode_.
+  /// @return the number of bytes that were received (including the header) or see readLine().
+  /// Socket::Failed is also returned if the payload is larger than maxFrameSize().
+  SOCKSIZE readFrame(std::string& payload, int& opcode);
+
+  /// Reads a frame from a non-blocking socket.
+  /// Same as readFrame() except that Socket::WouldBlock is returned if the frame is not complete,
+  /// see tryReadLine().
+  SOCKSIZE tryReadFrame(std::string& payload, int& opcode);
+
+  /// Returns true if a complete frame has already been received, see hasLine().
+  bool hasFrame() const;
+
+  /// Sends a frame, the header and the payload are sent together without being copied.
+  /// If autoFlush() is false, short frames are copied into the output buffer, see writeLine().
+  /// @return the length of the frame (including the header) or see readLine().
+  SOCKSIZE writeFrame(const std::string& payload, int opcode);
+
+  /// Sends several frames with the same opcode by a single gathered write, see writeLines().
+  SOCKSIZE writeFrames(const std::vector<std::string>& payloads, int opcode);
+
+  /// Writes the header of a frame (FrameHeaderSize bytes) in _header_.
+  static void encodeFrameHeader(char* header, size_t payloadLength, int opcode);
+  /// @}
+
+  /// Separator scanning.
+  /// Lines are scanned by the fastest kernel supported by the CPU (ScanBest), the others can
+  /// be chosen for comparison.
+  /// @{
+  enum ScanKernel {ScanBest, ScanScalar, ScanSSE2, ScanAVX2};
+
+  /// Returns true if the CPU (and the compiler) can run _kernel_.
+  static bool hasScanKernel(ScanKernel kernel);
+
+  /// Returns the first byte equal to _c1_ or _c2_ in [_begin_, _end_[ (_end_ if there is none),
+  /// found by _kernel_, which must be supported (see hasScanKernel()).
+  static const char* scan(ScanKernel kernel, const char* begin, const char* end, char c1, char c2);
+  /// @}
+
 private:
   SocketBuffer(const SocketBuffer&) = delete;
   SocketBuffer& operator=(const SocketBuffer&) = delete;
@@ -344,10 +486,15 @@ private:
 
 protected:
   bool retrieveLine(std::string& str, SOCKSIZE received);
+  SOCKSIZE receiveFrame(std::string& payload, int& opcode, bool block);
+  const char* findSeparator(const char* begin, const char* end, int& sepLen) const;
   size_t insize_{}, outsize_{};
   int insep_{}, outsep_{};
+  bool autoFlush_{true};
+  size_t maxFrameSize_{64 * 1024 * 1024};
   Socket* sock_{};
   struct InputBuffer* in_{};
+  struct OutputBuffer* out_{};
 };
 
 #endif
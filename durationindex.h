@@ -0,0 +1,91 @@
+//
+//  durationindex: persistent ordered index of names by duration.
+//
+
+#ifndef __durationindex__
+#define __durationindex__
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/// Names sorted by duration (then by name), for range and top-k queries.
+/// The entries are stored in a treap (a binary search tree balanced by random priorities, here
+/// the hashes of the names), so that insert(), erase() and the start of a query cost O(log n).
+/// Queries call a function for each entry, in order, instead of returning all the entries:
+/// their cost only depends on the number of entries that are actually used.
+///
+/// Like PrefixIndex, the index is persistent: insert() and erase() return a new index that
+/// shares all the nodes with this one except those on the path of the entry.
+/// Names are views: they must outlive the index (see NamePool).
+class DurationIndex {
+public:
+  struct Entry {
+    std::string_view name;
+    int duration{};
+  };
+
+  /// Creates an empty index.
+  DurationIndex() {}
+
+  /// Returns an index that also contains _name_ with _duration_.
+  DurationIndex insert(std::string_view name, int duration) const;
+
+  /// Returns an index that also contains _entries_: they are arranged in a tree of their own,
+  /// which is then merged with this index (faster than inserting them one by one).
+  DurationIndex insert(std::vector<Entry> entries) const;
+
+  /// Returns an index that does not contain _name_ with _duration_.
+  DurationIndex erase(std::string_view name, int duration) const;
+
+  /// Calls _f(entry)_ for the entries whose duration is between _min_ and _max_ (included), by
+  /// increasing duration, until _f_ returns false.
+  template <typename F>
+  void forEach(int min, int max, F f) const { ascend(root_.get(), min, max, f); }
+
+  /// Calls _f(entry)_ for all the entries by decreasing duration, until _f_ returns false.
+  template <typename F>
+  void forEachDescending(F f) const { descend(root_.get(), f); }
+
+  /// Returns the number of entries.
+  size_t size() const { return size_; }
+
+private:
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+
+  struct Node {
+    Entry entry;
+    size_t priority{};
+    NodePtr left, right;
+  };
+
+  DurationIndex(NodePtr root, size_t size) : root_(std::move(root)), size_(size) {}
+  static bool less(Entry const& a, Entry const& b);
+  static size_t priority(std::string_view name);
+  bool contains(Entry const& entry) const;
+  static void split(NodePtr const& node, Entry const& entry, NodePtr& left, NodePtr& right);
+  static NodePtr merge(NodePtr const& left, NodePtr const& right);
+  static NodePtr unite(NodePtr const& a, NodePtr const& b);
+  static NodePtr insert(NodePtr const& node, std::shared_ptr<Node> const& added);
+  static NodePtr erase(NodePtr const& node, Entry const& entry, bool& removed);
+
+  template <typename F>
+  static bool ascend(Node const* node, int min, int max, F& f) {
+    if (!node) return true;
+    int d = node->entry.duration;
+    if (d >= min && !ascend(node->left.get(), min, max, f)) return false;
+    if (d >= min && d <= max && !f(node->entry)) return false;
+    return d > max || ascend(node->right.get(), min, max, f);
+  }
+
+  template <typename F>
+  static bool descend(Node const* node, F& f) {
+    if (!node) return true;
+    return descend(node->right.get(), f) && f(node->entry) && descend(node->left.get(), f);
+  }
+
+  NodePtr root_;
+  size_t size_{};
+};
+
+#endif
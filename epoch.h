@@ -0,0 +1,78 @@
+//
+//  epoch: epoch-based reclamation of the memory shared with lock-free readers.
+//
+
+#ifndef __epoch__
+#define __epoch__
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/// Epoch-based reclamation.
+/// Readers access shared data inside a Guard, without any lock. Writers that unpublish data
+/// (e.g. replace the pointer that readers load) retire it instead of deleting it: retired data
+/// is deleted once all the Guards that existed when it was retired have been destroyed, so that
+/// no reader can still be using it.
+/// A Guard costs a few atomic operations on a slot that is normally not shared with other threads,
+/// hence readers scale with the number of cores.
+class EpochDomain {
+public:
+  /// Protects the data that the current thread reads while the guard exists.
+  /// Guards should be short-lived: they delay the reclamation of retired data.
+  class Guard {
+  public:
+    explicit Guard(EpochDomain& domain);
+    ~Guard();
+  private:
+    Guard(Guard const&) = delete;
+    Guard& operator=(Guard const&) = delete;
+    std::atomic<uint64_t>* slot_;
+  };
+
+  EpochDomain() = default;
+
+  /// Deletes all retired data: there must not be any Guard anymore.
+  ~EpochDomain();
+
+  /// Deletes _p_ (with delete) when no reader can be using it anymore.
+  /// _p_ must already be unreachable by readers that start after this call.
+  template <typename T>
+  void retire(T* p) {
+    retire(const_cast<void*>(static_cast<const void*>(p)),
+           [](void* q) {delete static_cast<T*>(q);});
+  }
+
+  /// Deletes the retired data that no reader can be using anymore.
+  void collect();
+
+  /// Returns the number of retired objects that are not deleted yet.
+  size_t retired() const;
+
+private:
+  static const size_t SlotCount = 128;
+
+  struct Retired {
+    void* object;
+    void (*deleter)(void*);
+    uint64_t epoch;
+  };
+
+  // epoch announced by a reader (0 if the slot is free), one per cache line
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};
+  };
+
+  void retire(void* p, void (*deleter)(void*));
+  uint64_t oldestReader() const;
+
+  EpochDomain(EpochDomain const&) = delete;
+  EpochDomain& operator=(EpochDomain const&) = delete;
+
+  std::atomic<uint64_t> epoch_{1};      // incremented each time data is retired
+  Slot slots_[SlotCount];
+  mutable std::mutex mutex_;            // protects retired_
+  std::vector<Retired> retired_;
+};
+
+#endif
@@ -0,0 +1,95 @@
+//
+//  geoindex: persistent geohash quadtree of named places for location queries.
+//
+
+#ifndef __geoindex__
+#define __geoindex__
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/// Set of named places (latitude, longitude in degrees) that can be searched by location.
+/// Places are ordered by their geohash (the bits of the longitude and of the latitude are
+/// interleaved) in a quadtree: each node covers a geohash cell and its children the 4 quarters
+/// of the cell. Cells are only split when they contain more than LeafSize places, so that dense
+/// areas get small cells and empty areas cost nothing. A query only visits the cells that
+/// intersect the searched area.
+///
+/// Like PrefixIndex, the index is persistent: insert() and erase() return a new index that
+/// shares all the nodes with this one except those on the path of the place.
+/// Names are views: they must outlive the index (see NamePool).
+class GeoIndex {
+public:
+  struct Place {
+    std::string_view name;
+    double latitude{}, longitude{};
+  };
+
+  struct Neighbor {
+    Place place;
+    double distance{};                  // in km
+  };
+
+  /// Creates an empty index.
+  GeoIndex();
+
+  /// Returns an index that also contains _place_.
+  GeoIndex insert(Place const& place) const;
+
+  /// Returns an index that also contains _places_. Each cell is copied (or split) once,
+  /// whatever the number of places inserted in it.
+  GeoIndex insert(std::vector<Place> const& places) const;
+
+  /// Returns an index that does not contain the place named _name_ at _latitude_, _longitude_.
+  GeoIndex erase(std::string_view name, double latitude, double longitude) const;
+
+  /// Returns the places inside the box (at most _limit_ places if _limit_ is not 0).
+  /// The box crosses the 180th meridian if _minLongitude_ > _maxLongitude_.
+  std::vector<Place> within(double minLatitude, double minLongitude,
+                            double maxLatitude, double maxLongitude, size_t limit = 0) const;
+
+  /// Returns the places at most _radius_ km away from _latitude_, _longitude_, nearest first
+  /// (only the _k_ nearest ones if _k_ is not 0). With _k_, the cells are visited nearest
+  /// first and the search stops once _k_ places are nearer than every cell left, so that
+  /// a large radius does not cost more than a small one.
+  std::vector<Neighbor> near(double latitude, double longitude, double radius, size_t k = 0) const;
+
+  /// Returns the number of places.
+  size_t size() const;
+
+  /// Returns the great-circle distance in km between two points.
+  static double distance(double latitude1, double longitude1, double latitude2, double longitude2);
+
+private:
+  static const size_t LeafSize = 32;
+  static const unsigned MaxDepth = 32;  // a cell of the last level covers a single geohash
+
+  struct Entry {
+    uint64_t key;                       // geohash
+    Place place;
+  };
+
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+
+  struct Box {
+    double minLatitude, minLongitude, maxLatitude, maxLongitude;
+  };
+
+  explicit GeoIndex(NodePtr root) : root_(std::move(root)) {}
+  static uint64_t geohash(double latitude, double longitude);
+  static NodePtr insert(NodePtr const& node, unsigned depth, Entry const& entry);
+  static NodePtr insert(NodePtr const& node, unsigned depth, Entry const* first, Entry const* last);
+  static NodePtr erase(NodePtr const& node, unsigned depth, uint64_t key, std::string_view name);
+  static void gather(Node const& node, std::vector<Entry>& entries);
+  static void search(Node const& node, Box const& cell, Box const& box, size_t limit,
+                     std::vector<Place>& places);
+  static double minDistance(Box const& cell, double latitude, double longitude);
+  std::vector<Neighbor> nearest(double latitude, double longitude, double radius, size_t k) const;
+
+  NodePtr root_;                        // nullptr if the index is empty
+};
+
+#endif
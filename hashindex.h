@@ -0,0 +1,294 @@
+//
+//  hashindex: persistent hash index keyed by interned names.
+//
+
+#ifndef __hashindex__
+#define __hashindex__
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Storage of names that are referenced by HashIndexes.
+/// Each name is stored once, so that indexes (and their copies) only store views, and counts
+/// the references that were taken by intern(). When its last reference is released, a name is
+/// removed from the pool but its storage is returned to the caller, which deletes it once no
+/// reader can use the indexes that referenced it (e.g. with EpochDomain::retire()).
+class NamePool {
+public:
+  /// Returns the stored copy of _name_ (which is added to the pool if needed) and takes a
+  /// reference to it.
+  std::string_view intern(std::string_view name) {
+    auto it = names_.find(name);
+    if (it == names_.end()) {
+      auto text = std::make_unique<std::string>(name);
+      std::string_view view = *text;
+      it = names_.emplace(view, Name{std::move(text), 0}).first;
+    }
+    ++it->second.references;
+    return it->first;
+  }
+
+  /// Releases a reference to _name_, which is ignored if it is not a view of the pool.
+  /// Returns the storage of the name if this was its last reference, nullptr otherwise.
+  std::string* release(std::string_view name) {
+    auto it = names_.find(name);
+    if (it == names_.end() || it->first.data() != name.data() || --it->second.references > 0) {
+      return nullptr;
+    }
+    std::string* text = it->second.text.release();
+    names_.erase(it);
+    return text;
+  }
+
+  /// Returns the stored copy of _name_ without taking a reference (an empty view with a null
+  /// data() if _name_ is not in the pool).
+  std::string_view find(std::string_view name) const {
+    auto it = names_.find(name);
+    return it != names_.end() ? it->first : std::string_view();
+  }
+
+  /// Makes room for _count_ more names.
+  void reserve(size_t count) { names_.reserve(names_.size() + count); }
+
+  /// Returns the number of names.
+  size_t size() const { return names_.size(); }
+
+private:
+  struct Name {
+    std::unique_ptr<std::string> text;  // is not moved when the table grows
+    size_t references{};
+  };
+  std::unordered_map<std::string_view, Name> names_;
+};
+
+
+/// Persistent hash map from names to values of type V: a hash trie whose leaves are small
+/// open-addressing tables. The entries of a leaf are stored contiguously with the hash of their
+/// name (linear probing), so that a lookup goes down a few nodes, then usually reads a single
+/// cache line of the leaf and only compares the name whose hash matches. A leaf that is full
+/// (LeafSlots slots) is split into a node whose 32 children are leaves, 5 bits of the hash per
+/// level, and a node becomes a leaf again when most of its entries are removed.
+/// A copy of an index shares all its nodes: adding or removing a name only copies the nodes on
+/// its path and its leaf (O(log n)), the other copies are unchanged and can be read concurrently.
+/// Keys are views: the names must outlive the index (see NamePool). Lookups take a view, hence
+/// don't need to allocate a std::string.
+template <typename V>
+class HashIndex {
+public:
+  /// Hash of a name, which is given to the other methods so that it is only computed once.
+  static size_t hash(std::string_view name) { return std::hash<std::string_view>()(name); }
+
+  /// Returns the value of _name_ or nullptr.
+  const V* find(std::string_view name, size_t h) const {
+    uint64_t m = mix(h);
+    unsigned level = 0;
+    Node const* node = root_.get();
+    for (; node && !node->leaf; ++level) node = node->children[chunk(m, level)].get();
+    if (!node) return nullptr;
+    Entry const& e = node->slots[slot(*node, level, m, h, name)];
+    return e.used() ? &e.value : nullptr;
+  }
+
+  /// Adds or replaces the value of _name_, which must be interned. Returns false if _name_ was
+  /// already there: its value is replaced, but the index keeps its key.
+  bool assign(std::string_view name, size_t h, V value) {
+    bool added = false;
+    root_ = assign(root_.get(), 0, mix(h), Entry{h, name, std::move(value)}, added);
+    return added;
+  }
+
+  /// Removes _name_, returns false if it was not found. _key_, if not null, is set to the view
+  /// that the index kept for _name_ (see assign()).
+  bool erase(std::string_view name, size_t h, std::string_view* key = nullptr) {
+    bool removed = false;
+    std::string_view erased;
+    NodePtr root = erase(root_, 0, mix(h), name, h, erased, removed);
+    if (!removed) return false;
+    root_ = std::move(root);
+    if (key) *key = erased;
+    return true;
+  }
+
+  /// Returns the number of entries.
+  size_t size() const { return root_ ? root_->count : 0; }
+
+  /// Calls _f(name, value)_ for each entry (in no particular order).
+  template <typename F>
+  void forEach(F f) const {
+    if (root_) visit(*root_, [&](Entry const& e) { f(e.name, e.value); });
+  }
+
+private:
+  struct Entry {
+    size_t hash{};
+    std::string_view name;              // null data() if the slot is free
+    V value{};
+    bool used() const { return name.data() != nullptr; }
+  };
+
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+
+  struct Node {
+    size_t count{};                     // entries of the subtree
+    bool leaf{true};
+    std::vector<Entry> slots;           // if leaf, their number is a power of 2
+    std::vector<NodePtr> children;      // otherwise, Fanout children (null if empty)
+  };
+
+  static const unsigned Bits = 5, Fanout = 1 << Bits;
+  // the 60 high bits of the mixed hash are used by the nodes: the leaves of the last level
+  // are never split, they hold the entries whose hashes are the same
+  static const unsigned MaxLevel = 12;
+  static const size_t MinSlots = 8, LeafSlots = 32;
+
+  // the high bits of the product are used: the low bits of the hashes of the names of a
+  // MediaManager stripe are all the same
+  static uint64_t mix(size_t h) { return uint64_t(h) * 0x9E3779B97F4A7C15ull; }
+  static unsigned chunk(uint64_t m, unsigned level) { return unsigned(m >> (64 - Bits * (level + 1))) & (Fanout - 1); }
+
+  // first slot of the probe sequence in a leaf of level _level_: the bits of the mixed hash
+  // that follow those of the path to the leaf
+  static size_t home(Node const& leaf, unsigned level, uint64_t m) {
+    unsigned bits = unsigned(std::countr_zero(leaf.slots.size()));
+    return size_t((m << (Bits * level)) >> (64 - bits));
+  }
+
+  // slot of _name_ in _leaf_, or the free slot where it would be added
+  static size_t slot(Node const& leaf, unsigned level, uint64_t m, size_t h, std::string_view name) {
+    size_t mask = leaf.slots.size() - 1;
+    for (size_t i = home(leaf, level, m);; i = (i + 1) & mask) {
+      Entry const& e = leaf.slots[i];
+      if (!e.used() || (e.hash == h && e.name == name)) return i;
+    }
+  }
+
+  // puts the entries in a new table of _size_ slots
+  static void rehash(Node& leaf, unsigned level, size_t size) {
+    std::vector<Entry> entries(size);
+    entries.swap(leaf.slots);
+    for (auto& e : entries) {
+      if (e.used()) {
+        uint64_t m = mix(e.hash);
+        leaf.slots[slot(leaf, level, m, e.hash, e.name)] = std::move(e);
+      }
+    }
+  }
+
+  // returns a leaf of level _level_ that contains the entries of _node_
+  static NodePtr flatten(Node const& node, unsigned level) {
+    auto leaf = std::make_shared<Node>();
+    leaf->count = node.count;
+    size_t size = MinSlots;
+    while (size * 3 < node.count * 4) size *= 2;
+    leaf->slots.resize(size);
+    visit(node, [&](Entry const& e) { leaf->slots[slot(*leaf, level, mix(e.hash), e.hash, e.name)] = e; });
+    return leaf;
+  }
+
+  // returns a copy of _node_ (nullptr if empty) of level _level_ with _entry_
+  static NodePtr assign(Node const* node, unsigned level, uint64_t m, Entry&& entry, bool& added) {
+    auto copy = node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+    if (!copy->leaf) {
+      auto& child = copy->children[chunk(m, level)];
+      child = assign(child.get(), level + 1, m, std::move(entry), added);
+      if (added) ++copy->count;
+      return copy;
+    }
+
+    if (copy->slots.empty()) copy->slots.resize(MinSlots);
+    size_t i = slot(*copy, level, m, entry.hash, entry.name);
+    if (copy->slots[i].used()) {
+      copy->slots[i].value = std::move(entry.value);
+      return copy;
+    }
+    added = true;
+    if ((copy->count + 1) * 4 > copy->slots.size() * 3) {
+      if (copy->slots.size() < LeafSlots || level == MaxLevel) {
+        rehash(*copy, level, copy->slots.size() * 2);
+        i = slot(*copy, level, m, entry.hash, entry.name);
+      }
+      else {
+        // the leaf is split: its entries and the new one go to the leaves of the next level
+        auto split = std::make_shared<Node>();
+        split->leaf = false;
+        split->count = copy->count + 1;
+        split->children.resize(Fanout);
+        bool moved = false;
+        for (auto& e : copy->slots) {
+          if (!e.used()) continue;
+          uint64_t em = mix(e.hash);
+          auto& child = split->children[chunk(em, level)];
+          child = assign(child.get(), level + 1, em, std::move(e), moved);
+        }
+        auto& child = split->children[chunk(m, level)];
+        child = assign(child.get(), level + 1, m, std::move(entry), moved);
+        return split;
+      }
+    }
+    copy->slots[i] = std::move(entry);
+    ++copy->count;
+    return copy;
+  }
+
+  // returns _node_ without _name_ (_node_ itself if not found, nullptr if it is empty)
+  static NodePtr erase(NodePtr const& node, unsigned level, uint64_t m, std::string_view name, size_t h,
+                       std::string_view& key, bool& removed) {
+    if (!node) return node;
+    if (!node->leaf) {
+      unsigned c = chunk(m, level);
+      NodePtr child = erase(node->children[c], level + 1, m, name, h, key, removed);
+      if (!removed) return node;
+      if (node->count == 1) return nullptr;
+      auto copy = std::make_shared<Node>(*node);
+      copy->children[c] = std::move(child);
+      --copy->count;
+      // the node becomes a leaf again when its entries fill half a leaf
+      if (copy->count * 8 <= LeafSlots * 3) return flatten(*copy, level);
+      return copy;
+    }
+
+    size_t i = slot(*node, level, m, h, name);
+    if (!node->slots[i].used()) return node;
+    removed = true;
+    key = node->slots[i].name;
+    if (node->count == 1) return nullptr;
+
+    // backward shift: the following entries of the cluster are moved up if this slot is
+    // between their home and their position, so that no tombstone is needed
+    auto copy = std::make_shared<Node>(*node);
+    auto& slots = copy->slots;
+    size_t mask = slots.size() - 1;
+    for (size_t j = (i + 1) & mask; slots[j].used(); j = (j + 1) & mask) {
+      size_t k = home(*copy, level, mix(slots[j].hash));
+      if (((j - k) & mask) >= ((j - i) & mask)) {
+        slots[i] = std::move(slots[j]);
+        i = j;
+      }
+    }
+    slots[i] = Entry{};
+    --copy->count;
+    return copy;
+  }
+
+  // calls _f(entry)_ for each entry of the subtree
+  template <typename F>
+  static void visit(Node const& node, F&& f) {
+    if (node.leaf) {
+      for (auto& e : node.slots) if (e.used()) f(e);
+    }
+    else {
+      for (auto& child : node.children) if (child) visit(*child, f);
+    }
+  }
+
+  NodePtr root_;
+};
+
+#endif
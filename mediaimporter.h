@@ -0,0 +1,99 @@
+//
+//  mediaimporter: parallel import of a directory tree of media files into a MediaManager.
+//
+
+#ifndef __mediaimporter__
+#define __mediaimporter__
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MediaManager.h"
+#include "mediaprober.h"
+#include "workerpool.h"
+
+/// Imports the media files of a directory tree into a MediaManager.
+/// Each directory is read by a task of a WorkerPool, so that several directories are read at
+/// the same time and the import is limited by the disk rather than by a single thread.
+/// Files are classified by their extension (see type()): photos, videos and films (formats
+/// that usually have chapters). The metadata of the files are read by the same tasks (see
+/// MediaProber): the coordinates of the photos, the duration of the videos and the chapters
+/// of the films (a video with chapters is imported as a film). An object is named by the path
+/// of its file relative to the imported directory. Symbolic links are ignored, so that only
+/// files inside the imported directory are cataloged. Objects are added to the catalog by
+/// batches, each batch being published at once (see MediaManager::addObjects()).
+/// Progress counters can be read while the import runs.
+class MediaImporter {
+public:
+  /// Counters of an import.
+  struct Progress {
+    uint64_t directories{}, files{};           // read so far
+    uint64_t photos{}, videos{}, films{};       // media files found so far
+    uint64_t added{};                           // objects added to the catalog
+    uint64_t probed{};                          // media files whose metadata were read
+    uint64_t skipped{};                         // files that are not media files
+    uint64_t errors{};                          // directories that could not be read
+    bool running{};
+    double seconds{};                           // since the beginning of the import
+  };
+
+  /// The import uses _threadCount_ threads and adds the objects to _manager_ by batches of
+  /// _batchSize_ objects (_manager_ must outlive the importer).
+  MediaImporter(MediaManager& manager, unsigned threadCount = 2 * std::thread::hardware_concurrency(),
+                size_t batchSize = 4096);
+
+  /// Stops the current import (the directories that were not read yet are ignored).
+  ~MediaImporter();
+
+  /// Starts importing the directory tree at _root_ in the background.
+  /// @return false if _root_ is not a directory or if an import is already running.
+  bool start(std::string const& root);
+
+  /// Waits until the current import is complete.
+  void wait();
+
+  /// Returns the counters of the current (or last) import.
+  Progress progress() const;
+
+  /// Returns the type of object of a file according to its extension (case insensitive):
+  /// CatalogFile::PhotoType, VideoType or FilmType, or 0 if it is not a media file.
+  static int type(std::filesystem::path const& file);
+
+  /// Returns the prober of the importer, whose cache keeps the metadata of the imported files.
+  MediaProber& prober() { return prober_; }
+
+private:
+  struct Found {
+    std::string name;
+    MultimediaPtr object;
+  };
+
+  void scan(std::filesystem::path const& dir);
+  void add(std::vector<Found>& found, bool all);
+
+  MediaImporter(MediaImporter const&) = delete;
+  MediaImporter& operator=(MediaImporter const&) = delete;
+
+  MediaManager& manager_;
+  size_t batchSize_;
+  std::filesystem::path root_;
+  std::chrono::steady_clock::time_point started_, finished_;
+  std::atomic<uint64_t> directories_{0}, files_{0}, photos_{0}, videos_{0}, films_{0}, added_{0};
+  std::atomic<uint64_t> probed_{0}, skipped_{0}, errors_{0};
+  std::atomic<bool> stopping_{false};
+  mutable std::mutex mutex_;
+  std::condition_variable done_;
+  size_t pending_{};                  // directories that are queued or being read
+  bool running_{};
+  std::mutex batchMutex_;
+  std::vector<Found> batch_;          // objects that are not added yet
+  MediaProber prober_;
+  WorkerPool pool_;                   // destroyed first: its tasks use the other members
+};
+
+#endif
@@ -0,0 +1,68 @@
+//
+//  mediaprober: reads the metadata of media files (JPEG, MP4) through mmap, with a cache.
+//
+
+#ifndef __mediaprober__
+#define __mediaprober__
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Reads the metadata of media files and keeps them in a cache.
+/// The file is mapped in memory (mmap) and only the headers that are needed are read, so that
+/// probing a large video does not read its data:
+/// - JPEG: the dimensions of the image (SOF segment) and its GPS coordinates (EXIF segment),
+/// - MP4 / QuickTime: the duration of the movie (moov/mvhd) and its chapters, either Nero
+///   chapters (moov/udta/chpl) or a QuickTime chapter track (trak/tref/chap).
+///
+/// get() probes a file the first time it is asked for, then returns the cached metadata as
+/// long as the modification time and the size of the file are the same. It can be called by
+/// several threads at a time (e.g. by the tasks of a WorkerPool that probe in the background).
+class MediaProber {
+public:
+  enum Format : uint8_t { Unknown = 0, Jpeg, Mp4 };
+
+  /// Metadata of a file (the fields that do not apply to its format are 0).
+  struct Metadata {
+    Format format{};
+    uint32_t width{}, height{};         // JPEG
+    bool located{};                     // JPEG: the coordinates are known
+    double latitude{}, longitude{};     // in degrees, negative in the south and in the west
+    double duration{};                  // MP4: in seconds (from 0 to INT_MAX)
+    std::vector<int32_t> chapters;      // MP4: durations of the chapters in seconds (same bounds)
+  };
+
+  /// Reads the metadata of a file (without the cache).
+  /// @return false if the file can't be read or if its format is not recognized.
+  static bool probe(std::string const& path, Metadata& metadata);
+
+  /// Same as probe() on the content of a file.
+  static bool probe(const char* data, size_t size, Metadata& metadata);
+
+  /// Returns the metadata of a file, probed if they are not in the cache or if the file
+  /// was modified since. The format is Unknown if the file was not recognized.
+  /// @return nullptr if the file does not exist.
+  std::shared_ptr<const Metadata> get(std::string const& path);
+
+  /// Returns the number of files in the cache.
+  size_t size() const;
+
+  /// Empties the cache.
+  void clear();
+
+private:
+  struct Entry {
+    int64_t mtime{};
+    uint64_t size{};
+    std::shared_ptr<const Metadata> metadata;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> cache_;
+};
+
+#endif
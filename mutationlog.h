@@ -0,0 +1,91 @@
+//
+//  mutationlog: append-only log of mutations with checksums and group commit.
+//
+
+#ifndef __mutationlog__
+#define __mutationlog__
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+/// Append-only log of records (write-ahead log).
+/// Each record has a sequence number and a checksum (CRC-32), so that a record that was only
+/// partly written when the process died is detected when the log is opened: the log is
+/// truncated before it. Records are buffered and written by batches: a single write() and
+/// fdatasync() make durable all the records appended since the previous batch (group commit).
+/// Batches are either written by a background thread every _syncInterval_ ms (records appended
+/// during the last interval can be lost), or by the appenders themselves if _syncInterval_
+/// is 0: commit() then returns once the record is durable, and appenders that wait at the same
+/// time share the same fdatasync().
+/// The beginning of the log can be discarded once its records are saved elsewhere
+/// (e.g. in a snapshot), see discard() and setCompaction().
+/// @note only available on POSIX systems (open() returns nullptr on Windows).
+class MutationLog {
+public:
+  /// Opens or creates the log at _path_ and calls _replay(sequence, payload)_ for each record
+  /// whose sequence is at least _first_, in the order of the log. Sequences of new records
+  /// start after the last record and after _first_ - 1.
+  /// @return nullptr on error.
+  static std::unique_ptr<MutationLog> open(std::string const& path, unsigned syncInterval, uint64_t first,
+                                           std::function<void(uint64_t, std::string_view)> const& replay);
+
+  /// Writes the records that are still buffered, then stops the threads of the log.
+  ~MutationLog();
+
+  /// Appends a record, returns its sequence.
+  uint64_t append(std::string_view payload);
+
+  /// Waits until the record _sequence_ is durable if the log is synchronous (_syncInterval_
+  /// is 0), returns immediately otherwise.
+  /// @return false if the log could not be written.
+  bool commit(uint64_t sequence);
+
+  /// Makes all the records appended so far durable.
+  /// @return false if the log could not be written.
+  bool sync();
+
+  /// Returns the sequence of the last record (or _first_ - 1) and the position that
+  /// follows it in the log, which can be given to discard().
+  uint64_t checkpoint(uint64_t& position) const;
+
+  /// Removes the records that precede _position_ (see checkpoint()).
+  /// Records can be appended and written meanwhile. @return false on error (or if another
+  /// discard() is running).
+  bool discard(uint64_t position);
+
+  /// Calls _compact_ on a background thread when the log grows beyond _maxSize_ bytes
+  /// (_compact_ is expected to call discard()). 0 means never.
+  void setCompaction(uint64_t maxSize, std::function<void()> const& compact);
+
+  /// Returns the size of the log in bytes (including the records that are not written yet).
+  uint64_t size() const;
+
+private:
+  MutationLog() = default;
+  MutationLog(MutationLog const&) = delete;
+  MutationLog& operator=(MutationLog const&) = delete;
+  bool flush(std::unique_lock<std::mutex>& lock, uint64_t sequence);
+  void run();
+
+  std::string path_;
+  int fd_{-1};
+  unsigned syncInterval_{};
+  mutable std::mutex mutex_;
+  std::condition_variable synced_, wakeup_;
+  std::string buffer_;                // records that are not written yet
+  uint64_t written_{};                // size of the file (with the batch being written)
+  uint64_t next_{1};                  // sequence of the next record
+  uint64_t durable_{};                // sequence of the last durable record
+  bool syncing_{}, failed_{}, stopping_{}, compacting_{}, discarding_{};
+  uint64_t maxSize_{};
+  std::function<void()> compact_;
+  std::thread flusher_;               // syncs every _syncInterval_
+  std::thread compactor_;             // runs the compactions
+};
+
+#endif
@@ -0,0 +1,90 @@
+//
+//  objectpool: pools of fixed-size blocks for the objects of a catalog.
+//
+
+#ifndef __objectpool__
+#define __objectpool__
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// Storage of blocks that all have the same size (the size of the first block allocated).
+/// The blocks are carved out of large chunks, one after the other: the objects of a pool are
+/// contiguous in memory, allocating a block only bumps a pointer (or reuses a freed block), and
+/// the chunks are all freed at once when the pool is destroyed.
+/// Thread-safe.
+class ObjectPool {
+public:
+  ObjectPool() = default;
+
+  /// Frees the chunks: the blocks must all have been deallocated.
+  ~ObjectPool();
+
+  /// Returns a block of _size_ bytes, or nullptr if _size_ is not the size of the blocks of
+  /// the pool (the caller must then allocate the memory itself).
+  void* allocate(size_t size);
+
+  /// Gives back _p_, which was allocated with _size_ bytes: returns false if it does not come
+  /// from the pool (nullptr was returned by allocate()).
+  bool deallocate(void* p, size_t size);
+
+  /// Returns the number of blocks in use.
+  size_t size() const;
+
+  /// Returns the number of bytes of the chunks.
+  size_t capacity() const;
+
+private:
+  static constexpr size_t FirstChunk = 64;    // blocks of the first chunk
+  static constexpr size_t MaxChunk = 4096;    // chunks double up to this number of blocks
+
+  ObjectPool(ObjectPool const&) = delete;
+  ObjectPool& operator=(ObjectPool const&) = delete;
+
+  mutable std::mutex mutex_;
+  size_t blockSize_ = 0;                      // 0 until the first allocation
+  std::vector<std::unique_ptr<std::byte[]>> chunks_;
+  size_t chunkBlocks_ = FirstChunk;           // blocks of the next chunk
+  size_t capacity_ = 0;
+  std::byte* next_ = nullptr;                 // first block never allocated in the last chunk
+  std::byte* end_ = nullptr;
+  void* free_ = nullptr;                      // freed blocks, each points to the next one
+  size_t used_ = 0;
+};
+
+
+/// Allocator of the blocks of a pool, for std::allocate_shared: the object and its control
+/// block are then stored in a single block of the pool. Each copy of the allocator (there is
+/// one in each control block) keeps the pool alive, so that objects can outlive their owner.
+/// Other allocations (arrays, or types of another size than the blocks) use operator new.
+template <typename T>
+class PoolAllocator {
+public:
+  using value_type = T;
+
+  explicit PoolAllocator(std::shared_ptr<ObjectPool> pool) : pool_(std::move(pool)) {}
+  template <typename U>
+  PoolAllocator(PoolAllocator<U> const& other) : pool_(other.pool_) {}
+
+  T* allocate(size_t n) {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "blocks are aligned on max_align_t");
+    if (n == 1) {
+      if (void* p = pool_->allocate(sizeof(T))) return static_cast<T*>(p);
+    }
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (n != 1 || !pool_->deallocate(p, sizeof(T))) std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(PoolAllocator<U> const& other) const { return pool_ == other.pool_; }
+
+private:
+  template <typename U> friend class PoolAllocator;
+  std::shared_ptr<ObjectPool> pool_;
+};
+
+#endif
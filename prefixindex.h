@@ -0,0 +1,57 @@
+//
+//  prefixindex: persistent compressed trie of names for prefix searches.
+//
+
+#ifndef __prefixindex__
+#define __prefixindex__
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Set of names that can be searched by prefix.
+/// The names are stored in a compressed trie (radix tree): each edge is labelled with a string
+/// and every node that is not a name has at least two children, hence a search costs time
+/// proportional to the length of the prefix and the number of names found, whatever the number
+/// of names in the index.
+///
+/// The index is persistent: nodes are never modified once created, insert() and erase() return
+/// a new index that shares all the nodes with this one except those on the path of the name.
+/// An index can therefore be read by several threads while new versions are built.
+class PrefixIndex {
+public:
+  /// Creates an empty index.
+  PrefixIndex();
+
+  /// Returns an index that also contains _name_.
+  PrefixIndex insert(std::string_view name) const;
+
+  /// Returns an index that also contains _names_. Each node is copied once, whatever the
+  /// number of names inserted below it.
+  PrefixIndex insert(std::vector<std::string_view> names) const;
+
+  /// Returns an index that does not contain _name_.
+  PrefixIndex erase(std::string_view name) const;
+
+  /// Returns the names that start with _prefix_ in lexicographic order,
+  /// at most _limit_ names if _limit_ is not 0.
+  std::vector<std::string> find(std::string_view prefix, size_t limit = 0) const;
+
+  /// Returns the number of names.
+  size_t size() const { return size_; }
+
+private:
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+
+  PrefixIndex(NodePtr root, size_t size) : root_(std::move(root)), size_(size) {}
+  static NodePtr insert(NodePtr const& node, std::string_view rest, bool& added);
+  static void insert(Node& node, std::string_view* first, std::string_view* last, size_t& added);
+  static NodePtr erase(NodePtr const& node, std::string_view rest, bool root, bool& removed);
+  static void collect(Node const& node, std::string& name, size_t limit, std::vector<std::string>& names);
+
+  NodePtr root_;                        // its label is always empty
+  size_t size_{};
+};
+
+#endif
@@ -6,19 +6,39 @@
 
 #ifndef __tcpserver__
 #define __tcpserver__
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <functional>
+#include <unordered_set>
+#include <vector>
 #include "ccsocket.h"
+#include "timerwheel.h"
 
 class TCPConnection;
-class TCPLock;
+class EventLoop;
+class SocketCnx;
+class WorkerPool;
+struct EventCnx;
+struct FileTransfer;
 
 /// TCP/IP IPv4 server.
-/// Supports TCP/IP AF_INET IPv4 connections with multiple clients. One thread is used per client.
+/// Supports TCP/IP AF_INET IPv4 connections with multiple clients, and AF_UNIX connections
+/// with clients running on the same host, see setLocalPath().
+/// By default one thread is used per client, see TCPServer::Mode.
 class TCPServer {
 public:
 
+  /// How client connections are served.
+  /// - ThreadPerClient (the default): each connection has its own thread and blocking socket.
+  /// - EventDriven: connections are served by a small fixed number of event loops using
+  ///   non-blocking sockets and edge-triggered epoll (only available on Linux,
+  ///   ThreadPerClient is used otherwise).
+  enum Mode { ThreadPerClient, EventDriven };
+
   using Callback =
   std::function< bool(std::string const& request, std::string& response) >;
 
@@ -27,27 +47,202 @@ public:
   /// - _request_ contains the data sent by the client
   /// - _response_ will be sent to the client as a response
   /// The connection with the client is closed if the callback returns false.
-  TCPServer(Callback const& callback);
+  ///
+  /// _mode_ selects how connections are served. In EventDriven mode, _loopCount_ is the number
+  /// of event loops (and thus of threads) serving the connections, 0 meaning one per core.
+  /// The callback is then called by these threads.
+  TCPServer(Callback const& callback, Mode mode = ThreadPerClient, unsigned loopCount = 0);
 
   virtual ~TCPServer();
 
   /// Starts the server.
   /// Binds an internal ServerSocket to _port_ then starts an infinite loop that processes connection
   /// requests from clients.
-  /// @return 0 on normal termination, or a negative value if the ServerSocket could not be bound
-  /// (value is then one of Socket::Errors).
-  virtual int run(int port);
+  ///
+  /// If _shards_ > 1, _shards_ ServerSockets are bound to _port_ with the SO_REUSEPORT option
+  /// (the kernel then distributes new connections between them) and each of them has its own
+  /// accepting thread pinned to its own core (the thread that calls run() only waits for them,
+  /// so its affinity is not changed). In EventDriven mode, each shard also has its own
+  /// event loops (the loop count is divided between shards) running on the same core.
+  /// In ThreadPerClient mode, the threads of the clients run on the core of their shard.
+  /// Only one shard is used if SO_REUSEPORT is not available.
+  /// @return 0 on normal termination (see stop()), or a negative value if the ServerSocket could
+  /// not be bound (value is then one of Socket::Errors).
+  virtual int run(int port, unsigned shards = 1);
+
+  /// Stops the server (graceful drain).
+  /// The server stops accepting connections (run() then returns) and reading new requests.
+  /// The requests that are being processed can complete and their responses are sent until
+  /// _timeout_ (in milliseconds) expires, then all the connections are closed. This function
+  /// returns once all the connections have been closed and their threads joined, which requires
+  /// the callbacks that are still running to return.
+  /// @return true if all the connections were closed before _timeout_ expired.
+  /// @note must not be called by the callback.
+  bool stop(int timeout = 5000);
+
+  /// Response sent to clients that are rejected by admission control, see setMaxConnections()
+  /// and setMaxInFlight().
+  static const char* const BusyResponse;
+
+  /// Changes the maximum number of connections (0, the default, means no limit).
+  /// When this limit is reached, new clients receive the BusyResponse line and are disconnected
+  /// immediately, so that the server keeps serving the connected clients.
+  void setMaxConnections(size_t count);
+  size_t maxConnections() const { return maxConnections_; }
+
+  /// Changes the maximum number of requests processed at the same time (0, the default, means
+  /// no limit). When this limit is reached, new requests are not processed: their response is
+  /// the BusyResponse, so that clients can retry later or elsewhere instead of waiting.
+  void setMaxInFlight(size_t count);
+  size_t maxInFlight() const { return maxInFlight_; }
+
+  /// Returns the number of connections.
+  size_t connectionCount() const { return connectionCount_; }
+
+  /// Connection timeouts, in milliseconds (0, the default, means no timeout).
+  /// - idle: maximum time without receiving any request (while no request is in progress)
+  /// - read: maximum time for receiving the rest of a request once its first bytes have arrived,
+  ///   so that clients that send their requests very slowly do not hold connections
+  /// - write: maximum time for sending responses to a client that does not read them
+  /// Connections that exceed a timeout are closed. The time spent processing requests is not
+  /// limited. The deadlines of all the connections are tracked by a single TimerWheel (one thread
+  /// for the server, O(1) per deadline) with a resolution of TimerTick milliseconds. Postponing
+  /// the deadline of a connection after each request does not lock the wheel: the timer of the
+  /// connection checks its deadline when it expires.
+  /// In ThreadPerClient mode, requests are read by blocking calls: the idle timeout then also
+  /// limits the time for receiving a request and the read timeout is not used.
+  /// @note must be called before run().
+  /// @{
+  void setIdleTimeout(int timeout);
+  void setReadTimeout(int timeout);
+  void setWriteTimeout(int timeout);
+  int idleTimeout() const { return idleTimeout_; }
+  int readTimeout() const { return readTimeout_; }
+  int writeTimeout() const { return writeTimeout_; }
+  static constexpr int TimerTick = 50;
+  /// @}
+
+  /// Binary framing.
+  /// Clients use the line protocol by default: each request and each response is a line
+  /// (the \\n and \\r characters of responses are replaced by spaces).
+  /// A client that sends the BinaryFramingRequest line ("FRAMING BINARY") receives the line "OK"
+  /// then exchanges frames (see SocketBuffer::readFrame()) with the server: requests are sent
+  /// with the RequestFrame opcode and responses have the ResponseFrame opcode. Responses are
+  /// then sent as they are, without being scanned nor modified.
+  /// @{
+  enum FrameOpcode { RequestFrame = 1, ResponseFrame = 2, FileFrame = 3 };
+  static const char* const BinaryFramingRequest;
+  /// @}
+
+  /// Function that returns the _path_ of the file that corresponds to _name_ (false if none).
+  using FileResolver = std::function< bool(std::string const& name, std::string& path) >;
+
+  /// Enables the FETCH command, which streams the content of files to clients.
+  /// FETCH requests ("FETCH name [offset length]") are handled by the server (the callback
+  /// is not called): _resolver_ gives the file that corresponds to _name_, then the server responds
+  /// "OK offset length size" (or "ERROR message") followed by _length_ bytes of the file starting
+  /// at _offset_ (up to the end of the file by default). These bytes are sent as they are in line
+  /// mode and as a FileFrame in binary mode (nothing follows if _length_ is 0). Since the length
+  /// of a frame has 32 bits, at most 4 GiB - 1 are sent at once: larger files are read by ranges.
+  /// On Linux, files are sent by sendfile() from the page cache, without being copied in user space,
+  /// and in EventDriven mode large transfers do not block the other connections.
+  /// SIGPIPE signals are then ignored by the process (sendfile() can't disable them).
+  /// @note must be called before run().
+  void setFileResolver(FileResolver const& resolver);
+  FileResolver const& fileResolver() const { return fileResolver_; }
+
+  /// Also listens on the Local (AF_UNIX) socket _path_ (Unix/Linux only).
+  /// Clients running on the same host can then connect to _path_ (see Socket::connect(path))
+  /// instead of the TCP port, so that their requests do not go through the TCP/IP stack.
+  /// These connections are served in the same way as TCP connections. An empty _path_ (the
+  /// default) disables the Local socket.
+  /// @note must be called before run().
+  void setLocalPath(std::string const& path);
+  std::string const& localPath() const { return localPath_; }
+
+  /// Returns the mode used for serving connections.
+  Mode mode() const { return mode_; }
+
+  /// Changes the number of worker threads that execute the callback.
+  /// By default (_count_ = 0), the callback is called by the thread that reads the requests,
+  /// (the thread of the client in ThreadPerClient mode, an event loop in EventDriven mode).
+  /// Otherwise requests are processed by a fixed pool of _count_ threads, so that slow requests
+  /// do not stall the event loops and the number of busy threads is bounded.
+  /// @note must be called before run().
+  void setWorkerCount(unsigned count);
+  unsigned workerCount() const { return workerCount_; }
+
+  /// Changes the maximum number of requests waiting for a worker (0, the default, means no limit).
+  /// When this limit is reached, no more requests are read from the clients that send new
+  /// requests until some room is available, so that these clients are pushed back by TCP flow
+  /// control. Only meaningful if setWorkerCount() > 0.
+  /// @note must be called before run().
+  void setMaxQueuedRequests(size_t count);
+  size_t maxQueuedRequests() const { return maxQueued_; }
 
 private:
-  friend class TCPLock;
   friend class SocketCnx;
+  friend class EventLoop;
+  friend struct EventCnx;
 
   TCPServer(TCPServer const&) = delete;
   TCPServer& operator=(TCPServer const&) = delete;
   void error(std::string const& msg);
+  bool processRequest(std::string const& request, std::string& response);
+  bool processRequests(std::vector<std::string> const& requests, std::vector<std::string>& responses,
+                       bool lines, FileTransfer* transfer);
+  void openFile(std::string const& request, std::string& response, FileTransfer& transfer);
+  void acceptConnections(ServerSocket& servsock, size_t firstLoop, size_t loopCount);
+  bool admit(Socket* socket);
+
+  // deadline that is currently enforced for a connection
+  enum Deadline { NoDeadline, IdleDeadline, ReadDeadline, WriteDeadline };
+
+  // timer that closes a connection when its deadline has passed. Setting a deadline only
+  // updates _deadline_, unless the timer would expire after it: the timer checks the current
+  // deadline when it expires and reschedules itself if the deadline has been postponed
+  struct ConnectionTimer {
+    TimerWheel::Timer timer;
+    std::atomic<uint64_t> deadline{NoDeadline};   // Deadline, and its start in ms above 2 bits
+    std::atomic<int64_t> expires{0};              // in ms, 0 if the timer is not pending
+  };
+  void initDeadline(ConnectionTimer& timer, Socket* socket);
+  void setDeadline(ConnectionTimer& timer, Deadline deadline);
+  void cancelDeadline(ConnectionTimer& timer);
+  int timeoutOf(Deadline deadline) const;
+  void release(SocketCnx* cnx);
+  void reapConnections();
+
+  // maximum number of pipelined requests that are processed together
+  static const size_t MaxBatch = 256;
 
   ServerSocket servsock_;
+  std::vector<ServerSocket*> shardSockets_;   // sockets of the other shards (see run())
+  ServerSocket localsock_{Socket::Local};
+  std::string localPath_;
   Callback callback_{};
+  Mode mode_{ThreadPerClient};
+  unsigned loopCount_{};
+  std::vector<EventLoop*> loops_;
+  unsigned workerCount_{};
+  size_t maxQueued_{};
+  WorkerPool* pool_{};
+  FileResolver fileResolver_{};
+
+  // admission control and drain
+  size_t maxConnections_{}, maxInFlight_{};
+  std::atomic<size_t> connectionCount_{0}, inFlight_{0};
+  std::atomic<bool> stopRequested_{false};             // set by the first call to stop()
+  std::chrono::steady_clock::time_point deadline_{};  // of the drain, set once before stopping_
+  std::atomic<bool> stopping_{false};                 // publishes deadline_
+  std::mutex cnxMutex_;
+  std::condition_variable cnxReleased_;
+  std::unordered_set<SocketCnx*> connections_;         // ThreadPerClient connections
+  std::vector<SocketCnx*> finished_;                   // their threads must be joined
+
+  // connection timeouts
+  int idleTimeout_{}, readTimeout_{}, writeTimeout_{};
+  TimerWheel* timers_{};
 };
 
 #endif
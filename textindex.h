@@ -0,0 +1,90 @@
+//
+//  textindex: inverted index of the words of names and file paths.
+//
+
+#ifndef __textindex__
+#define __textindex__
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Inverted index: for each word (term), the sorted ids of the documents that contain it.
+///
+/// Posting lists are compressed: they are split in blocks of at most 128 ids, each block stores
+/// its first id and the differences between the next ids as varints (1 byte for close ids).
+/// Blocks also serve as skip lists: a multi-term query walks the shortest list and jumps over
+/// the blocks of the other lists that can't contain the current id.
+///
+/// The index is persistent, like PrefixIndex: add() and remove() return a new index and leave
+/// this one unchanged. As ids only increase, posting lists are shared by all the versions and
+/// only grow, each version knowing how many ids of each list it contains; terms are stored in
+/// a persistent hash trie (only the path of a term is copied). Removed documents stay in the
+/// lists (tombstones) and are skipped by the versions that follow their removal, until most
+/// documents are removed and the lists are compacted.
+///
+/// add() and remove() must not be called concurrently and only on the latest version; all the
+/// versions can be read concurrently. Names are views: they must outlive the index (see NamePool).
+class TextIndex {
+public:
+  struct Stats {
+    size_t terms{};                     // distinct terms
+    size_t documents{};                 // documents in the posting lists, removed ones included
+    size_t removed{};                   // removed documents that are still in the posting lists
+    size_t postings{};                  // ids in the posting lists
+    size_t bytes{};                     // memory used by the posting lists
+  };
+
+  /// Creates an empty index.
+  TextIndex();
+
+  /// Splits _text_ into lowercase terms (sequences of letters and digits), without duplicates.
+  static std::vector<std::string> tokenize(std::string_view text);
+
+  /// Returns an index that also contains the document _name_ made of the terms of _text_.
+  /// _id_ is set to the id of the document, which is given to remove().
+  TextIndex add(std::string_view name, std::string_view text, uint32_t& id) const;
+
+  /// Same as add() for several documents (_names_[k] is made of the terms of _texts_[k]), whose
+  /// ids are _first_, _first_ + 1, etc. Each term is updated once.
+  TextIndex add(std::span<const std::string_view> names, std::span<const std::string> texts,
+                uint32_t& first) const;
+
+  /// Returns an index that does not contain document _id_.
+  TextIndex remove(uint32_t id) const;
+
+  /// Calls _f(name)_ for each document that contains all the terms of _query_, by increasing id,
+  /// until _f_ returns false.
+  void find(std::string_view query, std::function<bool(std::string_view)> const& f) const;
+
+  /// Returns statistics about the index (it visits all the terms).
+  Stats stats() const;
+
+private:
+  struct Document;
+  struct Documents;
+  struct Block;
+  struct Postings;
+  struct Term;
+  struct Node;
+  class Cursor;
+  using NodePtr = std::shared_ptr<const Node>;
+
+  static Term const* lookup(Node const* node, std::string_view text, uint64_t hash);
+  static NodePtr assign(NodePtr const& node, unsigned shift, Term const& term);
+  static NodePtr assign(NodePtr const& node, unsigned shift, Term const* first, Term const* last);
+  static void visit(Node const& node, std::function<void(Term const&)> const& f);
+  bool visible(uint32_t id) const;
+  void compact();
+
+  std::shared_ptr<Documents> documents_; // shared by all the versions
+  NodePtr terms_;                       // hash trie of the terms
+  size_t termCount_{}, postings_{}, removed_{};
+  uint32_t documentCount_{};            // documents in the posting lists
+  uint64_t version_{};
+};
+
+#endif
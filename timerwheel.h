@@ -0,0 +1,101 @@
+//
+//  timerwheel: hierarchical timer wheel driven by a single thread.
+//
+
+#ifndef __timerwheel__
+#define __timerwheel__
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/// Hierarchical timer wheel.
+/// Timers are stored in the slots of 4 wheels of 64 slots: the first wheel has one slot per tick,
+/// each slot of the next wheels covers 64 times more ticks. Scheduling and cancelling a timer
+/// costs O(1) whatever the number of timers, and a timer is moved at most 3 times to a lower
+/// wheel before it expires. A single thread advances the wheels every tick and calls the
+/// callbacks of the expired timers, so that many deadlines (e.g. one per connection) can be
+/// enforced without a thread or a kernel timer each.
+class TimerWheel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /// Timer that can be scheduled on a TimerWheel.
+  /// A Timer must be cancelled before being destroyed (unless it is not pending).
+  class Timer {
+  public:
+    /// _callback_ is called by the thread of the wheel when the timer expires. It must not call
+    /// the methods of the wheel (they would deadlock) and should return quickly.
+    /// It returns 0, or the delay after which the timer expires again: a deadline that is often
+    /// postponed can thus be checked when its timer expires instead of rescheduling the timer
+    /// (and locking the wheel) every time.
+    using Callback = std::function<std::chrono::milliseconds()>;
+    explicit Timer(Callback const& callback = nullptr) : callback_(callback) {}
+
+    void setCallback(Callback const& callback) { callback_ = callback; }
+
+    /// Returns true if the timer is scheduled and has not expired yet.
+    bool pending() const { return slot_ != nullptr; }
+
+  private:
+    friend class TimerWheel;
+    Timer(Timer const&) = delete;
+    Timer& operator=(Timer const&) = delete;
+    Callback callback_;
+    Timer* prev_{};
+    Timer* next_{};
+    Timer** slot_{};        // list that contains this timer (nullptr if not pending)
+    uint64_t expires_{};    // in ticks
+  };
+
+  /// Starts the thread of the wheel, which advances every _tick_.
+  /// Timers expire at most one tick late.
+  TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(50));
+
+  /// Stops the thread of the wheel, pending timers are not called.
+  ~TimerWheel();
+
+  /// (Re)schedules _timer_ so that it expires in _delay_.
+  void schedule(Timer& timer, std::chrono::milliseconds delay);
+
+  /// Cancels _timer_ if it is pending.
+  /// When this function returns, the callback of _timer_ is not running and won't be called
+  /// (unless the timer is scheduled again), hence its data can be destroyed safely.
+  void cancel(Timer& timer);
+
+  /// Returns the duration of a tick.
+  std::chrono::milliseconds tick() const { return tick_; }
+
+  /// Returns the number of pending timers.
+  size_t size() const;
+
+private:
+  static const unsigned Levels = 4;
+  static const unsigned SlotBits = 6;
+  static const unsigned Slots = 1 << SlotBits;
+
+  uint64_t ticks(Clock::time_point t) const;
+  uint64_t delay(std::chrono::milliseconds delay) const;
+  void add(Timer& timer);
+  void remove(Timer& timer);
+  unsigned cascade(unsigned level, unsigned index);
+  void advance(uint64_t now);
+  void run();
+
+  TimerWheel(TimerWheel const&) = delete;
+  TimerWheel& operator=(TimerWheel const&) = delete;
+
+  std::chrono::milliseconds tick_;
+  Clock::time_point start_;
+  uint64_t current_{};                  // next tick to process
+  size_t size_{};
+  Timer* wheels_[Levels][Slots]{};
+  mutable std::mutex mutex_;            // protects the wheels, also held while callbacks run
+  std::condition_variable stopped_;
+  bool stopping_{};
+  std::thread thread_;
+};
+
+#endif
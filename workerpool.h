@@ -0,0 +1,78 @@
+//
+//  workerpool: fixed-size thread pool with work stealing.
+//
+
+#ifndef __workerpool__
+#define __workerpool__
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed-size pool of worker threads.
+/// Each worker has its own deques of tasks: tasks submitted by a worker are pushed on its own
+/// deque of spawned tasks, other tasks are distributed in turn on the deques of submitted tasks.
+/// A worker runs the most recent task that it spawned, otherwise the oldest submitted task of its
+/// own deque, and steals the oldest task of another worker when it has none (submitted tasks
+/// first): submitted tasks, e.g. client requests, run in order and old ones can't starve.
+/// The number of waiting tasks can be bounded so that producers are pushed back instead of
+/// letting the queues grow without limit.
+class WorkerPool {
+public:
+  using Task = std::function<void()>;
+
+  /// Starts _workerCount_ threads (at least 1).
+  /// At most _maxQueued_ tasks can wait for a worker, 0 meaning no limit.
+  WorkerPool(unsigned workerCount, size_t maxQueued = 0);
+
+  /// Runs the tasks that are still queued then joins the workers.
+  ~WorkerPool();
+
+  /// Queues a task unless _maxQueued_ tasks are already waiting.
+  /// @return false if the task was not queued.
+  bool trySubmit(Task task);
+
+  /// Queues a task, blocks the caller while _maxQueued_ tasks are already waiting.
+  void submit(Task task);
+
+  /// Returns the number of worker threads.
+  unsigned workerCount() const { return unsigned(workers_.size()); }
+
+  /// Returns the maximum number of waiting tasks (0 if unbounded).
+  size_t maxQueued() const { return maxQueued_; }
+
+  /// Returns the number of tasks waiting for a worker.
+  size_t queued() const { return size_t(std::max(0L, queued_.load())); }
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> spawned;         // pushed by the worker itself, run newest first
+    std::deque<Task> submitted;       // pushed by other threads, run oldest first
+    std::thread thread;
+  };
+
+  bool reserve();
+  void push(Task&& task);
+  bool pop(size_t index, Task& task);
+  void run(size_t index);
+
+  WorkerPool(WorkerPool const&) = delete;
+  WorkerPool& operator=(WorkerPool const&) = delete;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  size_t maxQueued_{};
+  std::atomic<long> queued_{0};       // tasks that were reserved and not yet started
+  std::atomic<size_t> next_{0};       // next deque for tasks submitted by other threads
+  std::atomic<int> blocked_{0};       // threads waiting in submit()
+  std::mutex mutex_;                  // used for sleeping only
+  std::condition_variable workAvailable_, spaceAvailable_;
+  bool stopping_{};
+};
+
+#endif